@@ -61,3 +61,10 @@ void bg_flac_set_callbacks(bg_flac_t * flac,
                            void * priv);
 
 void bg_flac_set_sink(bg_flac_t * flac, gavl_packet_sink_t * psink);
+
+/* Continue encoding an existing file. Must be called before
+   bg_flac_start_uncompressed(). Returns the file position, where the
+   new frames must be written and the number of samples before that */
+
+int bg_flac_resume(bg_flac_t * flac, const char * filename,
+                   int64_t * end_pos, int64_t * samples);
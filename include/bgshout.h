@@ -31,16 +31,29 @@ const bg_parameter_info_t * bg_shout_get_parameters(void);
 void bg_shout_set_parameter(void * data, const char * name,
                             const gavl_value_t * val);
 
+/* Take server, port, mount, user and password from an URL */
+void bg_shout_set_url(bg_shout_t * s, const char * url);
+
 void bg_shout_set_metadata(bg_shout_t * s, const gavl_dictionary_t * m);
 
+/* Connects and starts the sender thread */
 int bg_shout_open(bg_shout_t *);
 
 void bg_shout_update_metadata(bg_shout_t *, const gavl_dictionary_t * m);
 
-void bg_shout_destroy(bg_shout_t *);
-
+/* Queues a complete block or drops it, if the send queue is full (and
+   queue_wait is not set). Returns 0 if the connection is lost and
+   cannot be restored */
 int bg_shout_write(bg_shout_t *, const uint8_t * data, int len);
 
+/* After reconnecting, ogg streams must be restarted with the headers.
+   bg_shout_write() discards the data until bg_shout_resume() is called */
+int bg_shout_reconnected(bg_shout_t *);
+void bg_shout_resume(bg_shout_t *);
+
+/* Send the queued data and close the connection */
+void bg_shout_close(bg_shout_t *);
+
 /* Also closes */
 void bg_shout_destroy(bg_shout_t *);
 
@@ -36,3 +36,109 @@ bgen_id3v1_t * bgen_id3v1_create(const gavl_dictionary_t*);
 int bgen_id3v1_write(gavl_io_t * output, const bgen_id3v1_t *);
 
 void bgen_id3v1_destroy(bgen_id3v1_t *);
+
+/* ID3V2 tag followed by padding bytes. The padding is the sum of
+   a fixed size and a percentage of the tag size. */
+
+int bgen_id3v2_write(gavl_io_t * output, const gavl_dictionary_t * m,
+                     int add_cover, int charset,
+                     int padding, int padding_percent);
+
+/* Replace the ID3V2 tag at the start of an existing file. Succeeds
+   only if the new tag fits into the space of the old one including
+   the padding. Otherwise 0 is returned and the file must be
+   rewritten completely. */
+
+int bgen_id3v2_update(const char * filename, const gavl_dictionary_t * m,
+                      int add_cover, int charset);
+
+/* Seek index with bounded memory. At most max_entries points are
+   kept. New points must be at least the average distance of the
+   existing ones apart. If the index is full, every other entry is
+   dropped, which doubles the distance. */
+
+typedef struct
+  {
+  int64_t time;     /* Samples or frames */
+  int64_t position; /* Bytes */
+  int duration;
+  } bgen_seek_point_t;
+
+typedef struct
+  {
+  bgen_seek_point_t * points;
+  int num_points;
+  int max_points;
+  
+  int64_t spacing;
+  } bgen_seek_index_t;
+
+void bgen_seek_index_init(bgen_seek_index_t * idx, int max_points);
+
+void bgen_seek_index_append(bgen_seek_index_t * idx,
+                            int64_t time, int64_t position, int duration);
+
+/* Last point with a time <= the given time */
+const bgen_seek_point_t *
+bgen_seek_index_lookup(const bgen_seek_index_t * idx, int64_t time);
+
+void bgen_seek_index_free(bgen_seek_index_t * idx);
+
+/* Encoder thread (framequeue.c). The frames passed to the returned
+   sink are encoded by the sink of the codec in a separate thread */
+
+typedef struct bgen_frame_queue_s bgen_frame_queue_t;
+
+bgen_frame_queue_t * bgen_frame_queue_create_audio(gavl_audio_sink_t * sink);
+bgen_frame_queue_t * bgen_frame_queue_create_video(gavl_video_sink_t * sink);
+
+gavl_audio_sink_t * bgen_frame_queue_get_audio_sink(bgen_frame_queue_t * q);
+gavl_video_sink_t * bgen_frame_queue_get_video_sink(bgen_frame_queue_t * q);
+
+/* Wait until all queued frames are encoded. Returns 0 if
+   the codec failed */
+int bgen_frame_queue_sync(bgen_frame_queue_t * q);
+
+/* Encode the remaining frames and terminate the thread. Returns 0
+   if the codec failed */
+int bgen_frame_queue_finish(bgen_frame_queue_t * q);
+
+void bgen_frame_queue_destroy(bgen_frame_queue_t * q);
+
+/* Parallel jobs (jobqueue.c). The caller owns a ring of num_jobs jobs,
+   which are identified by their index. Jobs are filled by the
+   application, submitted, processed by one of num_threads worker
+   threads and released in ring order. process() is called from the
+   worker threads with the job and thread index and returns 1 on
+   success. */
+
+typedef struct bgen_job_queue_s bgen_job_queue_t;
+
+bgen_job_queue_t *
+bgen_job_queue_create(int num_threads, int num_jobs,
+                      int (*process)(void * priv, int job, int thread),
+                      void * priv);
+
+/* Submitted jobs, which are not released yet */
+int bgen_job_queue_num_used(bgen_job_queue_t * q);
+
+/* Index of the nth submitted job (0 = oldest) */
+int bgen_job_queue_get_job(bgen_job_queue_t * q, int n);
+
+/* Index of the job after the submitted ones or -1 if all jobs
+   are in use */
+int bgen_job_queue_get_free(bgen_job_queue_t * q);
+
+/* Submit the job returned by bgen_job_queue_get_free() */
+void bgen_job_queue_submit(bgen_job_queue_t * q);
+
+/* Check if the nth submitted job is done. If wait is nonzero, wait
+   for it. Returns 1 if it is done, 0 if not and -1 if process()
+   failed */
+int bgen_job_queue_wait(bgen_job_queue_t * q, int n, int wait);
+
+/* Release the oldest job */
+void bgen_job_queue_release(bgen_job_queue_t * q);
+
+/* Terminate the threads after processing the submitted jobs */
+void bgen_job_queue_destroy(bgen_job_queue_t * q);
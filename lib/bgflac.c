@@ -20,7 +20,10 @@
 
 
 
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <gmerlin/plugin.h>
 #include <gmerlin/utils.h>
@@ -30,6 +33,8 @@
 
 #include <config.h>
 #include <bgflac.h>
+#include <FLAC/stream_decoder.h>
+#include "flacmt.h"
 
 #include <gmerlin/log.h>
 #define LOG_DOMAIN "flacenc"
@@ -37,16 +42,16 @@
 struct bg_flac_s
   {
   int clevel; /* Compression level 0..8 */
+  int threads;
 
   int bits_per_sample;
   int shift_bits;
-  int divisor;
   //  int samples_per_block;
 
   int fixed_blocksize;
   
-  void (*copy_frame)(int32_t * dst[], gavl_audio_frame_t * src,
-                     int num_channels);
+  bg_flac_pack_func_t pack;
+  int sample_bytes; /* Bytes per input sample */
 
   /* Buffer */
     
@@ -58,6 +63,9 @@ struct bg_flac_s
   //  FLAC__StreamMetadata * vorbis_comment;
   FLAC__StreamEncoder * enc;
 
+  /* Frame parallel encoding if libFLAC cannot use threads */
+  bg_flac_mt_t * mt;
+
   /* Needs to be set by the client */
   gavl_packet_sink_t * psink_out;
     
@@ -69,62 +77,18 @@ struct bg_flac_s
   gavl_compression_info_t ci;
 
   FLAC__StreamMetadata_StreamInfo si;
-  };
-
-
-/* Copy functions */
 
-static void copy_frame_8(int32_t * dst[], gavl_audio_frame_t * src,
-                         int num_channels)
-  {
-  int i, j;
-  for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < src->valid_samples; j++)
-      {
-      dst[i][j] = src->channels.s_8[i][j];
-      }
-    }
-  }
-
-static void copy_frame_16(int32_t * dst[], gavl_audio_frame_t * src,
-                          int num_channels)
-  {
-  int i, j;
-  for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < src->valid_samples; j++)
-      {
-      dst[i][j] = src->channels.s_16[i][j];
-      }
-    }
+  /* Continuing an existing file */
+  int resume;
+  FLAC__StreamMetadata_StreamInfo resume_si; /* Of the kept frames */
+  int64_t resume_frames;
+  int32_t * resume_prefix[GAVL_MAX_CHANNELS]; /* Re-encoded last frame */
+  int resume_prefix_len;
+  bg_flac_md5_t md5;
+  gavl_buffer_t frame_buf;
+  };
 
-  }
 
-static void copy_frame_32(int32_t * dst[], gavl_audio_frame_t * src,
-                          int num_channels)
-  {
-  int i;
-  for(i = 0; i < num_channels; i++)
-    {
-    memcpy(dst[i], src->channels.s_32[i],
-           src->valid_samples * sizeof(dst[0][0]));
-    }
-  }
-
-static void do_shift(int32_t * dst[], int num_channels, int num_samples,
-                     int divisor)
-  {
-  int i, j;
-  
-  for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < num_samples; j++)
-      {
-      dst[i][j] /= divisor;
-      }
-    }
-  }
 
 static const bg_parameter_info_t audio_parameters[] =
   {
@@ -145,6 +109,15 @@ static const bg_parameter_info_t audio_parameters[] =
       .help_string = TRS("0: Fastest encoding, biggest files\n\
 8: Slowest encoding, smallest files")
     },
+    {
+      .name =        "threads",
+      .long_name =   TRS("Threads"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(64),
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Number of encoder threads. 0 means one thread per CPU core. If libFLAC cannot encode with multiple threads, the blocks are encoded in parallel by gmerlin itself.")
+    },
     { /* End of parameters */ }
   };
 
@@ -171,58 +144,98 @@ void bg_flac_set_parameter(void * data, const char * name,
     {
     flac->bits_per_sample = atoi(val->v.str);
     }
+  else if(!strcmp(name, "threads"))
+    {
+    flac->threads = val->v.i;
+    }
   
   //  fprintf(stderr, "set_audio_parameter_flac %s\n", name);
   }
 
-static void metadata_callback(const FLAC__StreamEncoder *enc,
-                              const FLAC__StreamMetadata *m,
-                              void *client_data)
+/* Re-write stream info */
+
+static void update_streaminfo(bg_flac_t * flac,
+                              const FLAC__StreamMetadata_StreamInfo * si)
   {
-  bg_flac_t * flac = client_data;
+  uint8_t * ptr;
+  uint32_t i;
+
+  if(!flac->streaminfo_callback)
+    return;
+
+  ptr = flac->ci.codec_header.buf + 8; // Signature + metadata header
   
-  if((m->type == FLAC__METADATA_TYPE_STREAMINFO) && flac->streaminfo_callback)
-    {
-    const FLAC__StreamMetadata_StreamInfo * si;
-    uint8_t * ptr;
-    uint32_t i;
-    
-    /* Re-write stream info */
+  GAVL_16BE_2_PTR(si->min_blocksize, ptr); ptr += 2;
+  GAVL_16BE_2_PTR(si->max_blocksize, ptr); ptr += 2;
+  GAVL_24BE_2_PTR(si->min_framesize, ptr); ptr += 3;
+  GAVL_24BE_2_PTR(si->max_framesize, ptr); ptr += 3;
 
-    si = &m->data.stream_info;
-    ptr = flac->ci.codec_header.buf + 8; // Signature + metadata header
-    
-    GAVL_16BE_2_PTR(si->min_blocksize, ptr); ptr += 2;
-    GAVL_16BE_2_PTR(si->max_blocksize, ptr); ptr += 2;
-    GAVL_24BE_2_PTR(si->min_framesize, ptr); ptr += 3;
-    GAVL_24BE_2_PTR(si->max_framesize, ptr); ptr += 3;
+  i = si->sample_rate >> 4;
+  GAVL_16BE_2_PTR(i, ptr); ptr += 2;
+
+  i = si->sample_rate & 0x0f;   // Samplerate (lower 4 bits)
+
+  i <<= 3;                      // Channels
+  i |= (si->channels-1) & 0x7;
+
+  i <<= 5;                      // Bits
+  i |= (si->bits_per_sample-1) & 0x1f;
 
-    i = si->sample_rate >> 4;
-    GAVL_16BE_2_PTR(i, ptr); ptr += 2;
+  i <<= 4;                      // Total samples
+  i |= (si->total_samples >> 32) & 0xf;
 
-    i = si->sample_rate & 0x0f;   // Samplerate (lower 4 bits)
+  GAVL_16BE_2_PTR(i, ptr); ptr += 2;
 
-    i <<= 3;                      // Channels
-    i |= (si->channels-1) & 0x7;
+  i = (si->total_samples) & 0xffffffff;
+  GAVL_32BE_2_PTR(i, ptr); ptr += 4;
+  
+  memcpy(ptr, si->md5sum, 16); ptr += 16;
+  
+  flac->streaminfo_callback(flac->callback_priv,
+                            flac->ci.codec_header.buf,
+                            flac->ci.codec_header.len);
+  }
 
-    i <<= 5;                      // Bits
-    i |= (si->bits_per_sample-1) & 0x1f;
+/* Add the kept frames of the existing file */
 
-    i <<= 4;                      // Total samples
-    i |= (si->total_samples >> 32) & 0xf;
+static void merge_resume_si(bg_flac_t * flac,
+                            FLAC__StreamMetadata_StreamInfo * si)
+  {
+  const FLAC__StreamMetadata_StreamInfo * old = &flac->resume_si;
 
-    GAVL_16BE_2_PTR(i, ptr); ptr += 2;
+  si->total_samples += old->total_samples;
 
-    i = (si->total_samples) & 0xffffffff;
-    GAVL_32BE_2_PTR(i, ptr); ptr += 4;
-    
-    memcpy(ptr, si->md5sum, 16); ptr += 16;
-    
-    flac->streaminfo_callback(flac->callback_priv,
-                              flac->ci.codec_header.buf,
-                              flac->ci.codec_header.len);
+  if(old->min_framesize &&
+     (!si->min_framesize || (old->min_framesize < si->min_framesize)))
+    si->min_framesize = old->min_framesize;
+  if(old->max_framesize > si->max_framesize)
+    si->max_framesize = old->max_framesize;
+  }
+
+static void metadata_callback(const FLAC__StreamEncoder *enc,
+                              const FLAC__StreamMetadata *m,
+                              void *client_data)
+  {
+  bg_flac_t * flac = client_data;
+
+  /* In frame parallel mode, the stream info comes from bg_flac_mt_finish() */
+  if((m->type == FLAC__METADATA_TYPE_STREAMINFO) && !flac->mt)
+    {
+    if(flac->resume)
+      {
+      FLAC__StreamMetadata_StreamInfo si = m->data.stream_info;
+
+      /* Frame sizes of the renumbered frames */
+      si.min_framesize = flac->si.min_framesize;
+      si.max_framesize = flac->si.max_framesize;
+      bg_flac_md5_final(&flac->md5, si.md5sum);
+
+      merge_resume_si(flac, &si);
+      update_streaminfo(flac, &si);
+      }
+    else
+      update_streaminfo(flac, &m->data.stream_info);
     }
-     
   }
 
 static FLAC__StreamEncoderWriteStatus
@@ -265,6 +278,22 @@ write_callback(const FLAC__StreamEncoder *encoder,
     gavl_packet_init(&gp);
     gp.buf.len = bytes;
     gp.buf.buf = (uint8_t*)buffer;
+
+    /* The frame numbers continue the existing file */
+    if(flac->resume)
+      {
+      gavl_buffer_alloc(&flac->frame_buf, bytes + BG_FLAC_MAX_HEADER_GROW);
+      if(!(gp.buf.len = bg_flac_renumber_frame(flac->frame_buf.buf, buffer, bytes,
+                                               flac->resume_frames + current_frame)))
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+      gp.buf.buf = flac->frame_buf.buf;
+
+      if(!flac->si.min_framesize || (gp.buf.len < flac->si.min_framesize))
+        flac->si.min_framesize = gp.buf.len;
+      if(gp.buf.len > flac->si.max_framesize)
+        flac->si.max_framesize = gp.buf.len;
+      }
+    
     gp.duration = samples;
     gp.pts = flac->pts;
     flac->pts += samples;
@@ -366,6 +395,35 @@ bg_flac_start_compressed(bg_flac_t * flac,
   return gavl_packet_sink_create(NULL, write_audio_packet_func_flac, flac);;
   }
 
+static gavl_sink_status_t
+encode_audio_func_mt(void * priv, gavl_audio_frame_t * frame)
+  {
+  int i;
+  int num;
+  int done = 0;
+  int32_t * dst[GAVL_MAX_CHANNELS];
+  bg_flac_t * flac = priv;
+
+  while(done < frame->valid_samples)
+    {
+    if((num = bg_flac_mt_get_buffer(flac->mt, dst)) < 0)
+      return GAVL_SINK_ERROR;
+
+    if(num > frame->valid_samples - done)
+      num = frame->valid_samples - done;
+
+    for(i = 0; i < flac->format->num_channels; i++)
+      flac->pack(dst[i], frame->channels.s_8[i] + done * flac->sample_bytes,
+                 num, flac->shift_bits);
+
+    if(bg_flac_mt_commit(flac->mt, num) != GAVL_SINK_OK)
+      return GAVL_SINK_ERROR;
+
+    done += num;
+    }
+  return GAVL_SINK_OK;
+  }
+
 static gavl_sink_status_t
 encode_audio_func(void * priv, gavl_audio_frame_t * frame)
   {
@@ -383,12 +441,14 @@ encode_audio_func(void * priv, gavl_audio_frame_t * frame)
 
   /* Copy and shift */
 
-  flac->copy_frame(flac->buffer, frame, flac->format->num_channels);
-
-  if(flac->shift_bits)
-    do_shift(flac->buffer, flac->format->num_channels,
-             frame->valid_samples, flac->divisor);
+  for(i = 0; i < flac->format->num_channels; i++)
+    flac->pack(flac->buffer[i], frame->channels.s_8[i],
+               frame->valid_samples, flac->shift_bits);
 
+  if(flac->resume)
+    bg_flac_md5_update_samples(&flac->md5, flac->buffer, flac->format->num_channels,
+                               frame->valid_samples, flac->bits_per_sample);
+  
   if(!FLAC__stream_encoder_process(flac->enc,
                                    (const FLAC__int32 **) flac->buffer,
                                    frame->valid_samples))
@@ -397,10 +457,33 @@ encode_audio_func(void * priv, gavl_audio_frame_t * frame)
   return 1;
   }
 
+/* Pass the re-encoded last frame of the existing file to the threads */
+
+static int encode_prefix_mt(bg_flac_t * flac)
+  {
+  int i;
+  int32_t * dst[GAVL_MAX_CHANNELS];
+
+  if(!flac->resume_prefix_len)
+    return 1;
+
+  /* Always fits since it's shorter than a block */
+  if(bg_flac_mt_get_buffer(flac->mt, dst) < flac->resume_prefix_len)
+    return 0;
+
+  for(i = 0; i < flac->format->num_channels; i++)
+    memcpy(dst[i], flac->resume_prefix[i],
+           flac->resume_prefix_len * sizeof(*dst[i]));
+
+  return bg_flac_mt_commit(flac->mt, flac->resume_prefix_len) == GAVL_SINK_OK;
+  }
+
 gavl_audio_sink_t *
 bg_flac_start_uncompressed(bg_flac_t * flac,
                            gavl_dictionary_t * stream)
   {
+  int use_mt = 0;
+  
   flac->format = gavl_stream_get_audio_format_nc(stream);
   
   /* Common initialization */
@@ -417,24 +500,38 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
     
   if(flac->bits_per_sample <= 8)
     {
-    flac->copy_frame = copy_frame_8;
+    flac->pack = bg_flac_get_pack_func(1);
+    flac->sample_bytes = 1;
     flac->shift_bits = 8 - flac->bits_per_sample;
     flac->format->sample_format = GAVL_SAMPLE_S8;
     }
   else if(flac->bits_per_sample <= 16)
     {
-    flac->copy_frame = copy_frame_16;
+    flac->pack = bg_flac_get_pack_func(2);
+    flac->sample_bytes = 2;
     flac->shift_bits = 16 - flac->bits_per_sample;
     flac->format->sample_format = GAVL_SAMPLE_S16;
     }
   else if(flac->bits_per_sample <= 32)
     {
-    flac->copy_frame = copy_frame_32;
+    flac->pack = bg_flac_get_pack_func(4);
+    flac->sample_bytes = 4;
     flac->shift_bits = 32 - flac->bits_per_sample;
     flac->format->sample_format = GAVL_SAMPLE_S32;
     }
-  flac->divisor = (1 << flac->shift_bits); 
 
+  if(flac->resume &&
+     ((flac->format->samplerate != flac->resume_si.sample_rate) ||
+      (flac->format->num_channels != flac->resume_si.channels) ||
+      (flac->bits_per_sample != flac->resume_si.bits_per_sample)))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Cannot append: Format mismatch (existing: %d Hz, %d channels, %d bits)",
+             flac->resume_si.sample_rate, flac->resume_si.channels,
+             flac->resume_si.bits_per_sample);
+    return NULL;
+    }
+  
   /* Set compression parameters from presets */
   
   FLAC__stream_encoder_set_sample_rate(flac->enc, flac->format->samplerate);
@@ -445,6 +542,28 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
   
   FLAC__stream_encoder_set_bits_per_sample(flac->enc, flac->bits_per_sample);
 
+  /* The MD5 sum includes the existing samples, so we calculate it ourselves */
+  if(flac->resume)
+    {
+    FLAC__stream_encoder_set_blocksize(flac->enc, flac->resume_si.max_blocksize);
+    FLAC__stream_encoder_set_do_md5(flac->enc, 0);
+    }
+  
+  /* Threads */
+
+  if(!flac->threads)
+    flac->threads = sysconf(_SC_NPROCESSORS_ONLN);
+  
+  if(flac->threads > 1)
+    {
+    use_mt = 1;
+#ifdef HAVE_FLAC__STREAM_ENCODER_SET_NUM_THREADS
+    if(FLAC__stream_encoder_set_num_threads(flac->enc, flac->threads) ==
+       FLAC__STREAM_ENCODER_SET_NUM_THREADS_OK)
+      use_mt = 0;
+#endif
+    }
+  
   /* Initialize */
 
   /* Set vendor string: Must be done early because it's needed in the streaminfo callback */
@@ -467,6 +586,38 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
   //    FLAC__stream_encoder_get_blocksize(flac->enc);
 
   gavl_stream_set_compression_info(stream, &flac->ci);
+
+  /* The headers are written by flac->enc, the frames by the threads */
+  if(use_mt &&
+     (flac->mt = bg_flac_mt_create(flac->threads,
+                                   flac->format->samplerate,
+                                   flac->format->num_channels,
+                                   flac->bits_per_sample,
+                                   flac->clevel,
+                                   FLAC__stream_encoder_get_blocksize(flac->enc))))
+    {
+    bg_flac_mt_set_sink(flac->mt, flac->psink_out);
+
+    if(flac->resume)
+      {
+      bg_flac_mt_set_start(flac->mt, flac->resume_frames, &flac->md5);
+      if(!encode_prefix_mt(flac))
+        return NULL;
+      }
+    return gavl_audio_sink_create(NULL, encode_audio_func_mt, flac, flac->format);
+    }
+
+  if(flac->resume && flac->resume_prefix_len)
+    {
+    bg_flac_md5_update_samples(&flac->md5, flac->resume_prefix,
+                               flac->format->num_channels,
+                               flac->resume_prefix_len, flac->bits_per_sample);
+    if(!FLAC__stream_encoder_process(flac->enc,
+                                     (const FLAC__int32 **)flac->resume_prefix,
+                                     flac->resume_prefix_len))
+      return NULL;
+    }
+  
   return gavl_audio_sink_create(NULL, encode_audio_func, flac, flac->format);
   }
 
@@ -474,10 +625,25 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
 void bg_flac_free(bg_flac_t * flac)
   {
   int i;
+
+  if(flac->mt)
+    {
+    FLAC__StreamMetadata_StreamInfo si;
+
+    if(bg_flac_mt_finish(flac->mt, &si))
+      {
+      if(flac->resume)
+        merge_resume_si(flac, &si);
+      update_streaminfo(flac, &si);
+      }
+    }
   
   FLAC__stream_encoder_finish(flac->enc);
   FLAC__stream_encoder_delete(flac->enc);
 
+  if(flac->mt)
+    bg_flac_mt_destroy(flac->mt);
+
   if(flac->buffer[0])
     {
     for(i = 0; i < flac->format->num_channels; i++)
@@ -486,6 +652,13 @@ void bg_flac_free(bg_flac_t * flac)
       flac->buffer[i] = NULL;
       }
     }
+  for(i = 0; i < GAVL_MAX_CHANNELS; i++)
+    {
+    if(flac->resume_prefix[i])
+      free(flac->resume_prefix[i]);
+    }
+  gavl_buffer_free(&flac->frame_buf);
+  
   gavl_compression_info_free(&flac->ci);  
   free(flac);
   }
@@ -534,6 +707,7 @@ bg_flac_t * bg_flac_create()
   {
   bg_flac_t * flac = calloc(1, sizeof(*flac));
   flac->enc = FLAC__stream_encoder_new();
+  flac->threads = 1;
   flac->ci.id = GAVL_CODEC_ID_FLAC;
   gavl_buffer_alloc(&flac->ci.codec_header, BG_FLAC_HEADER_SIZE);
   return flac;
@@ -542,5 +716,197 @@ bg_flac_t * bg_flac_create()
 void bg_flac_set_sink(bg_flac_t * flac, gavl_packet_sink_t * psink)
   {
   flac->psink_out = psink;
+  if(flac->mt)
+    bg_flac_mt_set_sink(flac->mt, psink);
+  }
+
+
+/* Resume an existing file */
+
+typedef struct
+  {
+  /* Last decoded frame, which is kept back until we know
+     if it's the last one */
+  int32_t * held[GAVL_MAX_CHANNELS];
+  int held_len;
+  int held_alloc;
+  uint64_t held_start;
+  uint64_t held_end;
+
+  int64_t frames;
+  int64_t samples;
+  uint64_t end;
+  unsigned min_framesize;
+  unsigned max_framesize;
+
+  FLAC__StreamMetadata_StreamInfo si;
+  int have_si;
+  int error;
+
+  bg_flac_md5_t md5;
+  } resume_t;
+
+static void commit_held(resume_t * r)
+  {
+  unsigned size = r->held_end - r->held_start;
+
+  bg_flac_md5_update_samples(&r->md5, r->held, r->si.channels,
+                             r->held_len, r->si.bits_per_sample);
+  
+  r->frames++;
+  r->samples += r->held_len;
+  r->end = r->held_end;
+
+  if(!r->min_framesize || (size < r->min_framesize))
+    r->min_framesize = size;
+  if(size > r->max_framesize)
+    r->max_framesize = size;
+
+  r->held_len = 0;
+  }
+
+static FLAC__StreamDecoderWriteStatus
+resume_write_callback(const FLAC__StreamDecoder * dec,
+                      const FLAC__Frame * frame,
+                      const FLAC__int32 * const buffer[],
+                      void * data)
+  {
+  int i;
+  uint64_t pos;
+  resume_t * r = data;
+
+  if(r->held_len)
+    commit_held(r);
+
+  if(!FLAC__stream_decoder_get_decode_position(dec, &pos))
+    {
+    r->error = 1;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+  
+  if(r->held_alloc < frame->header.blocksize)
+    {
+    r->held_alloc = frame->header.blocksize;
+    for(i = 0; i < r->si.channels; i++)
+      r->held[i] = realloc(r->held[i], r->held_alloc * sizeof(*r->held[i]));
+    }
+
+  for(i = 0; i < r->si.channels; i++)
+    memcpy(r->held[i], buffer[i], frame->header.blocksize * sizeof(*r->held[i]));
+
+  r->held_len = frame->header.blocksize;
+  r->held_start = r->held_end;
+  r->held_end = pos;
+  
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+  }
+
+static void resume_metadata_callback(const FLAC__StreamDecoder * dec,
+                                     const FLAC__StreamMetadata * m,
+                                     void * data)
+  {
+  resume_t * r = data;
+
+  if(m->type == FLAC__METADATA_TYPE_STREAMINFO)
+    {
+    r->si = m->data.stream_info;
+    r->have_si = 1;
+    }
   }
 
+static void resume_error_callback(const FLAC__StreamDecoder * dec,
+                                  FLAC__StreamDecoderErrorStatus status,
+                                  void * data)
+  {
+  resume_t * r = data;
+  gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Decoding existing file failed: %s",
+           FLAC__StreamDecoderErrorStatusString[status]);
+  r->error = 1;
+  }
+
+int bg_flac_resume(bg_flac_t * flac, const char * filename,
+                   int64_t * end_pos, int64_t * samples)
+  {
+  int i;
+  int ret = 0;
+  resume_t r;
+  FLAC__StreamDecoder * dec;
+
+  memset(&r, 0, sizeof(r));
+  bg_flac_md5_init(&r.md5);
+  
+  dec = FLAC__stream_decoder_new();
+
+  if(FLAC__stream_decoder_init_file(dec, filename,
+                                    resume_write_callback,
+                                    resume_metadata_callback,
+                                    resume_error_callback,
+                                    &r) != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot open %s for appending", filename);
+    goto fail;
+    }
+
+  /* The first frame starts after the metadata */
+  if(!FLAC__stream_decoder_process_until_end_of_metadata(dec) ||
+     !FLAC__stream_decoder_get_decode_position(dec, &r.held_end) ||
+     !r.have_si)
+    goto fail;
+
+  r.end = r.held_end;
+  
+  /* New frames must continue the frame numbering of a fixed
+     blocksize stream */
+  if(r.si.min_blocksize != r.si.max_blocksize)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Cannot append to %s: Variable blocksize", filename);
+    goto fail;
+    }
+
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Decoding %s for appending", filename);
+  
+  if(!FLAC__stream_decoder_process_until_end_of_stream(dec) || r.error)
+    goto fail;
+
+  /* A short last frame must be encoded again, since only the
+     last frame of the stream can be shorter than the blocksize */
+  if(r.held_len == r.si.max_blocksize)
+    commit_held(&r);
+  
+  flac->resume = 1;
+  flac->resume_frames = r.frames;
+  flac->md5 = r.md5;
+
+  flac->resume_si = r.si;
+  flac->resume_si.total_samples = r.samples;
+  flac->resume_si.min_framesize = r.min_framesize;
+  flac->resume_si.max_framesize = r.max_framesize;
+
+  if(r.held_len)
+    {
+    for(i = 0; i < r.si.channels; i++)
+      {
+      flac->resume_prefix[i] = r.held[i];
+      r.held[i] = NULL;
+      }
+    flac->resume_prefix_len = r.held_len;
+    }
+
+  *end_pos = r.end;
+  *samples = r.samples;
+  ret = 1;
+  
+  fail:
+
+  FLAC__stream_decoder_finish(dec);
+  FLAC__stream_decoder_delete(dec);
+
+  for(i = 0; i < GAVL_MAX_CHANNELS; i++)
+    {
+    if(r.held[i])
+      free(r.held[i]);
+    }
+  
+  return ret;
+  }
@@ -0,0 +1,753 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Frame parallel flac encoding: The input is split into jobs of
+   BLOCKS_PER_JOB blocks (the blocksize is fixed). Each worker thread
+   encodes jobs with its own FLAC__StreamEncoder. Since every job is a
+   separate stream for libFLAC, the frame numbers start from zero. They
+   are rewritten (together with the header CRC-8 and the frame CRC-16)
+   before the frames are passed downstream in the original order.
+   The MD5 sum of the whole stream is calculated here. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <gmerlin/plugin.h>
+#include <gavl/numptr.h>
+
+#include <config.h>
+#include <gmerlin_encoders.h>
+#include <bgflac.h>
+#include "flacmt.h"
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "flacenc"
+
+#define BLOCKS_PER_JOB 16
+
+/* MD5 (RFC 1321) */
+
+static const uint32_t md5_k[64] =
+  {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+
+static const uint8_t md5_r[16] =
+  {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+  };
+
+void bg_flac_md5_init(bg_flac_md5_t * m)
+  {
+  m->h[0] = 0x67452301;
+  m->h[1] = 0xefcdab89;
+  m->h[2] = 0x98badcfe;
+  m->h[3] = 0x10325476;
+  m->len = 0;
+  }
+
+static void md5_block(bg_flac_md5_t * m, const uint8_t * data)
+  {
+  int i, g;
+  uint32_t w[16];
+  uint32_t a, b, c, d, f, tmp;
+
+  for(i = 0; i < 16; i++)
+    w[i] = GAVL_PTR_2_32LE(data + 4*i);
+
+  a = m->h[0];
+  b = m->h[1];
+  c = m->h[2];
+  d = m->h[3];
+
+  for(i = 0; i < 64; i++)
+    {
+    switch(i >> 4)
+      {
+      case 0:
+        f = (b & c) | (~b & d);
+        g = i;
+        break;
+      case 1:
+        f = (d & b) | (~d & c);
+        g = (5*i + 1) & 15;
+        break;
+      case 2:
+        f = b ^ c ^ d;
+        g = (3*i + 5) & 15;
+        break;
+      default:
+        f = c ^ (b | ~d);
+        g = (7*i) & 15;
+        break;
+      }
+    tmp = d;
+    d = c;
+    c = b;
+    f += a + md5_k[i] + w[g];
+    b += (f << md5_r[(i >> 2 & 0x0c) | (i & 3)]) |
+      (f >> (32 - md5_r[(i >> 2 & 0x0c) | (i & 3)]));
+    a = tmp;
+    }
+
+  m->h[0] += a;
+  m->h[1] += b;
+  m->h[2] += c;
+  m->h[3] += d;
+  }
+
+static void md5_update(bg_flac_md5_t * m, const uint8_t * data, int len)
+  {
+  int used = m->len & 63;
+  int n;
+
+  m->len += len;
+
+  if(used)
+    {
+    n = 64 - used;
+    if(n > len)
+      n = len;
+    memcpy(m->buf + used, data, n);
+    data += n;
+    len -= n;
+    if(used + n < 64)
+      return;
+    md5_block(m, m->buf);
+    }
+
+  while(len >= 64)
+    {
+    md5_block(m, data);
+    data += 64;
+    len -= 64;
+    }
+
+  if(len)
+    memcpy(m->buf, data, len);
+  }
+
+void bg_flac_md5_final(bg_flac_md5_t * m, uint8_t * digest)
+  {
+  int i;
+  int used = m->len & 63;
+  uint64_t bits = m->len * 8;
+
+  m->buf[used++] = 0x80;
+
+  if(used > 56)
+    {
+    memset(m->buf + used, 0, 64 - used);
+    md5_block(m, m->buf);
+    used = 0;
+    }
+  memset(m->buf + used, 0, 56 - used);
+
+  for(i = 0; i < 8; i++)
+    m->buf[56 + i] = (bits >> (8*i)) & 0xff;
+
+  md5_block(m, m->buf);
+
+  for(i = 0; i < 4; i++)
+    GAVL_32LE_2_PTR(m->h[i], digest + 4*i);
+  }
+
+/* MD5 of the samples in the format of the flac specification:
+   Interleaved, signed little endian */
+
+#define MD5_CHUNK 256
+
+void bg_flac_md5_update_samples(bg_flac_md5_t * m,
+                                int32_t * const samples[], int num_channels,
+                                int num, int bits_per_sample)
+  {
+  int i, j, k;
+  int n;
+  int pos = 0;
+  uint8_t * ptr;
+  int bytes = (bits_per_sample + 7) / 8;
+  int32_t v;
+  uint8_t buf[MD5_CHUNK * GAVL_MAX_CHANNELS * 4];
+
+  while(pos < num)
+    {
+    n = num - pos;
+    if(n > MD5_CHUNK)
+      n = MD5_CHUNK;
+
+    ptr = buf;
+
+    for(i = 0; i < n; i++)
+      {
+      for(j = 0; j < num_channels; j++)
+        {
+        v = samples[j][pos + i];
+        for(k = 0; k < bytes; k++)
+          {
+          *(ptr++) = v & 0xff;
+          v >>= 8;
+          }
+        }
+      }
+    md5_update(m, buf, ptr - buf);
+    pos += n;
+    }
+  }
+
+/* CRCs of the frame header (CRC-8, polynomial 0x07) and the whole
+   frame (CRC-16, polynomial 0x8005) */
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+  {
+  int i, j;
+  uint8_t c8;
+  uint16_t c16;
+
+  for(i = 0; i < 256; i++)
+    {
+    c8 = i;
+    c16 = i << 8;
+    for(j = 0; j < 8; j++)
+      {
+      c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : (c8 << 1);
+      c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : (c16 << 1);
+      }
+    crc8_table[i] = c8;
+    crc16_table[i] = c16;
+    }
+  }
+
+static uint8_t crc8(const uint8_t * data, int len)
+  {
+  uint8_t crc = 0;
+  while(len--)
+    crc = crc8_table[crc ^ *(data++)];
+  return crc;
+  }
+
+static uint16_t crc16(const uint8_t * data, int len)
+  {
+  uint16_t crc = 0;
+  while(len--)
+    crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *(data++)];
+  return crc;
+  }
+
+int bg_flac_renumber_frame(uint8_t * dst, const uint8_t * src, int len,
+                           int64_t frame_number)
+  {
+  int i;
+  int num_len;
+  int src_pos;
+  int dst_pos;
+  int extra = 0;
+  uint16_t crc;
+
+  pthread_once(&crc_once, crc_init);
+
+  if((len < 8) || (src[0] != 0xff) || ((src[1] & 0xfe) != 0xf8))
+    return 0;
+
+  /* Length of the coded number in the source */
+  if(!(src[4] & 0x80))
+    num_len = 1;
+  else
+    {
+    num_len = 0;
+    while((num_len < 8) && (src[4] & (0x80 >> num_len)))
+      num_len++;
+    if((num_len < 2) || (num_len > 7))
+      return 0;
+    }
+
+  /* Blocksize and samplerate at the end of the header */
+  switch(src[2] >> 4)
+    {
+    case 6:
+      extra += 1;
+      break;
+    case 7:
+      extra += 2;
+      break;
+    }
+  switch(src[2] & 0x0f)
+    {
+    case 12:
+      extra += 1;
+      break;
+    case 13:
+    case 14:
+      extra += 2;
+      break;
+    }
+
+  src_pos = 4 + num_len;
+
+  if(src_pos + extra + 1 + 2 > len)
+    return 0;
+
+  memcpy(dst, src, 4);
+
+  /* Coded number (UTF-8 like) */
+  if(frame_number < 0x80)
+    num_len = 1;
+  else
+    {
+    num_len = 2;
+    while((num_len < 7) && (frame_number >> (5*num_len + 1)))
+      num_len++;
+    }
+
+  if(num_len == 1)
+    dst[4] = frame_number;
+  else
+    {
+    dst[4] = ((0xff00 >> num_len) & 0xff) |
+      (frame_number >> (6 * (num_len - 1)));
+    for(i = 1; i < num_len; i++)
+      dst[4 + i] = 0x80 | ((frame_number >> (6 * (num_len - 1 - i))) & 0x3f);
+    }
+
+  dst_pos = 4 + num_len;
+
+  memcpy(dst + dst_pos, src + src_pos, extra);
+  dst_pos += extra;
+  src_pos += extra;
+
+  dst[dst_pos] = crc8(dst, dst_pos);
+  dst_pos++;
+  src_pos++;
+
+  /* Subframes */
+  memcpy(dst + dst_pos, src + src_pos, len - 2 - src_pos);
+  dst_pos += len - 2 - src_pos;
+
+  crc = crc16(dst, dst_pos);
+  dst[dst_pos++] = crc >> 8;
+  dst[dst_pos++] = crc & 0xff;
+
+  return dst_pos;
+  }
+
+/* Jobs */
+
+typedef struct
+  {
+  int bytes;
+  int samples;
+  } frame_info_t;
+
+typedef struct
+  {
+  int32_t * samples[GAVL_MAX_CHANNELS];
+  int num_samples;
+
+  int64_t first_frame;
+
+  /* Frames as returned by libFLAC */
+  gavl_buffer_t raw;
+
+  /* Renumbered frames */
+  gavl_buffer_t out;
+
+  frame_info_t * frames;
+  int num_frames;
+  int frames_alloc;
+  } job_t;
+
+struct bg_flac_mt_s
+  {
+  /* Encoding parameters */
+  int samplerate;
+  int num_channels;
+  int bits_per_sample;
+  int clevel;
+  int blocksize;
+
+  /* One encoder per thread */
+  FLAC__StreamEncoder ** encoders;
+  int num_threads;
+
+  bgen_job_queue_t * q;
+  job_t * jobs;
+  int num_jobs;
+
+  /* Job currently filled by the application */
+  job_t * fill;
+
+  int job_samples;
+  int64_t frames_submitted;
+
+  /* Output */
+  gavl_packet_sink_t * psink;
+  int64_t pts;
+
+  unsigned min_framesize;
+  unsigned max_framesize;
+  int64_t total_samples;
+
+  bg_flac_md5_t md5;
+  };
+
+static FLAC__StreamEncoderWriteStatus
+job_write_callback(const FLAC__StreamEncoder *encoder,
+                   const FLAC__byte buffer[],
+                   size_t bytes,
+                   unsigned samples,
+                   unsigned current_frame,
+                   void *data)
+  {
+  job_t * job = data;
+
+  /* Stream headers */
+  if(!samples)
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+  if(job->num_frames == job->frames_alloc)
+    {
+    job->frames_alloc += BLOCKS_PER_JOB;
+    job->frames = realloc(job->frames, job->frames_alloc * sizeof(*job->frames));
+    }
+
+  job->frames[job->num_frames].bytes = bytes;
+  job->frames[job->num_frames].samples = samples;
+  job->num_frames++;
+
+  gavl_buffer_append_data(&job->raw, buffer, bytes);
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+static int encode_job(bg_flac_mt_t * mt, FLAC__StreamEncoder * enc, job_t * job)
+  {
+  int i;
+  int len;
+  const uint8_t * src;
+
+  job->num_frames = 0;
+  job->raw.len = 0;
+  job->out.len = 0;
+
+  /* libFLAC resets the settings after finishing */
+  FLAC__stream_encoder_set_sample_rate(enc, mt->samplerate);
+  FLAC__stream_encoder_set_channels(enc, mt->num_channels);
+  FLAC__stream_encoder_set_compression_level(enc, mt->clevel);
+  FLAC__stream_encoder_set_bits_per_sample(enc, mt->bits_per_sample);
+  FLAC__stream_encoder_set_blocksize(enc, mt->blocksize);
+  FLAC__stream_encoder_set_do_md5(enc, 0);
+
+  if(FLAC__stream_encoder_init_stream(enc, job_write_callback,
+                                      NULL, NULL, NULL,
+                                      job) != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "FLAC__stream_encoder_init_stream failed");
+    return 0;
+    }
+
+  if(!FLAC__stream_encoder_process(enc, (const FLAC__int32 **)job->samples,
+                                   job->num_samples))
+    {
+    FLAC__stream_encoder_finish(enc);
+    return 0;
+    }
+
+  /* Flushes the last frame */
+  if(!FLAC__stream_encoder_finish(enc))
+    return 0;
+
+  gavl_buffer_alloc(&job->out, job->raw.len + job->num_frames * BG_FLAC_MAX_HEADER_GROW);
+
+  src = job->raw.buf;
+
+  for(i = 0; i < job->num_frames; i++)
+    {
+    if(!(len = bg_flac_renumber_frame(job->out.buf + job->out.len, src,
+                              job->frames[i].bytes, job->first_frame + i)))
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "Got invalid frame from libFLAC");
+      return 0;
+      }
+    src += job->frames[i].bytes;
+    job->frames[i].bytes = len;
+    job->out.len += len;
+    }
+
+  return 1;
+  }
+
+static int process_job(void * priv, int job, int thread)
+  {
+  bg_flac_mt_t * mt = priv;
+  return encode_job(mt, mt->encoders[thread], &mt->jobs[job]);
+  }
+
+/* Pass the frames of a finished job downstream */
+
+static gavl_sink_status_t emit_job(bg_flac_mt_t * mt, job_t * job)
+  {
+  int i;
+  gavl_packet_t gp;
+  uint8_t * ptr;
+
+  ptr = job->out.buf;
+
+  for(i = 0; i < job->num_frames; i++)
+    {
+    gavl_packet_init(&gp);
+    gp.buf.buf = ptr;
+    gp.buf.len = job->frames[i].bytes;
+    gp.duration = job->frames[i].samples;
+    gp.pts = mt->pts;
+    mt->pts += gp.duration;
+
+    if(!mt->min_framesize || (gp.buf.len < mt->min_framesize))
+      mt->min_framesize = gp.buf.len;
+    if(gp.buf.len > mt->max_framesize)
+      mt->max_framesize = gp.buf.len;
+
+    ptr += gp.buf.len;
+
+    if(gavl_packet_sink_put_packet(mt->psink, &gp) != GAVL_SINK_OK)
+      return GAVL_SINK_ERROR;
+    }
+  return GAVL_SINK_OK;
+  }
+
+/* Emit finished jobs in order. If wait is nonzero,
+   wait for the oldest job to finish */
+
+static gavl_sink_status_t drain(bg_flac_mt_t * mt, int wait)
+  {
+  int result;
+  gavl_sink_status_t st;
+
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(!(result = bgen_job_queue_wait(mt->q, 0, wait)))
+      break;
+
+    if(result < 0)
+      st = GAVL_SINK_ERROR;
+    else
+      st = emit_job(mt, &mt->jobs[bgen_job_queue_get_job(mt->q, 0)]);
+
+    bgen_job_queue_release(mt->q);
+
+    if(st != GAVL_SINK_OK)
+      return st;
+
+    /* Only wait for one job */
+    wait = 0;
+    }
+
+  return GAVL_SINK_OK;
+  }
+
+static void submit(bg_flac_mt_t * mt)
+  {
+  job_t * job = mt->fill;
+
+  bg_flac_md5_update_samples(&mt->md5, job->samples, mt->num_channels,
+                             job->num_samples, mt->bits_per_sample);
+  mt->total_samples += job->num_samples;
+
+  job->first_frame = mt->frames_submitted;
+  mt->frames_submitted += (job->num_samples + mt->blocksize - 1) / mt->blocksize;
+
+  bgen_job_queue_submit(mt->q);
+  mt->fill = NULL;
+  }
+
+bg_flac_mt_t * bg_flac_mt_create(int num_threads,
+                                 int samplerate, int num_channels,
+                                 int bits_per_sample, int clevel,
+                                 int blocksize)
+  {
+  int i, j;
+  bg_flac_mt_t * mt = calloc(1, sizeof(*mt));
+
+  /* Enough jobs to keep all workers busy while the
+     application fills the next one */
+  if(!(mt->q = bgen_job_queue_create(num_threads, 2 * num_threads,
+                                     process_job, mt)))
+    {
+    free(mt);
+    return NULL;
+    }
+
+  mt->samplerate      = samplerate;
+  mt->num_channels    = num_channels;
+  mt->bits_per_sample = bits_per_sample;
+  mt->clevel          = clevel;
+  mt->blocksize       = blocksize;
+
+  mt->job_samples = blocksize * BLOCKS_PER_JOB;
+
+  mt->num_jobs = 2 * num_threads;
+  mt->jobs = calloc(mt->num_jobs, sizeof(*mt->jobs));
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    for(j = 0; j < num_channels; j++)
+      mt->jobs[i].samples[j] = malloc(mt->job_samples * sizeof(int32_t));
+    }
+
+  bg_flac_md5_init(&mt->md5);
+
+  mt->encoders = calloc(num_threads, sizeof(*mt->encoders));
+  mt->num_threads = num_threads;
+
+  for(i = 0; i < num_threads; i++)
+    mt->encoders[i] = FLAC__stream_encoder_new();
+
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+           "Encoding frame parallel with %d threads", num_threads);
+
+  return mt;
+  }
+
+void bg_flac_mt_set_sink(bg_flac_mt_t * mt, gavl_packet_sink_t * psink)
+  {
+  mt->psink = psink;
+  }
+
+void bg_flac_mt_set_start(bg_flac_mt_t * mt, int64_t frames,
+                          const bg_flac_md5_t * md5)
+  {
+  mt->frames_submitted = frames;
+  mt->md5 = *md5;
+  }
+
+int bg_flac_mt_get_buffer(bg_flac_mt_t * mt, int32_t * dst[])
+  {
+  int i;
+
+  if(!mt->fill)
+    {
+    /* Wait until the oldest job is done */
+    if((bgen_job_queue_get_free(mt->q) < 0) && (drain(mt, 1) != GAVL_SINK_OK))
+      return -1;
+
+    mt->fill = &mt->jobs[bgen_job_queue_get_free(mt->q)];
+    mt->fill->num_samples = 0;
+    }
+
+  for(i = 0; i < mt->num_channels; i++)
+    dst[i] = mt->fill->samples[i] + mt->fill->num_samples;
+
+  return mt->job_samples - mt->fill->num_samples;
+  }
+
+gavl_sink_status_t bg_flac_mt_commit(bg_flac_mt_t * mt, int num)
+  {
+  mt->fill->num_samples += num;
+
+  if(mt->fill->num_samples < mt->job_samples)
+    return GAVL_SINK_OK;
+
+  submit(mt);
+  return drain(mt, 0);
+  }
+
+int bg_flac_mt_finish(bg_flac_mt_t * mt,
+                      FLAC__StreamMetadata_StreamInfo * si)
+  {
+  int ret = 1;
+
+  if(mt->fill && mt->fill->num_samples)
+    submit(mt);
+
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(drain(mt, 1) != GAVL_SINK_OK)
+      {
+      ret = 0;
+      break;
+      }
+    }
+
+  memset(si, 0, sizeof(*si));
+
+  si->min_blocksize = mt->blocksize;
+  si->max_blocksize = mt->blocksize;
+  si->min_framesize = mt->min_framesize;
+  si->max_framesize = mt->max_framesize;
+  si->sample_rate = mt->samplerate;
+  si->channels = mt->num_channels;
+  si->bits_per_sample = mt->bits_per_sample;
+  si->total_samples = mt->total_samples;
+
+  bg_flac_md5_final(&mt->md5, si->md5sum);
+
+  return ret;
+  }
+
+void bg_flac_mt_destroy(bg_flac_mt_t * mt)
+  {
+  int i, j;
+
+  /* Unfinished jobs are still encoded, but not emitted */
+  bgen_job_queue_destroy(mt->q);
+
+  for(i = 0; i < mt->num_threads; i++)
+    {
+    if(mt->encoders[i])
+      FLAC__stream_encoder_delete(mt->encoders[i]);
+    }
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    for(j = 0; j < mt->num_channels; j++)
+      {
+      if(mt->jobs[i].samples[j])
+        free(mt->jobs[i].samples[j]);
+      }
+    gavl_buffer_free(&mt->jobs[i].raw);
+    gavl_buffer_free(&mt->jobs[i].out);
+    if(mt->jobs[i].frames)
+      free(mt->jobs[i].frames);
+    }
+
+  if(mt->jobs)
+    free(mt->jobs);
+  if(mt->encoders)
+    free(mt->encoders);
+  free(mt);
+  }
@@ -0,0 +1,90 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Internal helpers of libbgflac */
+
+/* MD5 sum of the decoded samples as stored in the STREAMINFO */
+
+typedef struct
+  {
+  uint32_t h[4];
+  uint64_t len;
+  uint8_t buf[64];
+  } bg_flac_md5_t;
+
+void bg_flac_md5_init(bg_flac_md5_t * m);
+
+void bg_flac_md5_update_samples(bg_flac_md5_t * m,
+                                int32_t * const samples[], int num_channels,
+                                int num, int bits_per_sample);
+
+void bg_flac_md5_final(bg_flac_md5_t * m, uint8_t * digest);
+
+/* Sample packing (flacpack.c): Converts one channel of 1, 2 or 4 byte
+   samples to int32 and shifts them right by shift bits (arithmetic
+   shift) */
+
+typedef void (*bg_flac_pack_func_t)(int32_t * dst, const void * src,
+                                    int num, int shift);
+
+bg_flac_pack_func_t bg_flac_get_pack_func(int bytes);
+
+/* Copy a frame and replace the frame number. Returns the new length
+   or 0 if the frame header is invalid. dst must have space for
+   len + BG_FLAC_MAX_HEADER_GROW bytes */
+
+#define BG_FLAC_MAX_HEADER_GROW 6
+
+int bg_flac_renumber_frame(uint8_t * dst, const uint8_t * src, int len,
+                           int64_t frame_number);
+
+/* Frame parallel flac encoder, used if libFLAC cannot
+   encode with multiple threads itself */
+
+typedef struct bg_flac_mt_s bg_flac_mt_t;
+
+bg_flac_mt_t * bg_flac_mt_create(int num_threads,
+                                 int samplerate, int num_channels,
+                                 int bits_per_sample, int clevel,
+                                 int blocksize);
+
+void bg_flac_mt_set_sink(bg_flac_mt_t * mt, gavl_packet_sink_t * psink);
+
+/* Continue a stream: Set the number of the first frame and the
+   MD5 state of the preceding samples */
+
+void bg_flac_mt_set_start(bg_flac_mt_t * mt, int64_t frames,
+                          const bg_flac_md5_t * md5);
+
+/* Get pointers to the sample buffers (one per channel). Returns the
+   number of samples, which can be written or -1 on error */
+
+int bg_flac_mt_get_buffer(bg_flac_mt_t * mt, int32_t * dst[]);
+
+/* Commit num samples written into the buffers */
+
+gavl_sink_status_t bg_flac_mt_commit(bg_flac_mt_t * mt, int num);
+
+/* Encode the remaining samples and return the final stream info */
+
+int bg_flac_mt_finish(bg_flac_mt_t * mt,
+                      FLAC__StreamMetadata_StreamInfo * si);
+
+void bg_flac_mt_destroy(bg_flac_mt_t * mt);
@@ -0,0 +1,313 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Conversion of the input samples to the int32 buffers of libFLAC.
+   The kernels widen the samples and shift them right in one pass.
+   The fastest version for the CPU is chosen at runtime. */
+
+#include <string.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gmerlin/plugin.h>
+
+#include <bgflac.h>
+#include "flacmt.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_PACK
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define HAVE_NEON_PACK
+#include <arm_neon.h>
+#endif
+
+
+static void pack_8_c(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int8_t * s = src;
+  for(i = 0; i < num; i++)
+    dst[i] = s[i] >> shift;
+  }
+
+static void pack_16_c(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int16_t * s = src;
+  for(i = 0; i < num; i++)
+    dst[i] = s[i] >> shift;
+  }
+
+static void pack_32_c(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int32_t * s = src;
+
+  if(!shift)
+    {
+    memcpy(dst, src, num * sizeof(*dst));
+    return;
+    }
+  
+  for(i = 0; i < num; i++)
+    dst[i] = s[i] >> shift;
+  }
+
+#ifdef HAVE_X86_PACK
+
+/* SSE2: Sign extension is done by shifting the 8 or 16 bit values
+   to the top of the 32 bit word and back. The final shift is merged
+   into the shift back. */
+
+__attribute__((target("sse2")))
+static void pack_8_sse2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  __m128i x, lo, hi;
+  const int8_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(24 + shift);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    x = _mm_loadu_si128((const __m128i*)(s + i));
+    lo = _mm_unpacklo_epi8(x, x);
+    hi = _mm_unpackhi_epi8(x, x);
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_sra_epi32(_mm_unpacklo_epi16(lo, lo), cnt));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     _mm_sra_epi32(_mm_unpackhi_epi16(lo, lo), cnt));
+    _mm_storeu_si128((__m128i*)(dst + i + 8),
+                     _mm_sra_epi32(_mm_unpacklo_epi16(hi, hi), cnt));
+    _mm_storeu_si128((__m128i*)(dst + i + 12),
+                     _mm_sra_epi32(_mm_unpackhi_epi16(hi, hi), cnt));
+    }
+  pack_8_c(dst + i, s + i, num - i, shift);
+  }
+
+__attribute__((target("sse2")))
+static void pack_16_sse2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  __m128i x;
+  const int16_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(16 + shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = _mm_loadu_si128((const __m128i*)(s + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_sra_epi32(_mm_unpacklo_epi16(x, x), cnt));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     _mm_sra_epi32(_mm_unpackhi_epi16(x, x), cnt));
+    }
+  pack_16_c(dst + i, s + i, num - i, shift);
+  }
+
+__attribute__((target("sse2")))
+static void pack_32_sse2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int32_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+
+  if(!shift)
+    {
+    memcpy(dst, src, num * sizeof(*dst));
+    return;
+    }
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_sra_epi32(_mm_loadu_si128((const __m128i*)(s + i)), cnt));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     _mm_sra_epi32(_mm_loadu_si128((const __m128i*)(s + i + 4)), cnt));
+    }
+  pack_32_c(dst + i, s + i, num - i, shift);
+  }
+
+__attribute__((target("avx2")))
+static void pack_8_avx2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int8_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_sra_epi32(_mm256_cvtepi8_epi32(x), cnt));
+    _mm256_storeu_si256((__m256i*)(dst + i + 8),
+                        _mm256_sra_epi32(_mm256_cvtepi8_epi32(_mm_srli_si128(x, 8)), cnt));
+    }
+  pack_8_c(dst + i, s + i, num - i, shift);
+  }
+
+__attribute__((target("avx2")))
+static void pack_16_avx2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int16_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_sra_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(s + i))), cnt));
+    _mm256_storeu_si256((__m256i*)(dst + i + 8),
+                        _mm256_sra_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(s + i + 8))), cnt));
+    }
+  pack_16_c(dst + i, s + i, num - i, shift);
+  }
+
+__attribute__((target("avx2")))
+static void pack_32_avx2(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int32_t * s = src;
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+
+  if(!shift)
+    {
+    memcpy(dst, src, num * sizeof(*dst));
+    return;
+    }
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_sra_epi32(_mm256_loadu_si256((const __m256i*)(s + i)), cnt));
+    _mm256_storeu_si256((__m256i*)(dst + i + 8),
+                        _mm256_sra_epi32(_mm256_loadu_si256((const __m256i*)(s + i + 8)), cnt));
+    }
+  pack_32_c(dst + i, s + i, num - i, shift);
+  }
+
+#endif
+
+#ifdef HAVE_NEON_PACK
+
+static void pack_8_neon(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  int16x8_t x;
+  const int8_t * s = src;
+  const int32x4_t cnt = vdupq_n_s32(-shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = vmovl_s8(vld1_s8(s + i));
+    vst1q_s32(dst + i,     vshlq_s32(vmovl_s16(vget_low_s16(x)), cnt));
+    vst1q_s32(dst + i + 4, vshlq_s32(vmovl_s16(vget_high_s16(x)), cnt));
+    }
+  pack_8_c(dst + i, s + i, num - i, shift);
+  }
+
+static void pack_16_neon(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  int16x8_t x;
+  const int16_t * s = src;
+  const int32x4_t cnt = vdupq_n_s32(-shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = vld1q_s16(s + i);
+    vst1q_s32(dst + i,     vshlq_s32(vmovl_s16(vget_low_s16(x)), cnt));
+    vst1q_s32(dst + i + 4, vshlq_s32(vmovl_s16(vget_high_s16(x)), cnt));
+    }
+  pack_16_c(dst + i, s + i, num - i, shift);
+  }
+
+static void pack_32_neon(int32_t * dst, const void * src, int num, int shift)
+  {
+  int i;
+  const int32_t * s = src;
+  const int32x4_t cnt = vdupq_n_s32(-shift);
+
+  if(!shift)
+    {
+    memcpy(dst, src, num * sizeof(*dst));
+    return;
+    }
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    vst1q_s32(dst + i,     vshlq_s32(vld1q_s32(s + i), cnt));
+    vst1q_s32(dst + i + 4, vshlq_s32(vld1q_s32(s + i + 4), cnt));
+    }
+  pack_32_c(dst + i, s + i, num - i, shift);
+  }
+
+#endif
+
+/* Index: 0 = 8 bit, 1 = 16 bit, 2 = 32 bit */
+
+static bg_flac_pack_func_t pack_funcs[3];
+
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+
+static void pack_init(void)
+  {
+  pack_funcs[0] = pack_8_c;
+  pack_funcs[1] = pack_16_c;
+  pack_funcs[2] = pack_32_c;
+
+#ifdef HAVE_X86_PACK
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    {
+    pack_funcs[0] = pack_8_avx2;
+    pack_funcs[1] = pack_16_avx2;
+    pack_funcs[2] = pack_32_avx2;
+    }
+  else if(__builtin_cpu_supports("sse2"))
+    {
+    pack_funcs[0] = pack_8_sse2;
+    pack_funcs[1] = pack_16_sse2;
+    pack_funcs[2] = pack_32_sse2;
+    }
+#endif
+
+#ifdef HAVE_NEON_PACK
+  pack_funcs[0] = pack_8_neon;
+  pack_funcs[1] = pack_16_neon;
+  pack_funcs[2] = pack_32_neon;
+#endif
+  }
+
+bg_flac_pack_func_t bg_flac_get_pack_func(int bytes)
+  {
+  pthread_once(&pack_once, pack_init);
+  switch(bytes)
+    {
+    case 1:
+      return pack_funcs[0];
+    case 2:
+      return pack_funcs[1];
+    default:
+      return pack_funcs[2];
+    }
+  }
@@ -0,0 +1,205 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Benchmark for the sample packing of the FLAC encoder. The old code
+   widened the samples with a scalar copy loop and divided every
+   sample by 2^shift in a second pass. The kernels from flacpack.c do
+   both in one pass. The results are checked against an arithmetic
+   shift.
+
+   Usage: flacpack_bench [seconds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <config.h>
+
+#include <gavl/gavl.h>
+#include <gmerlin/plugin.h>
+
+#include <bgflac.h>
+#include "flacmt.h"
+
+/* Stereo at 48 kHz, processed in blocks of the libFLAC default size */
+#define SAMPLERATE   48000
+#define NUM_CHANNELS 2
+#define BLOCK        4096
+
+typedef struct
+  {
+  const char * name;
+  int bytes; /* Bytes per input sample */
+  int bits;  /* Target bits */
+  } pack_mode_t;
+
+static const pack_mode_t modes[] =
+  {
+    { "12 bit", 2, 12 },
+    { "20 bit", 4, 20 },
+    { "24 bit", 4, 24 },
+  };
+
+/* Old code: copy_frame_16 / copy_frame_32 followed by do_shift() */
+
+static void old_pack(int32_t * dst, const void * src, int bytes,
+                     int num, int divisor)
+  {
+  int i;
+
+  if(bytes == 2)
+    {
+    const int16_t * s = src;
+    for(i = 0; i < num; i++)
+      dst[i] = s[i];
+    }
+  else
+    {
+    const int32_t * s = src;
+    for(i = 0; i < num; i++)
+      dst[i] = s[i];
+    }
+  
+  for(i = 0; i < num; i++)
+    dst[i] /= divisor;
+  }
+
+static int32_t ref_sample(const void * src, int bytes, int i, int shift)
+  {
+  if(bytes == 2)
+    return ((const int16_t *)src)[i] >> shift;
+  else
+    return ((const int32_t *)src)[i] >> shift;
+  }
+
+static int run(const pack_mode_t * m, int seconds)
+  {
+  int i, j, k;
+  int shift;
+  int num_blocks;
+  uint8_t * src[NUM_CHANNELS];
+  int32_t * dst;
+  bg_flac_pack_func_t pack;
+  gavl_timer_t * timer;
+  gavl_time_t t_old;
+  gavl_time_t t_new;
+  int64_t samples;
+  int ret = 1;
+  
+  shift = m->bytes * 8 - m->bits;
+  pack = bg_flac_get_pack_func(m->bytes);
+  num_blocks = (int)((int64_t)seconds * SAMPLERATE / BLOCK);
+  samples = (int64_t)num_blocks * BLOCK * NUM_CHANNELS;
+  
+  dst = malloc(BLOCK * sizeof(*dst));
+  
+  for(i = 0; i < NUM_CHANNELS; i++)
+    {
+    src[i] = malloc(BLOCK * m->bytes);
+    for(j = 0; j < BLOCK * m->bytes; j++)
+      src[i][j] = rand() & 0xff;
+    }
+
+  /* Check all lengths up to one block against the reference */
+  for(k = 0; k < 67; k++)
+    {
+    int num = k < 64 ? k : BLOCK - (k - 64);
+    
+    for(i = 0; i < NUM_CHANNELS; i++)
+      {
+      memset(dst, 0x55, BLOCK * sizeof(*dst));
+      pack(dst, src[i], num, shift);
+
+      for(j = 0; j < num; j++)
+        {
+        if(dst[j] != ref_sample(src[i], m->bytes, j, shift))
+          {
+          fprintf(stderr, "%s: Sample %d of %d differs: %"PRId32" != %"PRId32"\n",
+                  m->name, j, num, dst[j], ref_sample(src[i], m->bytes, j, shift));
+          goto fail;
+          }
+        }
+      if(num < BLOCK && dst[num] != 0x55555555)
+        {
+        fprintf(stderr, "%s: Wrote past %d samples\n", m->name, num);
+        goto fail;
+        }
+      }
+    }
+  
+  timer = gavl_timer_create();
+
+  gavl_timer_start(timer);
+  for(i = 0; i < num_blocks; i++)
+    {
+    for(j = 0; j < NUM_CHANNELS; j++)
+      old_pack(dst, src[j], m->bytes, BLOCK, 1 << shift);
+    }
+  t_old = gavl_timer_get(timer);
+  gavl_timer_stop(timer);
+  gavl_timer_destroy(timer);
+  
+  timer = gavl_timer_create();
+  gavl_timer_start(timer);
+  for(i = 0; i < num_blocks; i++)
+    {
+    for(j = 0; j < NUM_CHANNELS; j++)
+      pack(dst, src[j], BLOCK, shift);
+    }
+  t_new = gavl_timer_get(timer);
+  gavl_timer_stop(timer);
+  gavl_timer_destroy(timer);
+
+  printf("%-7s copy+divide %8.1f Msamples/s, fused %8.1f Msamples/s\n",
+         m->name,
+         (double)samples / (double)(t_old ? t_old : 1) * GAVL_TIME_SCALE / 1.0e6,
+         (double)samples / (double)(t_new ? t_new : 1) * GAVL_TIME_SCALE / 1.0e6);
+  ret = 0;
+  
+  fail:
+  
+  for(i = 0; i < NUM_CHANNELS; i++)
+    free(src[i]);
+  free(dst);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int seconds = 3600;
+  int ret = 0;
+  
+  if(argc > 1)
+    seconds = atoi(argv[1]);
+  if(seconds < 1)
+    seconds = 1;
+
+  printf("%d seconds of %d channels at %d Hz\n",
+         seconds, NUM_CHANNELS, SAMPLERATE);
+  
+  for(i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    {
+    if(run(&modes[i], seconds))
+      ret = 1;
+    }
+  return ret;
+  }
@@ -0,0 +1,301 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Encoder thread: The frames of the application go through a bounded
+   queue to a thread, which calls the synchronous sink of the codec.
+   The frames are handed out through get_frame(), so the application
+   can write into them directly. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "framequeue"
+
+/* Frames queued per stream */
+#define NUM_FRAMES 4
+
+struct bgen_frame_queue_s
+  {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int running;
+
+  gavl_audio_frame_t * aframes[NUM_FRAMES];
+  gavl_video_frame_t * vframes[NUM_FRAMES];
+  int read_pos;
+  int num_queued;
+  int busy;
+  int quit;
+  int error;
+
+  /* Synchronous sinks of the codec */
+  gavl_audio_sink_t * codec_asink;
+  gavl_video_sink_t * codec_vsink;
+
+  /* Sinks for the application */
+  gavl_audio_sink_t * asink;
+  gavl_video_sink_t * vsink;
+  };
+
+static void * thread_func(void * data)
+  {
+  int idx;
+  gavl_sink_status_t st;
+  bgen_frame_queue_t * q = data;
+
+  pthread_mutex_lock(&q->mutex);
+
+  while(1)
+    {
+    while(!q->num_queued && !q->quit)
+      pthread_cond_wait(&q->cond, &q->mutex);
+
+    if(!q->num_queued)
+      break;
+
+    idx = q->read_pos;
+    q->busy = 1;
+    pthread_mutex_unlock(&q->mutex);
+
+    if(q->codec_asink)
+      st = gavl_audio_sink_put_frame(q->codec_asink, q->aframes[idx]);
+    else
+      st = gavl_video_sink_put_frame(q->codec_vsink, q->vframes[idx]);
+
+    pthread_mutex_lock(&q->mutex);
+    q->busy = 0;
+    q->read_pos = (q->read_pos + 1) % NUM_FRAMES;
+    q->num_queued--;
+    if(st != GAVL_SINK_OK)
+      q->error = 1;
+    pthread_cond_broadcast(&q->cond);
+    }
+
+  pthread_mutex_unlock(&q->mutex);
+  return NULL;
+  }
+
+/* Wait for a free slot, must be called with locked mutex.
+   Returns the slot index or -1 on error */
+
+static int get_slot(bgen_frame_queue_t * q)
+  {
+  while((q->num_queued == NUM_FRAMES) && !q->error)
+    pthread_cond_wait(&q->cond, &q->mutex);
+
+  if(q->error)
+    return -1;
+
+  return (q->read_pos + q->num_queued) % NUM_FRAMES;
+  }
+
+static gavl_audio_frame_t * get_audio_func(void * data)
+  {
+  int slot;
+  bgen_frame_queue_t * q = data;
+
+  pthread_mutex_lock(&q->mutex);
+  slot = get_slot(q);
+  pthread_mutex_unlock(&q->mutex);
+
+  if(slot < 0)
+    return NULL;
+  return q->aframes[slot];
+  }
+
+static gavl_video_frame_t * get_video_func(void * data)
+  {
+  int slot;
+  bgen_frame_queue_t * q = data;
+
+  pthread_mutex_lock(&q->mutex);
+  slot = get_slot(q);
+  pthread_mutex_unlock(&q->mutex);
+
+  if(slot < 0)
+    return NULL;
+  return q->vframes[slot];
+  }
+
+static gavl_sink_status_t put_audio_func(void * data, gavl_audio_frame_t * f)
+  {
+  int slot;
+  gavl_audio_frame_t * dst;
+  const gavl_audio_format_t * fmt;
+  bgen_frame_queue_t * q = data;
+
+  pthread_mutex_lock(&q->mutex);
+
+  if((slot = get_slot(q)) < 0)
+    {
+    pthread_mutex_unlock(&q->mutex);
+    return GAVL_SINK_ERROR;
+    }
+
+  /* Frames not obtained by get_audio_func are copied */
+  dst = q->aframes[slot];
+  if(f != dst)
+    {
+    fmt = gavl_audio_sink_get_format(q->codec_asink);
+    gavl_audio_frame_copy(fmt, dst, f, 0, 0,
+                          fmt->samples_per_frame, f->valid_samples);
+    dst->valid_samples = f->valid_samples;
+    dst->timestamp = f->timestamp;
+    }
+
+  q->num_queued++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+  return GAVL_SINK_OK;
+  }
+
+static gavl_sink_status_t put_video_func(void * data, gavl_video_frame_t * f)
+  {
+  int slot;
+  gavl_video_frame_t * dst;
+  bgen_frame_queue_t * q = data;
+
+  pthread_mutex_lock(&q->mutex);
+
+  if((slot = get_slot(q)) < 0)
+    {
+    pthread_mutex_unlock(&q->mutex);
+    return GAVL_SINK_ERROR;
+    }
+
+  dst = q->vframes[slot];
+  if(f != dst)
+    {
+    gavl_video_frame_copy(gavl_video_sink_get_format(q->codec_vsink), dst, f);
+    gavl_video_frame_copy_metadata(dst, f);
+    }
+
+  q->num_queued++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+  return GAVL_SINK_OK;
+  }
+
+static bgen_frame_queue_t * create_queue(bgen_frame_queue_t * q)
+  {
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+
+  if(pthread_create(&q->thread, NULL, thread_func, q))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot create encoder thread");
+    bgen_frame_queue_destroy(q);
+    return NULL;
+    }
+  q->running = 1;
+  return q;
+  }
+
+bgen_frame_queue_t * bgen_frame_queue_create_audio(gavl_audio_sink_t * sink)
+  {
+  int i;
+  const gavl_audio_format_t * fmt = gavl_audio_sink_get_format(sink);
+  bgen_frame_queue_t * q = calloc(1, sizeof(*q));
+
+  q->codec_asink = sink;
+  for(i = 0; i < NUM_FRAMES; i++)
+    q->aframes[i] = gavl_audio_frame_create(fmt);
+  q->asink = gavl_audio_sink_create(get_audio_func, put_audio_func, q, fmt);
+  return create_queue(q);
+  }
+
+bgen_frame_queue_t * bgen_frame_queue_create_video(gavl_video_sink_t * sink)
+  {
+  int i;
+  const gavl_video_format_t * fmt = gavl_video_sink_get_format(sink);
+  bgen_frame_queue_t * q = calloc(1, sizeof(*q));
+
+  q->codec_vsink = sink;
+  for(i = 0; i < NUM_FRAMES; i++)
+    q->vframes[i] = gavl_video_frame_create(fmt);
+  q->vsink = gavl_video_sink_create(get_video_func, put_video_func, q, fmt);
+  return create_queue(q);
+  }
+
+gavl_audio_sink_t * bgen_frame_queue_get_audio_sink(bgen_frame_queue_t * q)
+  {
+  return q->asink;
+  }
+
+gavl_video_sink_t * bgen_frame_queue_get_video_sink(bgen_frame_queue_t * q)
+  {
+  return q->vsink;
+  }
+
+int bgen_frame_queue_sync(bgen_frame_queue_t * q)
+  {
+  int ret;
+  
+  pthread_mutex_lock(&q->mutex);
+  while(q->num_queued || q->busy)
+    pthread_cond_wait(&q->cond, &q->mutex);
+  ret = !q->error;
+  pthread_mutex_unlock(&q->mutex);
+  return ret;
+  }
+
+int bgen_frame_queue_finish(bgen_frame_queue_t * q)
+  {
+  if(q->running)
+    {
+    pthread_mutex_lock(&q->mutex);
+    q->quit = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+
+    pthread_join(q->thread, NULL);
+    q->running = 0;
+    }
+  return !q->error;
+  }
+
+void bgen_frame_queue_destroy(bgen_frame_queue_t * q)
+  {
+  int i;
+
+  bgen_frame_queue_finish(q);
+
+  for(i = 0; i < NUM_FRAMES; i++)
+    {
+    if(q->aframes[i])
+      gavl_audio_frame_destroy(q->aframes[i]);
+    if(q->vframes[i])
+      gavl_video_frame_destroy(q->vframes[i]);
+    }
+
+  if(q->asink)
+    gavl_audio_sink_destroy(q->asink);
+  if(q->vsink)
+    gavl_video_sink_destroy(q->vsink);
+
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->cond);
+  free(q);
+  }
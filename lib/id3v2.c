@@ -0,0 +1,176 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "id3v2"
+
+/* Padded ID3V2 tags. The tag itself is rendered by libgmerlin,
+   we only append zeros and adjust the size in the header. */
+
+#define HEADER_SIZE 10
+#define FLAG_FOOTER 0x10
+
+static int get_syncsafe(const uint8_t * ptr)
+  {
+  return (ptr[0] << 21) | (ptr[1] << 14) | (ptr[2] << 7) | ptr[3];
+  }
+
+static void set_syncsafe(uint8_t * ptr, int val)
+  {
+  ptr[0] = (val >> 21) & 0x7f;
+  ptr[1] = (val >> 14) & 0x7f;
+  ptr[2] = (val >> 7) & 0x7f;
+  ptr[3] = val & 0x7f;
+  }
+
+static int check_header(const uint8_t * ptr)
+  {
+  if((ptr[0] != 'I') || (ptr[1] != 'D') || (ptr[2] != '3') ||
+     (ptr[3] < 2) || (ptr[3] > 4) ||
+     ((ptr[6] | ptr[7] | ptr[8] | ptr[9]) & 0x80))
+    return 0;
+  return 1;
+  }
+
+/* Render the tag */
+
+static uint8_t * render_tag(const gavl_dictionary_t * m,
+                            int add_cover, int charset, int * len)
+  {
+  gavl_io_t * io;
+  bg_id3v2_t * id3v2;
+  uint8_t * buf;
+  int tag_len;
+
+  io = gavl_io_create_mem_write();
+  id3v2 = bg_id3v2_create(m, add_cover);
+  bg_id3v2_write(io, id3v2, charset);
+  bg_id3v2_destroy(id3v2);
+  
+  buf = gavl_io_mem_get_buf(io, &tag_len);
+  gavl_io_destroy(io);
+
+  if((tag_len < HEADER_SIZE) || !check_header(buf))
+    {
+    if(buf)
+      free(buf);
+    return NULL;
+    }
+  
+  *len = tag_len;
+  return buf;
+  }
+
+/* Pad a rendered tag to total_len bytes (if larger) */
+
+static uint8_t * pad_tag(uint8_t * buf, int * len, int total_len)
+  {
+  /* Padding is not allowed together with a footer */
+  if((total_len > *len) && !(buf[5] & FLAG_FOOTER))
+    {
+    buf = realloc(buf, total_len);
+    memset(buf + *len, 0, total_len - *len);
+    set_syncsafe(buf + 6, total_len - HEADER_SIZE);
+    *len = total_len;
+    }
+  return buf;
+  }
+
+int bgen_id3v2_write(gavl_io_t * output, const gavl_dictionary_t * m,
+                     int add_cover, int charset,
+                     int padding, int padding_percent)
+  {
+  uint8_t * buf;
+  int len = 0;
+  int ret;
+  
+  if(!(buf = render_tag(m, add_cover, charset, &len)))
+    return 0;
+
+  padding += ((int64_t)len * padding_percent) / 100;
+
+  if(padding > 0)
+    buf = pad_tag(buf, &len, len + padding);
+  
+  ret = (gavl_io_write_data(output, buf, len) == len);
+  free(buf);
+  return ret;
+  }
+
+int bgen_id3v2_update(const char * filename, const gavl_dictionary_t * m,
+                      int add_cover, int charset)
+  {
+  FILE * f;
+  uint8_t header[HEADER_SIZE];
+  uint8_t * buf = NULL;
+  int old_len;
+  int len = 0;
+  int ret = 0;
+  
+  if(!(f = fopen(filename, "r+b")))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot open %s: %s",
+             filename, strerror(errno));
+    return 0;
+    }
+
+  if((fread(header, 1, HEADER_SIZE, f) < HEADER_SIZE) ||
+     !check_header(header))
+    goto end;
+  
+  old_len = HEADER_SIZE + get_syncsafe(header + 6);
+  if(header[5] & FLAG_FOOTER)
+    old_len += HEADER_SIZE;
+
+  /* The new tag must fill the old one exactly, otherwise the audio
+     data would have to be moved */
+  
+  if(!(buf = render_tag(m, add_cover, charset, &len)))
+    goto end;
+
+  buf = pad_tag(buf, &len, old_len);
+  if(len != old_len)
+    goto end;
+
+  if(fseek(f, 0, SEEK_SET) ||
+     (fwrite(buf, 1, len, f) < len) ||
+     fflush(f))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Writing ID3V2 tag to %s failed: %s",
+             filename, strerror(errno));
+    goto end;
+    }
+  ret = 1;
+  
+  end:
+
+  if(buf)
+    free(buf);
+  fclose(f);
+  return ret;
+  }
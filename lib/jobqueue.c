@@ -0,0 +1,245 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Parallel jobs: num_threads worker threads process the jobs of a
+   ring, which is owned by the caller. The jobs are submitted and
+   released in ring order, so the results can be passed on in the
+   order of the input. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "jobqueue"
+
+typedef enum
+  {
+    JOB_FREE = 0,
+    JOB_QUEUED,
+    JOB_BUSY,
+    JOB_DONE,
+  } job_state_t;
+
+typedef struct
+  {
+  job_state_t state;
+  int error;
+  } job_t;
+
+typedef struct
+  {
+  pthread_t thread;
+  int index;
+  bgen_job_queue_t * q;
+  } worker_t;
+
+struct bgen_job_queue_s
+  {
+  int (*process)(void * priv, int job, int thread);
+  void * priv;
+
+  worker_t * workers;
+  int workers_started;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int quit;
+
+  /* Jobs between head and head + num_used (excluding) are in use */
+  job_t * jobs;
+  int num_jobs;
+  int head;
+  int num_used;
+  };
+
+static void * thread_func(void * data)
+  {
+  int i;
+  int idx;
+  int result;
+  worker_t * w = data;
+  bgen_job_queue_t * q = w->q;
+
+  pthread_mutex_lock(&q->mutex);
+
+  while(1)
+    {
+    idx = -1;
+
+    for(i = 0; i < q->num_used; i++)
+      {
+      if(q->jobs[(q->head + i) % q->num_jobs].state == JOB_QUEUED)
+        {
+        idx = (q->head + i) % q->num_jobs;
+        break;
+        }
+      }
+
+    if(idx < 0)
+      {
+      if(q->quit)
+        break;
+      pthread_cond_wait(&q->cond, &q->mutex);
+      continue;
+      }
+
+    q->jobs[idx].state = JOB_BUSY;
+    pthread_mutex_unlock(&q->mutex);
+
+    result = q->process(q->priv, idx, w->index);
+
+    pthread_mutex_lock(&q->mutex);
+    q->jobs[idx].error = !result;
+    q->jobs[idx].state = JOB_DONE;
+    pthread_cond_broadcast(&q->cond);
+    }
+
+  pthread_mutex_unlock(&q->mutex);
+  return NULL;
+  }
+
+bgen_job_queue_t *
+bgen_job_queue_create(int num_threads, int num_jobs,
+                      int (*process)(void * priv, int job, int thread),
+                      void * priv)
+  {
+  int i;
+  bgen_job_queue_t * q;
+
+  if((num_threads < 1) || (num_jobs < 1))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Invalid number of threads (%d) or jobs (%d)",
+             num_threads, num_jobs);
+    return NULL;
+    }
+  
+  q = calloc(1, sizeof(*q));
+
+  q->process = process;
+  q->priv = priv;
+
+  q->num_jobs = num_jobs;
+  q->jobs = calloc((size_t)num_jobs, sizeof(*q->jobs));
+  q->workers = calloc((size_t)num_threads, sizeof(*q->workers));
+
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+
+  for(i = 0; i < num_threads; i++)
+    {
+    q->workers[i].q = q;
+    q->workers[i].index = i;
+    if(pthread_create(&q->workers[i].thread, NULL, thread_func, &q->workers[i]))
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot create encoder thread");
+      bgen_job_queue_destroy(q);
+      return NULL;
+      }
+    q->workers_started++;
+    }
+  return q;
+  }
+
+int bgen_job_queue_num_used(bgen_job_queue_t * q)
+  {
+  return q->num_used;
+  }
+
+int bgen_job_queue_get_job(bgen_job_queue_t * q, int n)
+  {
+  return (q->head + n) % q->num_jobs;
+  }
+
+int bgen_job_queue_get_free(bgen_job_queue_t * q)
+  {
+  if(q->num_used == q->num_jobs)
+    return -1;
+  return (q->head + q->num_used) % q->num_jobs;
+  }
+
+void bgen_job_queue_submit(bgen_job_queue_t * q)
+  {
+  job_t * job = &q->jobs[(q->head + q->num_used) % q->num_jobs];
+
+  pthread_mutex_lock(&q->mutex);
+  job->error = 0;
+  job->state = JOB_QUEUED;
+  q->num_used++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+  }
+
+int bgen_job_queue_wait(bgen_job_queue_t * q, int n, int wait)
+  {
+  int ret;
+  job_t * job = &q->jobs[(q->head + n) % q->num_jobs];
+
+  pthread_mutex_lock(&q->mutex);
+
+  if(wait)
+    {
+    while(job->state != JOB_DONE)
+      pthread_cond_wait(&q->cond, &q->mutex);
+    }
+
+  if(job->state != JOB_DONE)
+    ret = 0;
+  else if(job->error)
+    ret = -1;
+  else
+    ret = 1;
+  
+  pthread_mutex_unlock(&q->mutex);
+  return ret;
+  }
+
+void bgen_job_queue_release(bgen_job_queue_t * q)
+  {
+  pthread_mutex_lock(&q->mutex);
+  q->jobs[q->head].state = JOB_FREE;
+  q->head = (q->head + 1) % q->num_jobs;
+  q->num_used--;
+  pthread_mutex_unlock(&q->mutex);
+  }
+
+void bgen_job_queue_destroy(bgen_job_queue_t * q)
+  {
+  int i;
+
+  /* Unfinished jobs are still processed, but not released */
+  pthread_mutex_lock(&q->mutex);
+  q->quit = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+
+  for(i = 0; i < q->workers_started; i++)
+    pthread_join(q->workers[i].thread, NULL);
+
+  free(q->workers);
+  free(q->jobs);
+
+  pthread_mutex_destroy(&q->mutex);
+  pthread_cond_destroy(&q->cond);
+  free(q);
+  }
@@ -0,0 +1,124 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <gmerlin_encoders.h>
+
+/* Seek index with bounded memory: Points are only accepted if they are
+   at least spacing apart from the last accepted one. The spacing is the
+   average distance of the points in the index, so it adapts to the
+   units of the time (samples or frames) and to points taken over from
+   an existing file. Dropping every other point doubles the distance. */
+
+void bgen_seek_index_init(bgen_seek_index_t * idx, int max_points)
+  {
+  memset(idx, 0, sizeof(*idx));
+
+  /* Need at least 2 points for halving */
+  if(max_points < 2)
+    max_points = 2;
+
+  idx->max_points = max_points;
+  idx->points = malloc(max_points * sizeof(*idx->points));
+
+  /* Accept the first points until we know their distance */
+  idx->spacing = 1;
+  }
+
+static void update_spacing(bgen_seek_index_t * idx)
+  {
+  if(idx->num_points < 2)
+    return;
+  
+  idx->spacing = (idx->points[idx->num_points-1].time - idx->points[0].time) /
+    (idx->num_points - 1);
+
+  if(idx->spacing < 1)
+    idx->spacing = 1;
+  }
+
+static void halve(bgen_seek_index_t * idx)
+  {
+  int i;
+
+  /* Keep the even entries, the first one is always kept */
+  for(i = 1; 2 * i < idx->num_points; i++)
+    idx->points[i] = idx->points[2 * i];
+
+  idx->num_points = (idx->num_points + 1) / 2;
+  update_spacing(idx);
+  }
+
+void bgen_seek_index_append(bgen_seek_index_t * idx,
+                            int64_t time, int64_t position, int duration)
+  {
+  bgen_seek_point_t * p;
+
+  if(idx->num_points &&
+     (time < idx->points[idx->num_points-1].time + idx->spacing))
+    return;
+
+  if(idx->num_points == idx->max_points)
+    {
+    halve(idx);
+
+    /* Check again with the new spacing */
+    if(time < idx->points[idx->num_points-1].time + idx->spacing)
+      return;
+    }
+
+  p = idx->points + idx->num_points;
+  p->time = time;
+  p->position = position;
+  p->duration = duration;
+  idx->num_points++;
+  update_spacing(idx);
+  }
+
+const bgen_seek_point_t *
+bgen_seek_index_lookup(const bgen_seek_index_t * idx, int64_t time)
+  {
+  int lo, hi, mid;
+
+  if(!idx->num_points || (time < idx->points[0].time))
+    return NULL;
+
+  /* Binary search: points[lo].time <= time < points[hi].time */
+  lo = 0;
+  hi = idx->num_points;
+
+  while(hi - lo > 1)
+    {
+    mid = (lo + hi) / 2;
+    if(idx->points[mid].time <= time)
+      lo = mid;
+    else
+      hi = mid;
+    }
+  return idx->points + lo;
+  }
+
+void bgen_seek_index_free(bgen_seek_index_t * idx)
+  {
+  if(idx->points)
+    free(idx->points);
+  memset(idx, 0, sizeof(*idx));
+  }
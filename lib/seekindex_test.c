@@ -0,0 +1,194 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Test for the seek index: The points must be spread evenly over the
+   whole stream for sample based times (FLAC), frame numbers (Xing),
+   variable frame durations and for points taken over from an
+   existing file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <gmerlin_encoders.h>
+
+#define MAX_POINTS 200
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void)
+  {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+  }
+
+/* Check that the points cover [0, end] evenly:
+   No gap is more than twice the average gap (plus one frame) and
+   each quarter of the stream has about a quarter of the points */
+
+static int check_index(const char * name, const bgen_seek_index_t * idx,
+                       int64_t end, int max_duration, int min_points)
+  {
+  int i;
+  int64_t gap;
+  int64_t max_gap = 0;
+  double avg_gap;
+  int quarters[4] = { 0, 0, 0, 0 };
+  int q;
+  const bgen_seek_point_t * p = idx->points;
+  
+  if(idx->num_points < min_points)
+    {
+    fprintf(stderr, "%s: Only %d points\n", name, idx->num_points);
+    return 0;
+    }
+
+  if(p[0].time != 0)
+    {
+    fprintf(stderr, "%s: First point at %"PRId64"\n", name, p[0].time);
+    return 0;
+    }
+  
+  avg_gap = (double)end / idx->num_points;
+  
+  for(i = 1; i <= idx->num_points; i++)
+    {
+    gap = (i < idx->num_points ? p[i].time : end) - p[i-1].time;
+    if(gap > max_gap)
+      max_gap = gap;
+    }
+
+  for(i = 0; i < idx->num_points; i++)
+    {
+    q = (int)(p[i].time * 4 / end);
+    quarters[q]++;
+    }
+  
+  printf("%-10s %3d points, average gap %10.1f, max gap %8"PRId64", quarters %d %d %d %d\n",
+         name, idx->num_points, avg_gap, max_gap,
+         quarters[0], quarters[1], quarters[2], quarters[3]);
+
+  if(max_gap > 2 * avg_gap + max_duration)
+    {
+    fprintf(stderr, "%s: Gap too large\n", name);
+    return 0;
+    }
+  
+  for(i = 0; i < 4; i++)
+    {
+    if((quarters[i] < idx->num_points * 3 / 16) ||
+       (quarters[i] > idx->num_points * 5 / 16))
+      {
+      fprintf(stderr, "%s: Points not evenly distributed\n", name);
+      return 0;
+      }
+    }
+  return 1;
+  }
+
+/* Constant frame duration */
+
+static int test_constant(const char * name, int num_frames, int duration)
+  {
+  int i;
+  int ret;
+  bgen_seek_index_t idx;
+
+  bgen_seek_index_init(&idx, MAX_POINTS);
+
+  for(i = 0; i < num_frames; i++)
+    bgen_seek_index_append(&idx, (int64_t)i * duration, (int64_t)i * 1000,
+                           duration);
+
+  ret = check_index(name, &idx, (int64_t)num_frames * duration, duration,
+                    MAX_POINTS / 2);
+  bgen_seek_index_free(&idx);
+  return ret;
+  }
+
+/* Random frame durations */
+
+static int test_variable(const char * name, int num_frames)
+  {
+  int i;
+  int ret;
+  int duration;
+  int64_t time = 0;
+  bgen_seek_index_t idx;
+
+  bgen_seek_index_init(&idx, MAX_POINTS);
+
+  for(i = 0; i < num_frames; i++)
+    {
+    duration = 1 + rng() % 4608;
+    bgen_seek_index_append(&idx, time, (int64_t)i * 1000, duration);
+    time += duration;
+    }
+  
+  ret = check_index(name, &idx, time, 4608, MAX_POINTS / 2);
+  bgen_seek_index_free(&idx);
+  return ret;
+  }
+
+/* Points of an existing seektable, followed by the frames appended
+   after reopening the file */
+
+static int test_append(const char * name, int num_old, int num_frames,
+                       int duration)
+  {
+  int i;
+  int ret;
+  int64_t old_end;
+  int64_t time;
+  bgen_seek_index_t idx;
+  
+  bgen_seek_index_init(&idx, MAX_POINTS);
+
+  old_end = (int64_t)num_frames / 2 * duration;
+  
+  for(i = 0; i < num_old; i++)
+    bgen_seek_index_append(&idx, old_end * i / num_old, i * 1000, duration);
+
+  for(time = old_end; time < (int64_t)num_frames * duration; time += duration)
+    bgen_seek_index_append(&idx, time, time, duration);
+  
+  /* The appended points keep the distance of the old ones */
+  ret = check_index(name, &idx, (int64_t)num_frames * duration, duration,
+                    num_old * 2 < MAX_POINTS / 2 ? num_old * 2 : MAX_POINTS / 2);
+  bgen_seek_index_free(&idx);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int ret = 1;
+
+  if(!test_constant("flac", 1000000, 4096) ||
+     !test_constant("xing", 1000000, 1) ||
+     !test_constant("short", 1000, 4096) ||
+     !test_variable("variable", 1000000) ||
+     !test_append("append", MAX_POINTS / 2, 1000000, 4096) ||
+     !test_append("append2", 20, 1000000, 4096))
+    ret = 0;
+  
+  return ret ? 0 : 1;
+  }
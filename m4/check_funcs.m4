@@ -253,6 +253,19 @@ AM_CONDITIONAL(HAVE_FLAC, test x$have_flac = xtrue)
 
 if test x$have_flac = xtrue; then
 AC_DEFINE(HAVE_FLAC)
+
+OLD_CFLAGS=$CFLAGS
+OLD_LIBS=$LIBS
+
+CFLAGS="$FLAC_CFLAGS"
+LIBS="$FLAC_LIBS"
+
+dnl libFLAC >= 1.5.0 can encode with multiple threads
+AC_CHECK_FUNCS(FLAC__stream_encoder_set_num_threads)
+
+CFLAGS="$OLD_CFLAGS"
+LIBS="$OLD_LIBS"
+
 fi
 
 ])
@@ -330,3 +343,40 @@ fi
 
 ])
 
+
+dnl
+dnl libshout
+dnl
+
+AC_DEFUN([GMERLIN_CHECK_SHOUT],[
+
+AH_TEMPLATE([HAVE_SHOUT],
+            [Do we have libshout installed?])
+
+have_shout="false"
+
+SHOUT_REQUIRED="2.2.2"
+
+AC_ARG_ENABLE(shout,
+[AS_HELP_STRING([--disable-shout],[Disable libshout (default: autodetect)])],
+[case "${enableval}" in
+   yes) test_shout=true ;;
+   no)  test_shout=false ;;
+esac],[test_shout=true])
+
+if test x$test_shout = xtrue; then
+
+PKG_CHECK_MODULES(SHOUT, shout >= $SHOUT_REQUIRED, have_shout="true", have_shout="false")
+fi
+
+AC_SUBST(SHOUT_REQUIRED)
+AC_SUBST(SHOUT_LIBS)
+AC_SUBST(SHOUT_CFLAGS)
+
+AM_CONDITIONAL(HAVE_SHOUT, test x$have_shout = xtrue)
+
+if test "x$have_shout" = "xtrue"; then
+AC_DEFINE([HAVE_SHOUT])
+fi
+
+])
@@ -0,0 +1,474 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Chunk parallel encoding for file output: The video is cut into
+   chunks of at most chunk_frames frames. Each chunk is encoded by a
+   fresh AVCodecContext in a worker thread, so it starts with a
+   keyframe and doesn't reference frames of other chunks.
+
+   All encoders have the same settings and hence the same reordering
+   delay, so the timestamps of the stitched packets are continuous.
+   For the same reason, their global headers equal the one of the
+   main context, which is passed to the muxer.
+   The frames are passed to the pts cache just before the packets,
+   which need them, so the cache holds only the reordered frames. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ffmpeg_common.h"
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "ffmpeg_chunkmt"
+
+/* Scene detection: The luma (or whatever plane 0 contains) is
+   averaged over SCENE_BLOCKS x SCENE_BLOCKS blocks. A scene change
+   is detected, if the block averages differ by more than
+   SCENE_THRESHOLD on average */
+
+#define SCENE_BLOCKS    8
+#define SCENE_THRESHOLD 24
+
+typedef struct
+  {
+  gavl_video_frame_t ** frames;
+  int num_frames;
+
+  AVFrame * avframe;
+  AVFrame * conv; /* Scratch frame for the pixelformat conversion */
+  
+  AVPacket ** pkts;
+  int num_pkts;
+  int pkts_alloc;
+  } job_t;
+
+struct bg_ffmpeg_chunk_mt_s
+  {
+  bg_ffmpeg_codec_context_t * ctx;
+
+  int chunk_frames;
+  int scene_cut;
+  
+  /* The job after the submitted ones is filled by the application */
+  bgen_job_queue_t * q;
+  job_t * jobs;
+  int num_jobs;
+
+  /* Block averages of the last frame */
+  uint8_t scene[SCENE_BLOCKS * SCENE_BLOCKS];
+  int have_scene;
+  
+  gavl_video_sink_t * sink;
+  };
+
+/* Encoding (worker threads) */
+
+static AVPacket * next_packet(job_t * job)
+  {
+  if(job->num_pkts == job->pkts_alloc)
+    {
+    job->pkts_alloc += 64;
+    job->pkts = realloc(job->pkts, job->pkts_alloc * sizeof(*job->pkts));
+    memset(job->pkts + job->num_pkts, 0,
+           (job->pkts_alloc - job->num_pkts) * sizeof(*job->pkts));
+    }
+  if(!job->pkts[job->num_pkts])
+    job->pkts[job->num_pkts] = av_packet_alloc();
+  return job->pkts[job->num_pkts];
+  }
+
+static int receive_packets(AVCodecContext * avctx, job_t * job)
+  {
+  int result;
+  
+  while(1)
+    {
+    result = avcodec_receive_packet(avctx, next_packet(job));
+    
+    if((result == AVERROR(EAGAIN)) || (result == AVERROR_EOF))
+      return 1;
+    else if(result < 0)
+      return 0;
+    
+    job->num_pkts++;
+    }
+  }
+
+static int encode_job(void * priv, int idx, int thread)
+  {
+  int i;
+  int ret = 0;
+  AVCodecContext * avctx;
+  bg_ffmpeg_chunk_mt_t * mt = priv;
+  job_t * job = &mt->jobs[idx];
+
+  if(!(avctx = bg_ffmpeg_codec_clone_video(mt->ctx)))
+    return 0;
+  
+  for(i = 0; i < job->num_frames; i++)
+    {
+    bg_ffmpeg_codec_prepare_video_frame(mt->ctx, job->frames[i],
+                                        job->avframe, job->conv);
+
+    if((avcodec_send_frame(avctx, job->avframe) < 0) ||
+       !receive_packets(avctx, job))
+      goto end;
+    }
+
+  /* Flush */
+  if((avcodec_send_frame(avctx, NULL) < 0) ||
+     !receive_packets(avctx, job))
+    goto end;
+
+  ret = 1;
+  
+  end:
+  
+  avcodec_free_context(&avctx);
+  return ret;
+  }
+
+/* Stitching (application thread) */
+
+static gavl_sink_status_t emit_job(bg_ffmpeg_chunk_mt_t * mt, job_t * job)
+  {
+  int i;
+  int frame = 0;
+  int64_t pts;
+  bg_ffmpeg_codec_context_t * ctx = mt->ctx;
+  gavl_sink_status_t st = GAVL_SINK_OK;
+  
+  for(i = 0; i < job->num_pkts; i++)
+    {
+    pts = job->pkts[i]->pts;
+    if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+      pts *= ctx->vfmt.frame_duration;
+    
+    /* Frames up to this packet */
+    while((frame < job->num_frames) &&
+          (job->frames[frame]->timestamp <= pts))
+      {
+      if(!bg_encoder_pts_cache_push_frame(ctx->pc, job->frames[frame]))
+        {
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "PTS cache full");
+        st = GAVL_SINK_ERROR;
+        break;
+        }
+      frame++;
+      }
+
+    if(st == GAVL_SINK_OK)
+      {
+      bg_ffmpeg_codec_put_video_packet(ctx, job->pkts[i]);
+      if(ctx->flags & FLAG_ERROR)
+        st = GAVL_SINK_ERROR;
+      }
+    av_packet_unref(job->pkts[i]);
+    }
+  
+  job->num_pkts = 0;
+  job->num_frames = 0;
+  return st;
+  }
+
+/* Emit finished jobs in order. If wait is nonzero, wait
+   until the oldest job is done */
+
+static gavl_sink_status_t drain(bg_ffmpeg_chunk_mt_t * mt, int wait)
+  {
+  int result;
+  gavl_sink_status_t st;
+  
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(!(result = bgen_job_queue_wait(mt->q, 0, wait)))
+      break;
+
+    if(result < 0)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Encoding chunk failed");
+      return GAVL_SINK_ERROR;
+      }
+    
+    st = emit_job(mt, &mt->jobs[bgen_job_queue_get_job(mt->q, 0)]);
+    bgen_job_queue_release(mt->q);
+
+    if(st != GAVL_SINK_OK)
+      return st;
+    
+    /* Only wait for one job */
+    wait = 0;
+    }
+  
+  return GAVL_SINK_OK;
+  }
+
+/* Input (application thread) */
+
+static job_t * get_fill(bg_ffmpeg_chunk_mt_t * mt)
+  {
+  /* One job is always kept for the application */
+  if((bgen_job_queue_num_used(mt->q) == mt->num_jobs - 1) &&
+     (drain(mt, 1) != GAVL_SINK_OK))
+    return NULL;
+  return &mt->jobs[bgen_job_queue_get_free(mt->q)];
+  }
+
+/* Update the block averages and check for a scene change */
+
+static int detect_scene_change(bg_ffmpeg_chunk_mt_t * mt,
+                               const gavl_video_frame_t * f)
+  {
+  int i, j, x, y;
+  int bx, by;
+  int bw, bh;
+  int sum, num;
+  int diff = 0;
+  uint8_t avg;
+  const uint8_t * ptr;
+  const gavl_video_format_t * fmt = &mt->ctx->vfmt;
+  int bytes = gavl_pixelformat_bytes_per_pixel(fmt->pixelformat);
+
+  if(bytes < 1)
+    bytes = 1;
+
+  bw = (fmt->image_width  * bytes) / SCENE_BLOCKS;
+  bh = fmt->image_height / SCENE_BLOCKS;
+
+  if(!bw || !bh)
+    return 0;
+  
+  for(i = 0; i < SCENE_BLOCKS; i++)
+    {
+    by = i * bh;
+    for(j = 0; j < SCENE_BLOCKS; j++)
+      {
+      bx = j * bw;
+      sum = 0;
+      num = 0;
+
+      /* Every 4th byte of every 4th line is enough */
+      for(y = 0; y < bh; y += 4)
+        {
+        ptr = f->planes[0] + (by + y) * f->strides[0] + bx;
+        for(x = 0; x < bw; x += 4)
+          {
+          sum += ptr[x];
+          num++;
+          }
+        }
+      avg = sum / num;
+      diff += abs(avg - mt->scene[i * SCENE_BLOCKS + j]);
+      mt->scene[i * SCENE_BLOCKS + j] = avg;
+      }
+    }
+
+  if(!mt->have_scene)
+    {
+    mt->have_scene = 1;
+    return 0;
+    }
+  return (diff > SCENE_THRESHOLD * SCENE_BLOCKS * SCENE_BLOCKS);
+  }
+
+static gavl_video_frame_t * get_video_func(void * data)
+  {
+  job_t * job;
+  bg_ffmpeg_chunk_mt_t * mt = data;
+
+  if(!(job = get_fill(mt)))
+    return NULL;
+
+  if(!job->frames[job->num_frames])
+    job->frames[job->num_frames] = gavl_video_frame_create(&mt->ctx->vfmt);
+  
+  return job->frames[job->num_frames];
+  }
+
+static gavl_sink_status_t put_video_func(void * data, gavl_video_frame_t * f)
+  {
+  int cut;
+  job_t * job;
+  gavl_video_frame_t * dst;
+  bg_ffmpeg_chunk_mt_t * mt = data;
+  
+  if(!(job = get_fill(mt)))
+    return GAVL_SINK_ERROR;
+
+  cut = mt->scene_cut && detect_scene_change(mt, f);
+  
+  /* Start a new chunk at scene changes after at least half
+     the chunk length. The frame is copied then */
+  if(cut && job->num_frames && (job->num_frames >= mt->chunk_frames / 2))
+    {
+    bgen_job_queue_submit(mt->q);
+    if(!(job = get_fill(mt)))
+      return GAVL_SINK_ERROR;
+    }
+
+  if(!(dst = job->frames[job->num_frames]))
+    dst = job->frames[job->num_frames] = gavl_video_frame_create(&mt->ctx->vfmt);
+  
+  /* Frames not obtained by get_video_func are copied */
+  if(f != dst)
+    {
+    gavl_video_frame_copy(&mt->ctx->vfmt, dst, f);
+    gavl_video_frame_copy_metadata(dst, f);
+    }
+  
+  job->num_frames++;
+
+  if(job->num_frames == mt->chunk_frames)
+    bgen_job_queue_submit(mt->q);
+  
+  return drain(mt, 0);
+  }
+
+bg_ffmpeg_chunk_mt_t * bg_ffmpeg_chunk_mt_create(bg_ffmpeg_codec_context_t * ctx,
+                                                 int num_threads,
+                                                 int chunk_frames,
+                                                 int scene_cut)
+  {
+  int i;
+  job_t * job;
+  bg_ffmpeg_chunk_mt_t * mt;
+
+  if((num_threads < 1) || (chunk_frames < 1))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Invalid number of threads (%d) or chunk frames (%d)",
+             num_threads, chunk_frames);
+    return NULL;
+    }
+
+  mt = calloc(1, sizeof(*mt));
+
+  /* One job per worker and one filled by the application. The
+     frames are allocated when they are needed first */
+  mt->num_jobs = num_threads + 1;
+
+  if(!(mt->q = bgen_job_queue_create(num_threads, mt->num_jobs,
+                                     encode_job, mt)))
+    {
+    free(mt);
+    return NULL;
+    }
+  
+  mt->ctx = ctx;
+  mt->chunk_frames = chunk_frames;
+  mt->scene_cut = scene_cut;
+  mt->jobs = calloc((size_t)mt->num_jobs, sizeof(*mt->jobs));
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    job = &mt->jobs[i];
+    
+    job->frames = calloc((size_t)chunk_frames, sizeof(*job->frames));
+    
+    job->avframe = av_frame_alloc();
+    job->avframe->width  = ctx->vfmt.image_width;
+    job->avframe->height = ctx->vfmt.image_height;
+    job->avframe->format = ctx->avctx->pix_fmt;
+    
+    if(ctx->conv_frame && !(job->conv = bg_ffmpeg_codec_create_conv_frame(ctx)))
+      goto fail;
+    }
+  
+  mt->sink = gavl_video_sink_create(get_video_func, put_video_func, mt, &ctx->vfmt);
+  
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+           "Encoding chunks of up to %d frames with %d threads",
+           chunk_frames, num_threads);
+  
+  return mt;
+  
+  fail:
+  bg_ffmpeg_chunk_mt_destroy(mt);
+  return NULL;
+  }
+
+gavl_video_sink_t * bg_ffmpeg_chunk_mt_get_sink(bg_ffmpeg_chunk_mt_t * mt)
+  {
+  return mt->sink;
+  }
+
+int bg_ffmpeg_chunk_mt_finish(bg_ffmpeg_chunk_mt_t * mt)
+  {
+  job_t * job;
+  
+  /* Last chunk */
+  if(!(job = get_fill(mt)))
+    return 0;
+
+  if(job->num_frames)
+    bgen_job_queue_submit(mt->q);
+  
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(drain(mt, 1) != GAVL_SINK_OK)
+      return 0;
+    }
+  return 1;
+  }
+
+void bg_ffmpeg_chunk_mt_destroy(bg_ffmpeg_chunk_mt_t * mt)
+  {
+  int i, j;
+  job_t * job;
+  
+  /* Unfinished jobs are still encoded, but not emitted */
+  bgen_job_queue_destroy(mt->q);
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    job = &mt->jobs[i];
+
+    if(job->frames)
+      {
+      for(j = 0; j < mt->chunk_frames; j++)
+        {
+        if(job->frames[j])
+          gavl_video_frame_destroy(job->frames[j]);
+        }
+      free(job->frames);
+      }
+
+    if(job->pkts)
+      {
+      for(j = 0; j < job->pkts_alloc; j++)
+        {
+        if(job->pkts[j])
+          av_packet_free(&job->pkts[j]);
+        }
+      free(job->pkts);
+      }
+    
+    if(job->avframe)
+      av_frame_free(&job->avframe);
+    if(job->conv)
+      av_frame_free(&job->conv);
+    }
+
+  if(mt->sink)
+    gavl_video_sink_destroy(mt->sink);
+  
+  free(mt->jobs);
+  free(mt);
+  }
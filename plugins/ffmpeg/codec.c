@@ -31,6 +31,7 @@
 
 #include <gavl/metatags.h>
 #include <libavutil/opt.h>
+#include <libavutil/cpu.h>
 
 /*
  *  Standalone codecs
@@ -47,7 +48,7 @@
 #endif
 
 
-static void 
+static int
 get_pixelformat_converter(bg_ffmpeg_codec_context_t * ctx, enum AVPixelFormat fmt,
                           int do_convert);
 
@@ -152,10 +153,33 @@ static void apply_func(void * priv, const char * name, const gavl_value_t * val)
     return;
 
   ctx = priv;
+
+  if(!strcmp(name, "ff_frame_threads"))
+    {
+    ctx->frame_threads = val->v.i;
+    return;
+    }
+  else if(!strcmp(name, "ff_chunk_threads"))
+    {
+    ctx->chunk_threads = val->v.i;
+    return;
+    }
+  else if(!strcmp(name, "ff_chunk_frames"))
+    {
+    ctx->chunk_frames = val->v.i;
+    return;
+    }
+  else if(!strcmp(name, "ff_chunk_scene"))
+    {
+    ctx->chunk_scene = val->v.i;
+    return;
+    }
   
   bg_ffmpeg_set_codec_parameter(ctx->avctx,
                                 &ctx->options,
                                 name, val);
+
+  gavl_dictionary_set(&ctx->codec_params, name, val);
   }
 
 void bg_ffmpeg_codec_set_parameter(bg_ffmpeg_codec_context_t * ctx,
@@ -185,15 +209,19 @@ void bg_ffmpeg_codec_set_parameter(bg_ffmpeg_codec_context_t * ctx,
       }
     find_encoder(ctx);
 
+    gavl_dictionary_reset(&ctx->codec_params);
     bg_cfg_section_apply(codec,
                          NULL,
                          apply_func,
                          ctx);
     
     }
+  else if(!strcmp(name, "async"))
+    ctx->use_async = v->v.i;
   else if(bg_encoder_set_framerate_parameter(&ctx->fr, name, v))
     return;
-  
+  else /* Parameters of the standalone codec plugins */
+    apply_func(ctx, name, v);
   }
 
 static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
@@ -260,9 +288,8 @@ static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
  *  Audio
  */
 
-static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
+static int encode_audio(bg_ffmpeg_codec_context_t * ctx, AVFrame * f)
   {
-  AVFrame * f;
   int result;
 
   gavl_packet_reset(&ctx->gp);
@@ -270,34 +297,6 @@ static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
   ctx->pkt->data = ctx->gp.buf.buf;
   ctx->pkt->size = ctx->gp.buf.alloc;
   
-  if(ctx->aframe->valid_samples)
-    {
-    /*
-     *  Pad with silent samples if the codec strictly requires fixed frame sizes.
-     *  The remainig samples should be zero from the last call to gavl_audio_frame_mute()
-     */
-    if((ctx->avctx->frame_size > 0) &&
-       (ctx->aframe->valid_samples < ctx->avctx->frame_size) &&
-       !(ctx->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME |
-                                     AV_CODEC_CAP_VARIABLE_FRAME_SIZE)))
-      ctx->aframe->valid_samples = ctx->avctx->frame_size;
-    
-    ctx->frame->nb_samples = ctx->aframe->valid_samples;
-    ctx->frame->pts = ctx->in_pts;
-    ctx->in_pts += ctx->aframe->valid_samples;
-    f = ctx->frame;
-
-
-    }
-  else
-    {
-    if(ctx->codec->capabilities & AV_CODEC_CAP_DELAY)
-      f = NULL;
-    else
-      return 0;
-    }
-
-  
   if((result = avcodec_send_frame(ctx->avctx, f)) < 0)
     {
     char str[AV_ERROR_MAX_STRING_SIZE];
@@ -312,9 +311,12 @@ static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
     }
   
   /* Mute frame */
-  gavl_audio_frame_mute(ctx->aframe, &ctx->afmt);
-  ctx->aframe->valid_samples = 0;
-
+  if(f == ctx->frame)
+    {
+    gavl_audio_frame_mute(ctx->aframe, &ctx->afmt);
+    ctx->aframe->valid_samples = 0;
+    }
+  
   while(1)
     {
     result = avcodec_receive_packet(ctx->avctx, ctx->pkt);
@@ -357,6 +359,123 @@ static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
   return 1;
   }
 
+static int flush_audio(bg_ffmpeg_codec_context_t * ctx)
+  {
+  AVFrame * f;
+  
+  if(ctx->aframe->valid_samples)
+    {
+    /*
+     *  Pad with silent samples if the codec strictly requires fixed frame sizes.
+     *  The remainig samples should be zero from the last call to gavl_audio_frame_mute()
+     */
+    if((ctx->avctx->frame_size > 0) &&
+       (ctx->aframe->valid_samples < ctx->avctx->frame_size) &&
+       !(ctx->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME |
+                                     AV_CODEC_CAP_VARIABLE_FRAME_SIZE)))
+      ctx->aframe->valid_samples = ctx->avctx->frame_size;
+    
+    ctx->frame->nb_samples = ctx->aframe->valid_samples;
+    ctx->frame->pts = ctx->in_pts;
+    ctx->in_pts += ctx->aframe->valid_samples;
+    f = ctx->frame;
+
+
+    }
+  else
+    {
+    if(ctx->codec->capabilities & AV_CODEC_CAP_DELAY)
+      f = NULL;
+    else
+      return 0;
+    }
+
+  return encode_audio(ctx, f);
+  }
+
+/* Complete frames are passed to libavcodec directly. The buffers
+   are owned by the caller, so they must not be freed */
+
+static void free_nothing(void * opaque, uint8_t * data)
+  {
+  }
+
+static int wrap_audio(bg_ffmpeg_codec_context_t * ctx,
+                      gavl_audio_frame_t * frame, int offset)
+  {
+  int i;
+  int num_planes;
+  int plane_size;
+  int bytes;
+  uintptr_t align;
+  AVFrame * f = ctx->wrap_frame;
+  
+  bytes = gavl_bytes_per_sample(ctx->afmt.sample_format);
+  
+  if(ctx->afmt.interleave_mode == GAVL_INTERLEAVE_ALL)
+    {
+    num_planes = 1;
+    bytes *= ctx->afmt.num_channels;
+    f->data[0] = frame->samples.u_8 + offset * bytes;
+    }
+  else
+    {
+    num_planes = ctx->afmt.num_channels;
+    for(i = 0; i < num_planes; i++)
+      f->data[i] = frame->channels.u_8[i] + offset * bytes;
+    }
+
+  plane_size = bytes * ctx->afmt.samples_per_frame;
+  
+  /* SIMD code in the codecs might need data aligned like
+     av_frame_get_buffer() does it (64 bytes with AVX-512) */
+  align = av_cpu_max_align() - 1;
+  
+  for(i = 0; i < num_planes; i++)
+    {
+    if((uintptr_t)f->data[i] & align)
+      {
+      memset(f->data, 0, sizeof(f->data));
+      return 0;
+      }
+    }
+  
+  for(i = 0; i < num_planes; i++)
+    {
+    if(!(f->buf[i] = av_buffer_create(f->data[i], plane_size,
+                                      free_nothing, NULL, 0)))
+      {
+      av_frame_unref(f);
+      return 0;
+      }
+    }
+  
+  f->extended_data = f->data;
+  f->linesize[0] = plane_size;
+  f->nb_samples = ctx->afmt.samples_per_frame;
+  f->format = ctx->avctx->sample_fmt;
+  f->sample_rate = ctx->avctx->sample_rate;
+  av_channel_layout_copy(&f->ch_layout, &ctx->avctx->ch_layout);
+  
+  f->pts = ctx->in_pts;
+  ctx->in_pts += f->nb_samples;
+  return 1;
+  }
+
+static void unwrap_audio(bg_ffmpeg_codec_context_t * ctx)
+  {
+  /* If the codec still holds a reference, it would access the
+     buffer after we returned. Never happens with the native
+     encoders, but better safe than sorry */
+  if(av_buffer_get_ref_count(ctx->wrap_frame->buf[0]) > 1)
+    {
+    gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+             "Codec keeps input frames, disabling zero copy");
+    ctx->wrap_audio = 0;
+    }
+  av_frame_unref(ctx->wrap_frame);
+  }
+
 static gavl_sink_status_t
 write_audio_func(void * data, gavl_audio_frame_t * frame)
   {
@@ -372,6 +491,21 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
 
   while(samples_written < frame->valid_samples)
     {
+    /* Pass complete frames without copying */
+    if(ctx->wrap_audio && !ctx->aframe->valid_samples &&
+       (frame->valid_samples - samples_written >= ctx->afmt.samples_per_frame) &&
+       wrap_audio(ctx, frame, samples_written))
+      {
+      encode_audio(ctx, ctx->wrap_frame);
+      unwrap_audio(ctx);
+      
+      if(ctx->flags & FLAG_ERROR)
+        return GAVL_SINK_ERROR;
+      
+      samples_written += ctx->afmt.samples_per_frame;
+      continue;
+      }
+    
     samples_copied =
       gavl_audio_frame_copy(&ctx->afmt,
                             ctx->aframe, // dst frame
@@ -630,6 +764,16 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
   /* Mute frame */
   gavl_audio_frame_mute(ctx->aframe, fmt);
   ctx->aframe->valid_samples = 0;
+
+  /* External libraries and hardware encoders might keep the
+     input frames. Too many planes would need extended_buf */
+  if(!ctx->codec->wrapper_name &&
+     ((fmt->interleave_mode == GAVL_INTERLEAVE_ALL) ||
+      (fmt->num_channels <= AV_NUM_DATA_POINTERS)))
+    {
+    ctx->wrap_frame = av_frame_alloc();
+    ctx->wrap_audio = 1;
+    }
   
   ctx->asink = gavl_audio_sink_create(NULL, write_audio_func, ctx, fmt);
   
@@ -643,10 +787,86 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
   ctx->out_pts = GAVL_TIME_UNDEFINED;
   
   ctx->flags |= FLAG_INITIALIZED;
+
+  if(ctx->use_async &&
+     (ctx->async = bgen_frame_queue_create_audio(ctx->asink)))
+    return bgen_frame_queue_get_audio_sink(ctx->async);
+  
   return ctx->asink;
   }
 
 
+void bg_ffmpeg_codec_put_video_packet(bg_ffmpeg_codec_context_t * ctx,
+                                      AVPacket * pkt)
+  {
+  gavl_packet_reset(&ctx->gp);
+
+  ctx->gp.pts = pkt->pts;
+  ctx->gp.dts = pkt->dts;
+
+#if 0
+  ctx->gp.duration = pkt->duration;
+  ctx->gp.dts = pkt->dts;
+
+#endif
+  
+  if(pkt->flags & AV_PKT_FLAG_KEY)
+    ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
+  
+  ctx->gp.buf.len = pkt->size;
+  ctx->gp.buf.buf = pkt->data;
+  
+  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+    {
+    ctx->gp.pts *= ctx->vfmt.frame_duration;
+    ctx->gp.dts *= ctx->vfmt.frame_duration;
+    }
+  /* Detect VP8 alternate reference frames */
+  if((ctx->id == AV_CODEC_ID_VP8) &&
+     !(ctx->gp.buf.buf[0] & 0x10))
+    {
+    ctx->gp.flags |= GAVL_PACKET_NOOUTPUT;
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Got alterate reference frame %"PRId64, ctx->gp.pts);
+    }
+  else
+    {
+    /* Decide frame type */
+    if(ctx->gp.pts < ctx->out_pts)
+      ctx->gp.flags |= GAVL_PACKET_TYPE_B;
+    else
+      {
+      if(ctx->gp.flags & GAVL_PACKET_KEYFRAME)
+        ctx->gp.flags |= GAVL_PACKET_TYPE_I;
+      else
+        ctx->gp.flags |= GAVL_PACKET_TYPE_P;
+      ctx->out_pts = ctx->gp.pts;
+      }
+
+    if(!bg_encoder_pts_cache_pop_packet(ctx->pc, &ctx->gp, -1, ctx->gp.pts))
+      {
+      ctx->flags |= FLAG_ERROR;
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+               "Got no packet in cache for pts %"PRId64, ctx->gp.pts);
+      //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", ctx->gp.pts);
+      }
+    //      else
+    //  fprintf(stderr, "pop packet: %"PRId64"\n", ctx->gp.pts);
+    }
+  /* Write frame */
+
+  //    fprintf(stderr, "Put video packet\n");
+  //    gavl_packet_dump(&ctx->gp);
+  
+  if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+    {
+    ctx->flags |= FLAG_ERROR;
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Writing packet failed");
+    }
+  ctx->gp.buf.buf = NULL;
+  }
+
 static int flush_video(bg_ffmpeg_codec_context_t * ctx,
                        AVFrame * frame)
   {
@@ -677,79 +897,32 @@ static int flush_video(bg_ffmpeg_codec_context_t * ctx,
       }
     
     /* Got packet */
-
-    gavl_packet_reset(&ctx->gp);
-
-    ctx->gp.pts = ctx->pkt->pts;
-    ctx->gp.dts = ctx->pkt->dts;
-
-    
-#if 0
-    ctx->gp.duration = ctx->pkt->duration;
-    ctx->gp.dts = ctx->pkt->dts;
-
-#endif
-    
-    if(ctx->pkt->flags & AV_PKT_FLAG_KEY)
-      ctx->gp.flags |= GAVL_PACKET_KEYFRAME;
-    
-    ctx->gp.buf.len = ctx->pkt->size;
-    ctx->gp.buf.buf = ctx->pkt->data;
-    
-    if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
-      {
-      ctx->gp.pts *= ctx->vfmt.frame_duration;
-      ctx->gp.dts *= ctx->vfmt.frame_duration;
-      }
-    /* Detect VP8 alternate reference frames */
-    if((ctx->id == AV_CODEC_ID_VP8) &&
-       !(ctx->gp.buf.buf[0] & 0x10))
-      {
-      ctx->gp.flags |= GAVL_PACKET_NOOUTPUT;
-      gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
-               "Got alterate reference frame %"PRId64, ctx->gp.pts);
-      }
-    else
-      {
-      /* Decide frame type */
-      if(ctx->gp.pts < ctx->out_pts)
-        ctx->gp.flags |= GAVL_PACKET_TYPE_B;
-      else
-        {
-        if(ctx->gp.flags & GAVL_PACKET_KEYFRAME)
-          ctx->gp.flags |= GAVL_PACKET_TYPE_I;
-        else
-          ctx->gp.flags |= GAVL_PACKET_TYPE_P;
-        ctx->out_pts = ctx->gp.pts;
-        }
-
-      if(!bg_encoder_pts_cache_pop_packet(ctx->pc, &ctx->gp, -1, ctx->gp.pts))
-        {
-        ctx->flags |= FLAG_ERROR;
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-               "Got no packet in cache for pts %"PRId64, ctx->gp.pts);
-        //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", ctx->gp.pts);
-        }
-      //      else
-      //  fprintf(stderr, "pop packet: %"PRId64"\n", ctx->gp.pts);
-      }
-    /* Write frame */
-
-    //    fprintf(stderr, "Put video packet\n");
-    //    gavl_packet_dump(&ctx->gp);
-    
-    if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
-      {
-      ctx->flags |= FLAG_ERROR;
-      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-             "Writing packet failed");
-      }
-    ctx->gp.buf.buf = NULL;
+    bg_ffmpeg_codec_put_video_packet(ctx, ctx->pkt);
     }
   
   return 1;
   }
 
+void bg_ffmpeg_codec_prepare_video_frame(bg_ffmpeg_codec_context_t * ctx,
+                                         gavl_video_frame_t * f,
+                                         AVFrame * dst, AVFrame * conv)
+  {
+  dst->pts = f->timestamp;
+  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+    dst->pts /= ctx->vfmt.frame_duration;
+  
+  dst->data[0]     = f->planes[0];
+  dst->data[1]     = f->planes[1];
+  dst->data[2]     = f->planes[2];
+  dst->linesize[0] = f->strides[0];
+  dst->linesize[1] = f->strides[1];
+  dst->linesize[2] = f->strides[2];
+
+  /* Can redirect the planes to conv */
+  if(ctx->convert_frame)
+    ctx->convert_frame(ctx, f, dst, conv);
+  }
+
 static gavl_sink_status_t
 write_video_func(void * data, gavl_video_frame_t * frame)
   {
@@ -762,21 +935,8 @@ write_video_func(void * data, gavl_video_frame_t * frame)
     }
   
   //  fprintf(stderr, "push frame: %"PRId64"\n", frame->timestamp);
-  
-  if(ctx->convert_frame)
-    ctx->convert_frame(ctx, frame);
-  
-  ctx->frame->pts = frame->timestamp;
-  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
-    ctx->frame->pts /= ctx->vfmt.frame_duration;
-  
-  
-  ctx->frame->data[0]     = frame->planes[0];
-  ctx->frame->data[1]     = frame->planes[1];
-  ctx->frame->data[2]     = frame->planes[2];
-  ctx->frame->linesize[0] = frame->strides[0];
-  ctx->frame->linesize[1] = frame->strides[1];
-  ctx->frame->linesize[2] = frame->strides[2];
+
+  bg_ffmpeg_codec_prepare_video_frame(ctx, frame, ctx->frame, ctx->conv_frame);
  
 //  ctx->frame->width  = ctx->vfmt.image_width;
 //  ctx->frame->height = ctx->vfmt.image_height;
@@ -821,6 +981,7 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   int do_convert = 0;
   const ffmpeg_codec_info_t * info;
   gavl_video_sink_get_func get_func = NULL;
+  gavl_video_sink_t * sink;
   const AVOutputFormat * ofmt;
   gavl_video_format_t * fmt;
   //  if(!find_encoder(ctx))
@@ -911,8 +1072,8 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
     ctx->vframe = gavl_video_frame_create(&ctx->vfmt);
     get_func = get_video_func;
 
-    get_pixelformat_converter(ctx, ctx->avctx->pix_fmt, do_convert);
-    
+    if(!get_pixelformat_converter(ctx, ctx->avctx->pix_fmt, do_convert))
+      return NULL;
     }
 
   ctx->vsink = gavl_video_sink_create(get_func, write_video_func, ctx, &ctx->vfmt);
@@ -924,10 +1085,83 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   ctx->frame->height = ctx->vfmt.image_height;
  
   ctx->frame->format = ctx->avctx->pix_fmt;
- 
+
+  sink = ctx->vsink;
+  
+  /* Frames of intra-only codecs can be encoded independently */
+  if((ctx->frame_threads > 1) &&
+     (info->flags & FLAG_INTRA_ONLY) &&
+     !(ctx->codec->capabilities & AV_CODEC_CAP_DELAY) &&
+     (ctx->frame_mt = bg_ffmpeg_frame_mt_create(ctx, ctx->frame_threads)))
+    sink = bg_ffmpeg_frame_mt_get_sink(ctx->frame_mt);
+
+  /* Other codecs can encode closed GOPs independently. Live streams
+     cannot wait for complete chunks */
+  else if((ctx->chunk_threads > 1) && (ctx->chunk_frames > 0))
+    {
+    if(ctx->format && (ctx->format->flags & FLAG_SAP))
+      gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+               "Chunk threads are not supported for live streams");
+    else if((ctx->chunk_mt = bg_ffmpeg_chunk_mt_create(ctx, ctx->chunk_threads,
+                                                       ctx->chunk_frames,
+                                                       ctx->chunk_scene)))
+      sink = bg_ffmpeg_chunk_mt_get_sink(ctx->chunk_mt);
+    }
+  
   ctx->flags |= FLAG_INITIALIZED;
+
+  if(ctx->use_async &&
+     (ctx->async = bgen_frame_queue_create_video(sink)))
+    return bgen_frame_queue_get_video_sink(ctx->async);
+  
+  return sink;
+  }
+
+typedef struct
+  {
+  AVCodecContext * avctx;
+  AVDictionary * options;
+  } clone_t;
+
+static void apply_clone_func(void * priv, const char * name,
+                             const gavl_value_t * val)
+  {
+  clone_t * c = priv;
+
+  if(!name || !strcmp(name, BG_CFG_TAG_NAME))
+    return;
+  
+  bg_ffmpeg_set_codec_parameter(c->avctx, &c->options, name, val);
+  }
+
+AVCodecContext * bg_ffmpeg_codec_clone_video(bg_ffmpeg_codec_context_t * ctx)
+  {
+  clone_t c;
+
+  c.options = NULL;
+  
+  if(!(c.avctx = avcodec_alloc_context3(ctx->codec)))
+    return NULL;
+
+  bg_cfg_section_apply(&ctx->codec_params, NULL, apply_clone_func, &c);
+
+  c.avctx->codec_type = AVMEDIA_TYPE_VIDEO;
+  c.avctx->codec_id   = ctx->id;
+  bg_ffmpeg_set_video_dimensions_avctx(c.avctx, &ctx->vfmt);
+  c.avctx->pix_fmt    = ctx->avctx->pix_fmt;
+  c.avctx->time_base  = ctx->avctx->time_base;
+  c.avctx->flags      = ctx->avctx->flags;
+
+  /* The threads are used for the frames already */
+  c.avctx->thread_count = 1;
   
-  return ctx->vsink;
+  if(avcodec_open2(c.avctx, ctx->codec, &c.options) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "avcodec_open2 failed for frame thread");
+    avcodec_free_context(&c.avctx);
+    }
+  av_dict_free(&c.options);
+  return c.avctx;
   }
 
 void bg_ffmpeg_codec_set_packet_sink(bg_ffmpeg_codec_context_t * ctx,
@@ -944,6 +1178,31 @@ void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx)
   if(!(ctx->flags & FLAG_INITIALIZED))
     return;
 
+  /* Encode the queued frames first */
+  if(ctx->async)
+    {
+    if(!bgen_frame_queue_finish(ctx->async))
+      ctx->flags |= FLAG_ERROR;
+    bgen_frame_queue_destroy(ctx->async);
+    ctx->async = NULL;
+    }
+
+  if(ctx->frame_mt)
+    {
+    if(!bg_ffmpeg_frame_mt_finish(ctx->frame_mt))
+      ctx->flags |= FLAG_ERROR;
+    bg_ffmpeg_frame_mt_destroy(ctx->frame_mt);
+    ctx->frame_mt = NULL;
+    }
+
+  if(ctx->chunk_mt)
+    {
+    if(!bg_ffmpeg_chunk_mt_finish(ctx->chunk_mt))
+      ctx->flags |= FLAG_ERROR;
+    bg_ffmpeg_chunk_mt_destroy(ctx->chunk_mt);
+    ctx->chunk_mt = NULL;
+    }
+
   if(ctx->type == AVMEDIA_TYPE_VIDEO)
     flush_video(ctx, NULL);
   else // Audio
@@ -991,6 +1250,14 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
   
   if(ctx->frame)
     av_frame_free(&ctx->frame);
+
+  if(ctx->wrap_frame)
+    av_frame_free(&ctx->wrap_frame);
+
+  if(ctx->conv_frame)
+    av_frame_free(&ctx->conv_frame);
+
+  gavl_dictionary_free(&ctx->codec_params);
   
   if(ctx->pkt)
     av_packet_free(&ctx->pkt);
@@ -1005,36 +1272,113 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
  *  Pixelformat conversion stuff
  */
 
-static void convert_frame_bgra(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f)
+static void convert_frame_swap_32(bg_ffmpeg_codec_context_t * ctx,
+                                  gavl_video_frame_t * f,
+                                  AVFrame * dst, AVFrame * conv)
   {
-  int i, j;
-  uint8_t * ptr;
-  uint8_t swp;
+  int i;
   
   for(i = 0; i < ctx->vfmt.image_height; i++)
+    ctx->pixconv->swap_rb_32(f->planes[0] + i * f->strides[0],
+                             ctx->vfmt.image_width);
+  }
+
+static void convert_frame_swap_24(bg_ffmpeg_codec_context_t * ctx,
+                                  gavl_video_frame_t * f,
+                                  AVFrame * dst, AVFrame * conv)
+  {
+  int i;
+  
+  for(i = 0; i < ctx->vfmt.image_height; i++)
+    ctx->pixconv->swap_rb_24(f->planes[0] + i * f->strides[0],
+                             ctx->vfmt.image_width);
+  }
+
+/* YUV 4:2:0 planar -> NV12. The luma plane is passed as it is */
+
+static void convert_frame_nv12(bg_ffmpeg_codec_context_t * ctx,
+                               gavl_video_frame_t * f,
+                               AVFrame * dst, AVFrame * conv)
+  {
+  int i;
+  
+  for(i = 0; i < (ctx->vfmt.image_height + 1) / 2; i++)
+    ctx->pixconv->interleave_uv(conv->data[1] + i * conv->linesize[1],
+                                f->planes[1] + i * f->strides[1],
+                                f->planes[2] + i * f->strides[2],
+                                (ctx->vfmt.image_width + 1) / 2);
+
+  dst->data[1]     = conv->data[1];
+  dst->data[2]     = NULL;
+  dst->linesize[1] = conv->linesize[1];
+  dst->linesize[2] = 0;
+  }
+
+static void convert_frame_yuy2(bg_ffmpeg_codec_context_t * ctx,
+                               gavl_video_frame_t * f,
+                               AVFrame * dst, AVFrame * conv)
+  {
+  int i;
+  
+  for(i = 0; i < ctx->vfmt.image_height; i++)
+    ctx->pixconv->yuy2_to_planar(conv->data[0] + i * conv->linesize[0],
+                                 conv->data[1] + i * conv->linesize[1],
+                                 conv->data[2] + i * conv->linesize[2],
+                                 f->planes[0] + i * f->strides[0],
+                                 (ctx->vfmt.image_width + 1) & ~1);
+  
+  for(i = 0; i < 3; i++)
     {
-    ptr = f->planes[0] + i * f->strides[0];
-    for(j = 0; j < ctx->vfmt.image_width; j++)
-      {
-      /* RGBA -> BGRA */
-      swp = ptr[0];
-      ptr[0] = ptr[2];
-      ptr[2] = swp;
-      ptr += 4;
-      }
+    dst->data[i]     = conv->data[i];
+    dst->linesize[i] = conv->linesize[i];
     }
   }
 
-static void 
+AVFrame * bg_ffmpeg_codec_create_conv_frame(bg_ffmpeg_codec_context_t * ctx)
+  {
+  AVFrame * ret = av_frame_alloc();
+  
+  ret->format = ctx->avctx->pix_fmt;
+  /* Even width for the 2 pixel kernels */
+  ret->width  = (ctx->vfmt.image_width + 1) & ~1;
+  ret->height = ctx->vfmt.image_height;
+  
+  if(av_frame_get_buffer(ret, 0) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot allocate conversion frame");
+    av_frame_free(&ret);
+    return NULL;
+    }
+  return ret;
+  }
+
+static int
 get_pixelformat_converter(bg_ffmpeg_codec_context_t * ctx,
                           enum AVPixelFormat fmt, int do_convert)
   {
-  if(do_convert & CONVERT_OTHER)
+  if(!(do_convert & CONVERT_OTHER))
+    return 1;
+  
+  ctx->pixconv = bg_ffmpeg_pixconv_get();
+  
+  switch(fmt)
     {
-    if(fmt == AV_PIX_FMT_BGRA)
-      {
-      ctx->convert_frame = convert_frame_bgra;
-      }
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_BGR0:
+      ctx->convert_frame = convert_frame_swap_32;
+      break;
+    case AV_PIX_FMT_RGB24:
+    case AV_PIX_FMT_BGR24:
+      ctx->convert_frame = convert_frame_swap_24;
+      break;
+    case AV_PIX_FMT_NV12:
+      ctx->convert_frame = convert_frame_nv12;
+      return !!(ctx->conv_frame = bg_ffmpeg_codec_create_conv_frame(ctx));
+    case AV_PIX_FMT_YUV422P:
+      ctx->convert_frame = convert_frame_yuy2;
+      return !!(ctx->conv_frame = bg_ffmpeg_codec_create_conv_frame(ctx));
+    default:
+      break;
     }
-  
+  return 1;
   }
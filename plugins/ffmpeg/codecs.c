@@ -251,6 +251,16 @@ static const bg_parameter_info_t parameters_libvorbis[] =
     PARAM_FLAG_GRAY, \
     PARAM_FLAG_BITEXACT
 
+#define ENCODE_PARAM_VIDEO_CHUNKS \
+  {                                           \
+    .name =      "chunks",                       \
+    .long_name = TRS("Chunks"),                     \
+    .type =      BG_PARAMETER_SECTION,         \
+  },                                        \
+    PARAM_CHUNK_THREADS,       \
+    PARAM_CHUNK_FRAMES, \
+    PARAM_CHUNK_SCENE
+
 static const bg_parameter_info_t parameters_mpeg4[] = {
   ENCODE_PARAM_VIDEO_FRAMETYPES_IPB,
   PARAM_FLAG_AC_PRED_MPEG4,
@@ -271,6 +281,7 @@ static const bg_parameter_info_t parameters_mjpeg[] = {
   ENCODE_PARAM_VIDEO_RATECONTROL,
   ENCODE_PARAM_VIDEO_QUANTIZER_I,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_FRAME_THREADS,
   { /* End of parameters */ }
 };
 
@@ -380,6 +391,7 @@ static const bg_parameter_info_t parameters_libx264[] = {
     .val_default = GAVL_VALUE_INIT_INT(-1),
     .help_string = TRS("Negative means disable, 0 means lossless"),
   },
+  ENCODE_PARAM_VIDEO_CHUNKS,
   { /* End */ },
 };
 
@@ -522,6 +534,7 @@ static const bg_parameter_info_t parameters_libvpx[] = {
                                      TRS("Centered"),
                                      (char *)0},
   },
+  ENCODE_PARAM_VIDEO_CHUNKS,
   { /* End */ },
 };
 
@@ -531,6 +544,7 @@ static const bg_parameter_info_t parameters_tga[] = {
     .long_name = TRS("Use RLE compression"),
     .type =      BG_PARAMETER_CHECKBUTTON,
   },
+  PARAM_FRAME_THREADS,
   { /* */ }
 };
 
@@ -783,6 +797,15 @@ add_codec_info(const ffmpeg_codec_info_t ** info, enum AVCodecID id, int * num)
   }
 
 
+#define ASYNC_PARAM \
+    { \
+      .name      = "async", \
+      .long_name = TRS("Encode in a separate thread"), \
+      .type      = BG_PARAMETER_CHECKBUTTON, \
+      .val_default = GAVL_VALUE_INIT_INT(0), \
+      .help_string = TRS("Queue the frames and encode them in a separate thread. Lets capture and encoding overlap and absorbs short encoder spikes of live sources."), \
+    }
+
 static const bg_parameter_info_t audio_parameters[] =
   {
     {
@@ -790,6 +813,7 @@ static const bg_parameter_info_t audio_parameters[] =
       .long_name = TRS("Codec"),
       .type      = BG_PARAMETER_MULTI_MENU,
     },
+    ASYNC_PARAM,
     { /* */ }
   };
 
@@ -801,6 +825,7 @@ static const bg_parameter_info_t video_parameters[] =
       .type      = BG_PARAMETER_MULTI_MENU,
     },
     BG_ENCODER_FRAMERATE_PARAMS,
+    ASYNC_PARAM,
     { /* */ }
   };
 
@@ -1316,7 +1341,9 @@ static const struct
 pixelformats[] =
   {
     { AV_PIX_FMT_YUV420P,  GAVL_YUV_420_P },  ///< Planar YUV 4:2:0 (1 Cr & Cb sample per 2x2 Y samples)
+    { AV_PIX_FMT_NV12,     GAVL_YUV_420_P, CONVERT_OTHER },
     { AV_PIX_FMT_YUYV422,  GAVL_YUY2      },
+    { AV_PIX_FMT_YUV422P,  GAVL_YUY2,      CONVERT_OTHER },
     { AV_PIX_FMT_YUV422P,  GAVL_YUV_422_P },  ///< Planar YUV 4:2:2 (1 Cr & Cb sample per 2x1 Y samples)
     { AV_PIX_FMT_YUV444P,  GAVL_YUV_444_P }, ///< Planar YUV 4:4:4 (1 Cr & Cb sample per 1x1 Y samples)
     { AV_PIX_FMT_YUV411P,  GAVL_YUV_411_P }, ///< Planar YUV 4:1:1 (1 Cr & Cb sample per 4x1 Y samples)
@@ -1336,7 +1363,12 @@ pixelformats[] =
     { AV_PIX_FMT_BGR555LE, GAVL_BGR_15, PIX_FMT_LE }, ///< packed BGR 5:5:5, 16bpp, (msb)1A 5B 5G 5R(lsb), little-endian, most significant bit to 1
     { AV_PIX_FMT_RGB24,    GAVL_RGB_24    },  ///< Packed pixel, 3 bytes per pixel, RGBRGB...
     { AV_PIX_FMT_BGR24,    GAVL_BGR_24    },  ///< Packed pixel, 3 bytes per pixel, BGRBGR...
+    { AV_PIX_FMT_RGBA,     GAVL_RGBA_32   },
+    { AV_PIX_FMT_RGB0,     GAVL_RGB_32    },
+    { AV_PIX_FMT_BGR24,    GAVL_RGB_24,  CONVERT_OTHER },
+    { AV_PIX_FMT_RGB24,    GAVL_BGR_24,  CONVERT_OTHER },
     { AV_PIX_FMT_BGRA,     GAVL_RGBA_32, CONVERT_OTHER },
+    { AV_PIX_FMT_BGR0,     GAVL_RGB_32,  CONVERT_OTHER },
     
 #if 0 // Not needed in the forseeable future    
 #if LIBAVUTIL_VERSION_INT < (50<<16)
@@ -1348,15 +1380,16 @@ pixelformats[] =
 #endif // Not needed
 };
 
-static gavl_pixelformat_t bg_pixelformat_ffmpeg_2_gavl(enum AVPixelFormat p)
+static int has_pixelformat(const gavl_pixelformat_t * fmts, int num,
+                           gavl_pixelformat_t p)
   {
   int i;
-  for(i = 0; i < sizeof(pixelformats)/sizeof(pixelformats[0]); i++)
+  for(i = 0; i < num; i++)
     {
-    if(pixelformats[i].ffmpeg_csp == p)
-      return pixelformats[i].gavl_csp;
+    if(fmts[i] == p)
+      return 1;
     }
-  return GAVL_PIXELFORMAT_NONE;
+  return 0;
   }
 
 static enum AVPixelFormat bg_pixelformat_gavl_2_ffmpeg(gavl_pixelformat_t p, int * do_convert,
@@ -1388,30 +1421,23 @@ void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
                                   enum AVPixelFormat * ffmpeg_fmt,
                                   gavl_pixelformat_t * gavl_fmt, int * do_convert)
   {
-  int i, num;
+  int i, j, num;
   gavl_pixelformat_t * gavl_fmts;
 
-  /* Count pixelformats */
-  i = 0;
-  num = 0;
-
-  while(supported[i] != AV_PIX_FMT_NONE)
-    {
-    if(bg_pixelformat_ffmpeg_2_gavl(supported[i]) != GAVL_PIXELFORMAT_NONE)
-      num++;
-    i++;
-    }
-  
-  gavl_fmts = malloc((num+1) * sizeof(gavl_fmts));
-  
-  i = 0;
+  /* Collect the gavl formats, which can be passed with at most a
+     trivial conversion. A format can have several entries */
   num = 0;
+  gavl_fmts = malloc((sizeof(pixelformats)/sizeof(pixelformats[0]) + 1) *
+                     sizeof(*gavl_fmts));
   
-  while(supported[i] != AV_PIX_FMT_NONE)
+  for(i = 0; supported[i] != AV_PIX_FMT_NONE; i++)
     {
-    if((gavl_fmts[num] = bg_pixelformat_ffmpeg_2_gavl(supported[i])) != GAVL_PIXELFORMAT_NONE)
-      num++;
-    i++;
+    for(j = 0; j < sizeof(pixelformats)/sizeof(pixelformats[0]); j++)
+      {
+      if((pixelformats[j].ffmpeg_csp == supported[i]) &&
+         !has_pixelformat(gavl_fmts, num, pixelformats[j].gavl_csp))
+        gavl_fmts[num++] = pixelformats[j].gavl_csp;
+      }
     }
   gavl_fmts[num] = GAVL_PIXELFORMAT_NONE;
 
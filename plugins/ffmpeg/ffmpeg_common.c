@@ -50,10 +50,14 @@ static int write_frame(bg_ffmpeg_stream_t * s)
     }
   else
     {
-    if(av_interleaved_write_frame(s->ffmpeg->fmtctx, s->pkt) != 0)
-      {
+    int result;
+    
+    pthread_mutex_lock(&s->ffmpeg->write_mutex);
+    result = av_interleaved_write_frame(s->ffmpeg->fmtctx, s->pkt);
+    pthread_mutex_unlock(&s->ffmpeg->write_mutex);
+
+    if(result != 0)
       return 0;
-      }
     }
   
   return 1;
@@ -95,6 +99,7 @@ void * bg_ffmpeg_create(const ffmpeg_format_info_t * format)
   ret->video_parameters =
     bg_ffmpeg_create_video_parameters(format);
 
+  pthread_mutex_init(&ret->write_mutex, NULL);
   
   return ret;
   }
@@ -130,6 +135,8 @@ void bg_ffmpeg_destroy(void * data)
     free(priv->rtp_base_address);
   
   gavl_dictionary_free(&priv->m);
+
+  pthread_mutex_destroy(&priv->write_mutex);
   
   free(priv);
 
@@ -22,10 +22,13 @@
 
 #include <config.h>
 
+#include <pthread.h>
+
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <gmerlin/plugin.h>
 #include <gmerlin/pluginfuncs.h>
+#include <gmerlin_encoders.h>
 
 #include <gavl/packettimer.h>
 #include <gavl/gavlsocket.h>
@@ -145,6 +148,60 @@ bg_ffmpeg_get_codec_info(enum AVCodecID id, int type);
 
 typedef struct bg_ffmpeg_codec_context_s bg_ffmpeg_codec_context_t;
 
+/* Frame parallel encoding of intra-only codecs (framemt.c). Each
+   thread has its own AVCodecContext. The packets are passed in the
+   order of the frames */
+
+typedef struct bg_ffmpeg_frame_mt_s bg_ffmpeg_frame_mt_t;
+
+bg_ffmpeg_frame_mt_t * bg_ffmpeg_frame_mt_create(bg_ffmpeg_codec_context_t * ctx,
+                                                 int num_threads);
+
+gavl_video_sink_t * bg_ffmpeg_frame_mt_get_sink(bg_ffmpeg_frame_mt_t * mt);
+
+/* Encode and pass the remaining frames. Returns 0 on error */
+int bg_ffmpeg_frame_mt_finish(bg_ffmpeg_frame_mt_t * mt);
+
+void bg_ffmpeg_frame_mt_destroy(bg_ffmpeg_frame_mt_t * mt);
+
+/* Chunk parallel encoding (chunkmt.c). Chunks of up to chunk_frames
+   frames are encoded as closed GOPs by separate AVCodecContexts. If
+   scene_cut is nonzero, chunks are cut at scene changes */
+
+typedef struct bg_ffmpeg_chunk_mt_s bg_ffmpeg_chunk_mt_t;
+
+bg_ffmpeg_chunk_mt_t * bg_ffmpeg_chunk_mt_create(bg_ffmpeg_codec_context_t * ctx,
+                                                 int num_threads,
+                                                 int chunk_frames,
+                                                 int scene_cut);
+
+gavl_video_sink_t * bg_ffmpeg_chunk_mt_get_sink(bg_ffmpeg_chunk_mt_t * mt);
+
+/* Encode and pass the remaining chunks. Returns 0 on error */
+int bg_ffmpeg_chunk_mt_finish(bg_ffmpeg_chunk_mt_t * mt);
+
+void bg_ffmpeg_chunk_mt_destroy(bg_ffmpeg_chunk_mt_t * mt);
+
+/* Pixel format conversion kernels (pixconv.c). num is the number
+   of pixels (swap) or chroma samples (interleave) per line */
+
+typedef struct
+  {
+  /* RGBA <-> BGRA, in place */
+  void (*swap_rb_32)(uint8_t * ptr, int num);
+  /* RGB24 <-> BGR24, in place */
+  void (*swap_rb_24)(uint8_t * ptr, int num);
+  /* YUY2 -> planar 4:2:2, num must be even */
+  void (*yuy2_to_planar)(uint8_t * y, uint8_t * u, uint8_t * v,
+                         const uint8_t * src, int num);
+  /* Planar U and V -> NV12 chroma plane */
+  void (*interleave_uv)(uint8_t * dst, const uint8_t * u,
+                        const uint8_t * v, int num);
+  } bg_ffmpeg_pixconv_t;
+
+/* Get the fastest kernels for this CPU */
+const bg_ffmpeg_pixconv_t * bg_ffmpeg_pixconv_get(void);
+
 struct bg_ffmpeg_codec_context_s
   {
   const AVCodec * codec;
@@ -181,6 +238,10 @@ struct bg_ffmpeg_codec_context_s
   /* Audio frame to encode */
   gavl_audio_frame_t * aframe;
   int block_align;
+
+  /* Wraps complete frames of the caller without copying */
+  AVFrame * wrap_frame;
+  int wrap_audio;
   
   /*
    * Video frame to encode.
@@ -199,8 +260,28 @@ struct bg_ffmpeg_codec_context_s
   /* Trivial pixelformat conversions because
      we are too lazy to support all variants in gavl */
   
-  void (*convert_frame)(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f);
-  
+  void (*convert_frame)(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f,
+                        AVFrame * dst, AVFrame * conv);
+  const bg_ffmpeg_pixconv_t * pixconv;
+
+  /* Destination for conversions, which change the plane layout */
+  AVFrame * conv_frame;
+
+  /* Codec parameters, applied again to the contexts of frame and
+     chunk threads */
+  gavl_dictionary_t codec_params;
+
+  int frame_threads;
+  bg_ffmpeg_frame_mt_t * frame_mt;
+
+  int chunk_threads;
+  int chunk_frames;
+  int chunk_scene;
+  bg_ffmpeg_chunk_mt_t * chunk_mt;
+
+  /* Encode in a separate thread */
+  int use_async;
+  bgen_frame_queue_t * async;
   };
 
 
@@ -243,6 +324,24 @@ void bg_ffmpeg_codec_set_packet_sink(bg_ffmpeg_codec_context_t * ctx,
 
 void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx);
 
+/* Used by the frame threads */
+
+/* Open another encoder with the settings of ctx */
+AVCodecContext * bg_ffmpeg_codec_clone_video(bg_ffmpeg_codec_context_t * ctx);
+
+/* Scratch frame for conversions, which change the plane layout.
+   Needed if ctx->conv_frame is non-NULL */
+AVFrame * bg_ffmpeg_codec_create_conv_frame(bg_ffmpeg_codec_context_t * ctx);
+
+/* Set up dst for encoding f, does the pixelformat conversion */
+void bg_ffmpeg_codec_prepare_video_frame(bg_ffmpeg_codec_context_t * ctx,
+                                         gavl_video_frame_t * f,
+                                         AVFrame * dst, AVFrame * conv);
+
+/* Pass an encoded packet downstream. Sets FLAG_ERROR on failure */
+void bg_ffmpeg_codec_put_video_packet(bg_ffmpeg_codec_context_t * ctx,
+                                      AVPacket * pkt);
+
 /* ffmpeg_common.c */
 
 typedef struct ffmpeg_priv_s ffmpeg_priv_t;
@@ -323,6 +422,9 @@ struct ffmpeg_priv_s
 
   gavl_dictionary_t m;
 
+  /* Packets of async encoders come from different threads */
+  pthread_mutex_t write_mutex;
+  
 #if 0  
   pthread_mutex_t sdp_mutex;
   char * sdp_string;
@@ -0,0 +1,291 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Frame parallel encoding for intra-only codecs: Each worker thread
+   has its own AVCodecContext and encodes whole frames. The jobs are
+   kept in a ring, so the packets can be passed in the order of the
+   input frames. The pts cache is filled only when a packet is
+   emitted, so it never holds more than one frame.
+
+   With a fixed quantizer, the output is the same as with one
+   context. With a target bitrate, each context has its own rate
+   control, so the frames differ while the total size stays close */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "ffmpeg_common.h"
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "ffmpeg_framemt"
+
+typedef struct
+  {
+  gavl_video_frame_t * frame;
+  AVFrame * avframe;
+  AVFrame * conv; /* Scratch frame for the pixelformat conversion */
+
+  AVPacket * pkt;
+  int have_packet;
+  } job_t;
+
+struct bg_ffmpeg_frame_mt_s
+  {
+  bg_ffmpeg_codec_context_t * ctx;
+  
+  /* One codec context per thread */
+  AVCodecContext ** avctx;
+  int num_threads;
+
+  /* The job after the submitted ones is filled by the application */
+  bgen_job_queue_t * q;
+  job_t * jobs;
+  int num_jobs;
+
+  gavl_video_sink_t * sink;
+  };
+
+static int encode_job(void * priv, int idx, int thread)
+  {
+  int result;
+  bg_ffmpeg_frame_mt_t * mt = priv;
+  job_t * job = &mt->jobs[idx];
+  
+  bg_ffmpeg_codec_prepare_video_frame(mt->ctx, job->frame,
+                                      job->avframe, job->conv);
+  
+  if(avcodec_send_frame(mt->avctx[thread], job->avframe) < 0)
+    return 0;
+
+  /* Intra-only codecs without delay return the packet immediately */
+  result = avcodec_receive_packet(mt->avctx[thread], job->pkt);
+
+  if(!result)
+    job->have_packet = 1;
+  else if(result != AVERROR(EAGAIN))
+    return 0;
+  
+  return 1;
+  }
+
+/* Emit finished jobs in order. If wait is nonzero, wait
+   until the oldest job is done */
+
+static gavl_sink_status_t drain(bg_ffmpeg_frame_mt_t * mt, int wait)
+  {
+  int result;
+  job_t * job;
+  bg_ffmpeg_codec_context_t * ctx = mt->ctx;
+  
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(!(result = bgen_job_queue_wait(mt->q, 0, wait)))
+      break;
+
+    if(result < 0)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Encoding frame failed");
+      return GAVL_SINK_ERROR;
+      }
+    
+    job = &mt->jobs[bgen_job_queue_get_job(mt->q, 0)];
+    
+    if(job->have_packet)
+      {
+      if(!bg_encoder_pts_cache_push_frame(ctx->pc, job->frame))
+        {
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "PTS cache full");
+        return GAVL_SINK_ERROR;
+        }
+      bg_ffmpeg_codec_put_video_packet(ctx, job->pkt);
+      av_packet_unref(job->pkt);
+      job->have_packet = 0;
+      }
+    
+    bgen_job_queue_release(mt->q);
+
+    if(ctx->flags & FLAG_ERROR)
+      return GAVL_SINK_ERROR;
+    
+    /* Only wait for one job */
+    wait = 0;
+    }
+  
+  return GAVL_SINK_OK;
+  }
+
+/* Get the job filled by the application */
+
+static job_t * get_fill(bg_ffmpeg_frame_mt_t * mt)
+  {
+  /* One job is always kept for the application */
+  if((bgen_job_queue_num_used(mt->q) == mt->num_jobs - 1) &&
+     (drain(mt, 1) != GAVL_SINK_OK))
+    return NULL;
+  return &mt->jobs[bgen_job_queue_get_free(mt->q)];
+  }
+
+static gavl_video_frame_t * get_video_func(void * data)
+  {
+  job_t * job;
+  bg_ffmpeg_frame_mt_t * mt = data;
+
+  if(!(job = get_fill(mt)))
+    return NULL;
+  return job->frame;
+  }
+
+static gavl_sink_status_t put_video_func(void * data, gavl_video_frame_t * f)
+  {
+  job_t * job;
+  bg_ffmpeg_frame_mt_t * mt = data;
+  
+  if(!(job = get_fill(mt)))
+    return GAVL_SINK_ERROR;
+
+  /* Frames not obtained by get_video_func are copied */
+  if(f != job->frame)
+    {
+    gavl_video_frame_copy(&mt->ctx->vfmt, job->frame, f);
+    gavl_video_frame_copy_metadata(job->frame, f);
+    }
+  
+  bgen_job_queue_submit(mt->q);
+  return drain(mt, 0);
+  }
+
+bg_ffmpeg_frame_mt_t * bg_ffmpeg_frame_mt_create(bg_ffmpeg_codec_context_t * ctx,
+                                                 int num_threads)
+  {
+  int i;
+  job_t * job;
+  bg_ffmpeg_frame_mt_t * mt;
+
+  if(num_threads < 1)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Invalid number of threads: %d", num_threads);
+    return NULL;
+    }
+
+  mt = calloc(1, sizeof(*mt));
+  
+  /* One job per worker, the same number waiting for
+     their predecessors and one filled by the application */
+  mt->num_jobs = 2 * num_threads + 1;
+
+  if(!(mt->q = bgen_job_queue_create(num_threads, mt->num_jobs,
+                                     encode_job, mt)))
+    {
+    free(mt);
+    return NULL;
+    }
+  
+  mt->ctx = ctx;
+  mt->jobs = calloc((size_t)mt->num_jobs, sizeof(*mt->jobs));
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    job = &mt->jobs[i];
+    
+    job->frame = gavl_video_frame_create(&ctx->vfmt);
+    job->pkt = av_packet_alloc();
+
+    job->avframe = av_frame_alloc();
+    job->avframe->width  = ctx->vfmt.image_width;
+    job->avframe->height = ctx->vfmt.image_height;
+    job->avframe->format = ctx->avctx->pix_fmt;
+    
+    if(ctx->conv_frame && !(job->conv = bg_ffmpeg_codec_create_conv_frame(ctx)))
+      goto fail;
+    }
+  
+  mt->avctx = calloc((size_t)num_threads, sizeof(*mt->avctx));
+  mt->num_threads = num_threads;
+  
+  for(i = 0; i < num_threads; i++)
+    {
+    if(!(mt->avctx[i] = bg_ffmpeg_codec_clone_video(ctx)))
+      goto fail;
+    }
+
+  mt->sink = gavl_video_sink_create(get_video_func, put_video_func, mt, &ctx->vfmt);
+  
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+           "Encoding frame parallel with %d threads", num_threads);
+  
+  return mt;
+  
+  fail:
+  bg_ffmpeg_frame_mt_destroy(mt);
+  return NULL;
+  }
+
+gavl_video_sink_t * bg_ffmpeg_frame_mt_get_sink(bg_ffmpeg_frame_mt_t * mt)
+  {
+  return mt->sink;
+  }
+
+int bg_ffmpeg_frame_mt_finish(bg_ffmpeg_frame_mt_t * mt)
+  {
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(drain(mt, 1) != GAVL_SINK_OK)
+      return 0;
+    }
+  return 1;
+  }
+
+void bg_ffmpeg_frame_mt_destroy(bg_ffmpeg_frame_mt_t * mt)
+  {
+  int i;
+  job_t * job;
+  
+  /* Unfinished jobs are still encoded, but not emitted */
+  bgen_job_queue_destroy(mt->q);
+
+  for(i = 0; i < mt->num_threads; i++)
+    {
+    if(mt->avctx[i])
+      avcodec_free_context(&mt->avctx[i]);
+    }
+  
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    job = &mt->jobs[i];
+    
+    if(job->frame)
+      gavl_video_frame_destroy(job->frame);
+    if(job->avframe)
+      av_frame_free(&job->avframe);
+    if(job->conv)
+      av_frame_free(&job->conv);
+    if(job->pkt)
+      av_packet_free(&job->pkt);
+    }
+
+  if(mt->sink)
+    gavl_video_sink_destroy(mt->sink);
+  
+  if(mt->avctx)
+    free(mt->avctx);
+  free(mt->jobs);
+  free(mt);
+  }
@@ -983,3 +983,47 @@ RC buffer size") \
     .val_default = GAVL_VALUE_INIT_INT(0), \
     .help_string = TRS("Number of threads to use") \
   }
+
+/** Frame threads for intra-only codecs */
+#define PARAM_FRAME_THREADS  \
+  { \
+    .name = "ff_frame_threads", \
+    .long_name = TRS("Frame threads"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_min = GAVL_VALUE_INIT_INT(1), \
+    .val_max = GAVL_VALUE_INIT_INT(256), \
+    .val_default = GAVL_VALUE_INIT_INT(1), \
+    .help_string = TRS("Encode this many frames at once. Each thread has its own encoder instance.") \
+  }
+
+/** Chunk parallel encoding for codecs with inter frames */
+#define PARAM_CHUNK_THREADS  \
+  { \
+    .name = "ff_chunk_threads", \
+    .long_name = TRS("Chunk threads"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_min = GAVL_VALUE_INIT_INT(1), \
+    .val_max = GAVL_VALUE_INIT_INT(256), \
+    .val_default = GAVL_VALUE_INIT_INT(1), \
+    .help_string = TRS("Encode this many chunks at once. Each chunk starts with a keyframe and is encoded by its own encoder instance. Not available for live streams.") \
+  }
+
+#define PARAM_CHUNK_FRAMES  \
+  { \
+    .name = "ff_chunk_frames", \
+    .long_name = TRS("Chunk length (frames)"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_min = GAVL_VALUE_INIT_INT(1), \
+    .val_max = GAVL_VALUE_INIT_INT(10000), \
+    .val_default = GAVL_VALUE_INIT_INT(120), \
+    .help_string = TRS("Maximum number of frames per chunk. All frames of the chunks being encoded are kept in memory.") \
+  }
+
+#define PARAM_CHUNK_SCENE  \
+  { \
+    .name = "ff_chunk_scene", \
+    .long_name = TRS("Cut chunks at scene changes"),    \
+    .type = BG_PARAMETER_CHECKBUTTON,             \
+    .val_default = GAVL_VALUE_INIT_INT(1), \
+    .help_string = TRS("Start a new chunk at scene changes after at least half the chunk length") \
+  }
@@ -0,0 +1,360 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Pixel format conversions, which are done before the frames are
+   passed to libavcodec. The kernels are selected at runtime. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ffmpeg_common.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_CONV
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define HAVE_NEON_CONV
+#include <arm_neon.h>
+#endif
+
+/* C versions, also used for the remaining pixels of the SIMD versions */
+
+static void swap_rb_32_c(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8_t swp;
+  
+  for(i = 0; i < num; i++)
+    {
+    swp = ptr[0];
+    ptr[0] = ptr[2];
+    ptr[2] = swp;
+    ptr += 4;
+    }
+  }
+
+static void swap_rb_24_c(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8_t swp;
+  
+  for(i = 0; i < num; i++)
+    {
+    swp = ptr[0];
+    ptr[0] = ptr[2];
+    ptr[2] = swp;
+    ptr += 3;
+    }
+  }
+
+static void yuy2_to_planar_c(uint8_t * y, uint8_t * u, uint8_t * v,
+                             const uint8_t * src, int num)
+  {
+  int i;
+  
+  for(i = 0; i < num / 2; i++)
+    {
+    y[0] = src[0];
+    *u   = src[1];
+    y[1] = src[2];
+    *v   = src[3];
+    y += 2;
+    u++;
+    v++;
+    src += 4;
+    }
+  }
+
+static void interleave_uv_c(uint8_t * dst, const uint8_t * u,
+                            const uint8_t * v, int num)
+  {
+  int i;
+  
+  for(i = 0; i < num; i++)
+    {
+    dst[0] = u[i];
+    dst[1] = v[i];
+    dst += 2;
+    }
+  }
+
+#ifdef HAVE_X86_CONV
+
+__attribute__((target("ssse3")))
+static void swap_rb_32_ssse3(uint8_t * ptr, int num)
+  {
+  int i;
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                     10, 9, 8, 11, 14, 13, 12, 15);
+  
+  for(i = 0; i + 4 <= num; i += 4)
+    _mm_storeu_si128((__m128i*)(ptr + 4*i),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 4*i)), mask));
+  swap_rb_32_c(ptr + 4*i, num - i);
+  }
+
+/* 5 pixels per 16 bytes. The last byte belongs to the next pixel
+   and is written back unchanged */
+
+__attribute__((target("ssse3")))
+static void swap_rb_24_ssse3(uint8_t * ptr, int num)
+  {
+  int i;
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7,
+                                     6, 11, 10, 9, 14, 13, 12, 15);
+  
+  for(i = 0; i + 6 <= num; i += 5)
+    _mm_storeu_si128((__m128i*)(ptr + 3*i),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + 3*i)), mask));
+  swap_rb_24_c(ptr + 3*i, num - i);
+  }
+
+/* 16 pixels: Y0..7 U0..3 V0..3 after the shuffle */
+
+__attribute__((target("ssse3")))
+static void yuy2_to_planar_ssse3(uint8_t * y, uint8_t * u, uint8_t * v,
+                                 const uint8_t * src, int num)
+  {
+  int i;
+  __m128i a, b, uv;
+  const __m128i mask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                     1, 5, 9, 13, 3, 7, 11, 15);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 2*i)), mask);
+    b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 2*i + 16)), mask);
+    
+    _mm_storeu_si128((__m128i*)(y + i), _mm_unpacklo_epi64(a, b));
+
+    uv = _mm_unpackhi_epi32(a, b);
+    _mm_storel_epi64((__m128i*)(u + i/2), uv);
+    _mm_storel_epi64((__m128i*)(v + i/2), _mm_srli_si128(uv, 8));
+    }
+  yuy2_to_planar_c(y + i, u + i/2, v + i/2, src + 2*i, num - i);
+  }
+
+__attribute__((target("ssse3")))
+static void interleave_uv_ssse3(uint8_t * dst, const uint8_t * u,
+                                const uint8_t * v, int num)
+  {
+  int i;
+  __m128i a, b;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    a = _mm_loadu_si128((const __m128i*)(u + i));
+    b = _mm_loadu_si128((const __m128i*)(v + i));
+    _mm_storeu_si128((__m128i*)(dst + 2*i),      _mm_unpacklo_epi8(a, b));
+    _mm_storeu_si128((__m128i*)(dst + 2*i + 16), _mm_unpackhi_epi8(a, b));
+    }
+  interleave_uv_c(dst + 2*i, u + i, v + i, num - i);
+  }
+
+__attribute__((target("avx2")))
+static void swap_rb_32_avx2(uint8_t * ptr, int num)
+  {
+  int i;
+  const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    _mm256_storeu_si256((__m256i*)(ptr + 4*i),
+                        _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(ptr + 4*i)), mask));
+  swap_rb_32_c(ptr + 4*i, num - i);
+  }
+
+/* 32 pixels. The in-lane shuffle gives Y0..7 U0..3 V0..3 | Y8..15 U4..7 V4..7,
+   the dword permutation moves the lumas together */
+
+__attribute__((target("avx2")))
+static void yuy2_to_planar_avx2(uint8_t * y, uint8_t * u, uint8_t * v,
+                                const uint8_t * src, int num)
+  {
+  int i;
+  __m256i a, b, uv;
+  const __m256i mask = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                        1, 5, 9, 13, 3, 7, 11, 15,
+                                        0, 2, 4, 6, 8, 10, 12, 14,
+                                        1, 5, 9, 13, 3, 7, 11, 15);
+  const __m256i perm = _mm256_setr_epi32(0, 1, 4, 5, 2, 6, 3, 7);
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    {
+    a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + 2*i)), mask);
+    b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + 2*i + 32)), mask);
+
+    /* Y0..15 U0..7 V0..7 */
+    a = _mm256_permutevar8x32_epi32(a, perm);
+    b = _mm256_permutevar8x32_epi32(b, perm);
+
+    _mm256_storeu_si256((__m256i*)(y + i), _mm256_permute2x128_si256(a, b, 0x20));
+
+    /* U0..7 V0..7 U8..15 V8..15 -> U0..15 V0..15 */
+    uv = _mm256_permute4x64_epi64(_mm256_permute2x128_si256(a, b, 0x31), 0xd8);
+    _mm_storeu_si128((__m128i*)(u + i/2), _mm256_castsi256_si128(uv));
+    _mm_storeu_si128((__m128i*)(v + i/2), _mm256_extracti128_si256(uv, 1));
+    }
+  yuy2_to_planar_c(y + i, u + i/2, v + i/2, src + 2*i, num - i);
+  }
+
+__attribute__((target("avx2")))
+static void interleave_uv_avx2(uint8_t * dst, const uint8_t * u,
+                               const uint8_t * v, int num)
+  {
+  int i;
+  __m256i a, b, lo, hi;
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    {
+    a = _mm256_loadu_si256((const __m256i*)(u + i));
+    b = _mm256_loadu_si256((const __m256i*)(v + i));
+    lo = _mm256_unpacklo_epi8(a, b);
+    hi = _mm256_unpackhi_epi8(a, b);
+    _mm256_storeu_si256((__m256i*)(dst + 2*i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i*)(dst + 2*i + 32),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+  interleave_uv_c(dst + 2*i, u + i, v + i, num - i);
+  }
+
+#endif
+
+#ifdef HAVE_NEON_CONV
+
+static void swap_rb_32_neon(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8x16x4_t x;
+  uint8x16_t swp;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    x = vld4q_u8(ptr + 4*i);
+    swp = x.val[0];
+    x.val[0] = x.val[2];
+    x.val[2] = swp;
+    vst4q_u8(ptr + 4*i, x);
+    }
+  swap_rb_32_c(ptr + 4*i, num - i);
+  }
+
+static void swap_rb_24_neon(uint8_t * ptr, int num)
+  {
+  int i;
+  uint8x16x3_t x;
+  uint8x16_t swp;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    x = vld3q_u8(ptr + 3*i);
+    swp = x.val[0];
+    x.val[0] = x.val[2];
+    x.val[2] = swp;
+    vst3q_u8(ptr + 3*i, x);
+    }
+  swap_rb_24_c(ptr + 3*i, num - i);
+  }
+
+static void yuy2_to_planar_neon(uint8_t * y, uint8_t * u, uint8_t * v,
+                                const uint8_t * src, int num)
+  {
+  int i;
+  uint8x16x4_t x;
+  uint8x16x2_t luma;
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    {
+    /* Y even, U, Y odd, V */
+    x = vld4q_u8(src + 2*i);
+    luma.val[0] = x.val[0];
+    luma.val[1] = x.val[2];
+    vst2q_u8(y + i, luma);
+    vst1q_u8(u + i/2, x.val[1]);
+    vst1q_u8(v + i/2, x.val[3]);
+    }
+  yuy2_to_planar_c(y + i, u + i/2, v + i/2, src + 2*i, num - i);
+  }
+
+static void interleave_uv_neon(uint8_t * dst, const uint8_t * u,
+                               const uint8_t * v, int num)
+  {
+  int i;
+  uint8x16x2_t x;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    x.val[0] = vld1q_u8(u + i);
+    x.val[1] = vld1q_u8(v + i);
+    vst2q_u8(dst + 2*i, x);
+    }
+  interleave_uv_c(dst + 2*i, u + i, v + i, num - i);
+  }
+
+#endif
+
+static bg_ffmpeg_pixconv_t pixconv;
+
+static pthread_once_t pixconv_once = PTHREAD_ONCE_INIT;
+
+static void pixconv_init(void)
+  {
+  pixconv.swap_rb_32     = swap_rb_32_c;
+  pixconv.swap_rb_24     = swap_rb_24_c;
+  pixconv.yuy2_to_planar = yuy2_to_planar_c;
+  pixconv.interleave_uv  = interleave_uv_c;
+
+#ifdef HAVE_X86_CONV
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("ssse3"))
+    {
+    pixconv.swap_rb_32     = swap_rb_32_ssse3;
+    pixconv.swap_rb_24     = swap_rb_24_ssse3;
+    pixconv.yuy2_to_planar = yuy2_to_planar_ssse3;
+    pixconv.interleave_uv  = interleave_uv_ssse3;
+    }
+  /* RGB24 has no AVX2 version, the 3 byte pixels don't fit into the lanes */
+  if(__builtin_cpu_supports("avx2"))
+    {
+    pixconv.swap_rb_32     = swap_rb_32_avx2;
+    pixconv.yuy2_to_planar = yuy2_to_planar_avx2;
+    pixconv.interleave_uv  = interleave_uv_avx2;
+    }
+#endif
+
+#ifdef HAVE_NEON_CONV
+  pixconv.swap_rb_32     = swap_rb_32_neon;
+  pixconv.swap_rb_24     = swap_rb_24_neon;
+  pixconv.yuy2_to_planar = yuy2_to_planar_neon;
+  pixconv.interleave_uv  = interleave_uv_neon;
+#endif
+  }
+
+const bg_ffmpeg_pixconv_t * bg_ffmpeg_pixconv_get(void)
+  {
+  pthread_once(&pixconv_once, pixconv_init);
+  return &pixconv;
+  }
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <config.h>
 
@@ -40,6 +41,7 @@
 #include <gavl/numptr.h>
 
 
+#include <gmerlin_encoders.h>
 #include <bgflac.h>
 #include <vorbiscomment.h>
 
@@ -55,6 +57,11 @@ typedef struct
   int use_vorbis_comment;
   int use_seektable;
   int num_seektable_entries;
+
+  int padding;         /* Bytes */
+  int padding_percent; /* Of the other metadata */
+
+  int append;          /* From config */
   
   int add_cover;   // From config
   
@@ -71,13 +78,12 @@ typedef struct
   
   int64_t bytes_written;
 
-  /* Table with *all* frames */
-  FLAC__StreamMetadata_SeekPoint * frame_table;
-  uint32_t frame_table_len;
-  uint32_t frame_table_alloc;
+  /* Candidates for the seek table */
+  bgen_seek_index_t frame_index;
   
   /* Generated seek table */
   FLAC__StreamMetadata_SeekPoint * seektable; 
+  int seektable_entries; /* Configured or from the existing file */
   
   //  gavl_compression_info_t ci;
   // gavl_dictionary_t m_stream;
@@ -94,6 +100,15 @@ typedef struct
   const gavl_dictionary_t * m_global;
 
   int write_seektable;
+  int write_padding;
+  int seektable_last;
+  
+  int header_written;
+
+  /* Continuing an existing file */
+  int appending;
+  int streaminfo_last;
+  FILE * out;
   
   gavl_io_t * io;
 
@@ -148,10 +163,13 @@ static int write_seektable(FLAC__StreamMetadata_SeekPoint * index,
   {
   int i;
   int len_bytes;
-  uint8_t buf[18];
-  int ret = 0;
+  uint8_t * buf;
+  int ret;
   uint8_t * ptr;
 
+  len_bytes = len * 18;
+  
+  buf = malloc(4 + len_bytes);
   ptr = buf;
   
   ptr[0] = 3;
@@ -160,19 +178,44 @@ static int write_seektable(FLAC__StreamMetadata_SeekPoint * index,
 
   ptr++;
   
-  len_bytes = len * 18;
-  GAVL_24BE_2_PTR(len_bytes, ptr);
-  write_data(f, buf, 4);
+  GAVL_24BE_2_PTR(len_bytes, ptr); ptr += 3;
   
   for(i = 0; i < len; i++)
     {
-    ptr = buf;
     GAVL_64BE_2_PTR(index[i].sample_number, ptr); ptr += 8;
     GAVL_64BE_2_PTR(index[i].stream_offset, ptr); ptr += 8;
     GAVL_16BE_2_PTR(index[i].frame_samples, ptr); ptr += 2;
-    write_data(f, buf, 18);
     }
+
+  ret = write_data(f, buf, 4 + len_bytes);
+  free(buf);
+  return ret;
+  }
+
+/* Zero filled PADDING block, which allows taggers to
+   update the metadata without rewriting the whole file */
+
+#define MAX_PADDING 0xffffff
+
+static int write_padding(flac_t * f)
+  {
+  int64_t len;
+  uint8_t * buf;
+  int ret;
   
+  len = f->padding + (f->bytes_written * f->padding_percent) / 100;
+
+  if(len > MAX_PADDING)
+    len = MAX_PADDING;
+  
+  buf = calloc(1, 4 + len);
+
+  /* Always the last metadata block */
+  buf[0] = 0x01 | 0x80;
+  GAVL_24BE_2_PTR(len, buf + 1);
+
+  ret = write_data(f, buf, 4 + len);
+  free(buf);
   return ret;
   }
 
@@ -222,6 +265,31 @@ static const bg_parameter_info_t parameters[] =
       .help_string = TRS("Maximum number of entries in the seek table. Default is 100, larger numbers result in\
  shorter seeking times but also in larger files.")
     },
+    {
+      .name =        "padding",
+      .long_name =   TRS("Padding (bytes)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min = GAVL_VALUE_INIT_INT(0),
+      .val_max = GAVL_VALUE_INIT_INT(MAX_PADDING),
+      .val_default = GAVL_VALUE_INIT_INT(8192),
+      .help_string = TRS("Reserve space after the metadata. Taggers can use it to update the metadata without rewriting the whole file. 0 together with a relative padding of 0 writes no padding.")
+    },
+    {
+      .name =        "padding_percent",
+      .long_name =   TRS("Relative padding (%)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min = GAVL_VALUE_INIT_INT(0),
+      .val_max = GAVL_VALUE_INIT_INT(1000),
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Additional padding in percent of the size of the other metadata blocks. Useful if the cover or the comments are expected to grow.")
+    },
+    {
+      .name =        "append",
+      .long_name =   TRS("Append to existing files"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("If the output file exists, continue it instead of overwriting it. The audio format must match the existing file. The stream info and the seek table are updated in place, the metadata is kept.")
+    },
     { /* End of parameters */ }
   };
 
@@ -248,25 +316,32 @@ static void set_parameter_flac(void * data,
     flac->use_seektable = v->v.i;
   else if(!strcmp(name, "num_seektable_entries"))
     flac->num_seektable_entries = v->v.i;
+  else if(!strcmp(name, "padding"))
+    flac->padding = v->v.i;
+  else if(!strcmp(name, "padding_percent"))
+    flac->padding_percent = v->v.i;
+  else if(!strcmp(name, "append"))
+    flac->append = v->v.i;
   }
 
 static int streaminfo_callback(void * data, uint8_t * si, int len)
   {
-  int first;
   flac_t * flac = data;
 
   int last = 0;
   
-  if(flac->bytes_written)
-    first = 0;
-  else
-    first = 1;
-  
-  if(first)
+  if(!flac->header_written)
     {
+    flac->header_written = 1;
+
+    /* The headers of the existing file are kept */
+    if(flac->appending)
+      return 1;
+    
     /* Set or clear the "last metadata packet" flag */
 
-    if(flac->write_seektable || flac->use_vorbis_comment || flac->cover)
+    if(flac->write_seektable || flac->use_vorbis_comment || flac->cover ||
+       flac->write_padding)
       last = 0;
     else
       last = 1;
@@ -282,7 +357,7 @@ static int streaminfo_callback(void * data, uint8_t * si, int len)
 
     if(flac->use_vorbis_comment)
       {
-      if(flac->write_seektable || flac->cover)
+      if(flac->write_seektable || flac->cover || flac->write_padding)
         last = 0;
       else
         last = 1;
@@ -291,13 +366,14 @@ static int streaminfo_callback(void * data, uint8_t * si, int len)
       }
     if(flac->write_seektable)
       {
-      if(flac->cover)
+      if(flac->cover || flac->write_padding)
         last = 0;
       else
         last = 1;
       
       flac->seektable_start = flac->bytes_written;
-      write_seektable(flac->seektable, flac->num_seektable_entries, flac, last);
+      flac->seektable_last = last;
+      write_seektable(flac->seektable, flac->seektable_entries, flac, last);
       }
     if(flac->cover)
       {
@@ -307,17 +383,27 @@ static int streaminfo_callback(void * data, uint8_t * si, int len)
       int len;
 
       gavl_io_t * io_mem = gavl_io_create_mem_write();
-      bg_flac_cover_tag_write(io_mem, flac->cover, 1);
+      bg_flac_cover_tag_write(io_mem, flac->cover, !flac->write_padding);
       buf = gavl_io_mem_get_buf(io_mem, &len);
       write_data(flac, buf, len);
       
       free(buf);
       gavl_io_destroy(io_mem);
       }
-    
+
+    if(flac->write_padding && !write_padding(flac))
+      return 0;
     }
   else if(!flac->streaming)
     {
+    if(flac->appending)
+      {
+      if(flac->streaminfo_last)
+        si[4] |= 0x80;
+      else
+        si[4] &= 0x7f;
+      }
+    
     gavl_io_seek(flac->io, 0, SEEK_SET);
     if(!write_data(flac, si, len))
       return 0;
@@ -340,11 +426,14 @@ static int open_io_flac(void * data, gavl_io_t * io,
   
   /* Create seektable */
 
-  flac->write_seektable = flac->use_seektable;
+  if(!flac->appending)
+    flac->write_seektable = flac->use_seektable;
   
   if(flac->streaming)
     flac->write_seektable = 0;
 
+  flac->write_padding = flac->padding || flac->padding_percent;
+
   /* Check if we have a cover */
 
   if(flac->add_cover)
@@ -363,12 +452,16 @@ static int open_io_flac(void * data, gavl_io_t * io,
       flac->cover = NULL;
     }
   
-  if(flac->write_seektable)
+  if(flac->write_seektable && !flac->appending)
     {
     int i;
-    flac->seektable = calloc(flac->num_seektable_entries, sizeof(*flac->seektable));
-    for(i = 0; i < flac->num_seektable_entries; i++)
+    flac->seektable_entries = flac->num_seektable_entries;
+    flac->seektable = calloc(flac->seektable_entries, sizeof(*flac->seektable));
+    for(i = 0; i < flac->seektable_entries; i++)
       flac->seektable[i].sample_number = 0xFFFFFFFFFFFFFFFFLL;
+
+    /* Twice the entries to choose from */
+    bgen_seek_index_init(&flac->frame_index, 2 * flac->seektable_entries);
     }
 
   flac->m_global = m;
@@ -377,6 +470,77 @@ static int open_io_flac(void * data, gavl_io_t * io,
   
   }
 
+/* Get the metadata layout of a file, which will be continued */
+
+static int read_existing(flac_t * flac, FILE * in)
+  {
+  int i;
+  uint8_t buf[18];
+  int type;
+  int last;
+  int len;
+  int first = 1;
+
+  /* Set only if the file has a seektable */
+  flac->write_seektable = 0;
+  flac->seektable_entries = 0;
+  
+  if((fread(buf, 1, 4, in) < 4) || memcmp(buf, "fLaC", 4))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot append to %s: No flac file",
+             flac->filename);
+    return 0;
+    }
+
+  do
+    {
+    if(fread(buf, 1, 4, in) < 4)
+      return 0;
+
+    type = buf[0] & 0x7f;
+    last = !!(buf[0] & 0x80);
+    len = GAVL_PTR_2_24BE(buf + 1);
+
+    if(first && (type != FLAC__METADATA_TYPE_STREAMINFO))
+      return 0;
+    first = 0;
+    
+    switch(type)
+      {
+      case FLAC__METADATA_TYPE_STREAMINFO:
+        flac->streaminfo_last = last;
+        break;
+      case FLAC__METADATA_TYPE_SEEKTABLE:
+        flac->seektable_start = ftell(in) - 4;
+        flac->seektable_last = last;
+        flac->seektable_entries = len / 18;
+        flac->seektable = calloc(flac->seektable_entries,
+                                 sizeof(*flac->seektable));
+        
+        for(i = 0; i < flac->seektable_entries; i++)
+          {
+          if(fread(buf, 1, 18, in) < 18)
+            return 0;
+          flac->seektable[i].sample_number = GAVL_PTR_2_64BE(buf);
+          flac->seektable[i].stream_offset = GAVL_PTR_2_64BE(buf + 8);
+          flac->seektable[i].frame_samples = GAVL_PTR_2_16BE(buf + 16);
+          }
+        len -= flac->seektable_entries * 18;
+        
+        /* Keep the size of the existing table */
+        flac->write_seektable = !!flac->seektable_entries;
+        break;
+      }
+    
+    if(fseek(in, len, SEEK_CUR))
+      return 0;
+    
+    } while(!last);
+
+  flac->data_start = ftell(in);
+  return 1;
+  }
+
 static int open_flac(void * data, const char * filename,
                      const gavl_dictionary_t * m)
   {
@@ -394,12 +558,22 @@ static int open_flac(void * data, const char * filename,
     flac->filename = gavl_filename_ensure_extension(filename, "flac");
     if(!bg_encoder_cb_create_output_file(flac->cb, flac->filename))
       return 0;
-    
-    if(!(out = fopen(flac->filename, "wb")))
+
+    if(flac->append && (out = fopen(flac->filename, "r+b")))
+      {
+      if(!read_existing(flac, out))
+        {
+        fclose(out);
+        return 0;
+        }
+      flac->appending = 1;
+      }
+    else if(!(out = fopen(flac->filename, "wb")))
       {
       gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot open %s: %s",
              flac->filename, strerror(errno));
       }
+    flac->out = out;
     io = gavl_io_create_file(out, 1, 1, 1);
     }
 
@@ -426,18 +600,10 @@ static void append_packet(flac_t * f, int samples)
   {
   if(f->streaming)
     return;
-  
-  if(f->frame_table_len + 1 > f->frame_table_alloc)
-    {
-    f->frame_table_alloc += 10000;
-    f->frame_table = realloc(f->frame_table,
-                             f->frame_table_alloc * sizeof(*f->frame_table));
-    }
 
-  f->frame_table[f->frame_table_len].sample_number = f->samples_written;
-  f->frame_table[f->frame_table_len].frame_samples = samples;
-  f->frame_table[f->frame_table_len].stream_offset = f->bytes_written - f->data_start;
-  f->frame_table_len++;
+  if(f->write_seektable)
+    bgen_seek_index_append(&f->frame_index, f->samples_written,
+                           f->bytes_written - f->data_start, samples);
 
   //  fprintf(stderr, "Append packet %ld %d -> %ld\n", f->samples_written, samples,
   //          f->samples_written + samples);
@@ -465,8 +631,21 @@ write_audio_packet_func_flac(void * priv, gavl_packet_t * packet)
 static int start_flac(void * data)
   {
   flac_t * flac;
+  int64_t end_pos = 0;
   flac = data;
 
+  if(flac->appending)
+    {
+    if(flac->compressed)
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+               "Appending compressed packets is not supported");
+      return 0;
+      }
+    if(!bg_flac_resume(flac->enc, flac->filename, &end_pos, &flac->samples_written))
+      return 0;
+    }
+  
   if(flac->compressed)
     {
     if(!(flac->psink_ext = bg_flac_start_compressed(flac->enc, &flac->stream)))
@@ -482,7 +661,39 @@ static int start_flac(void * data)
     gavl_packet_sink_create(NULL, write_audio_packet_func_flac, flac);
   bg_flac_set_sink(flac->enc, flac->psink_int);
 
-  flac->data_start = -1;
+  if(flac->appending)
+    {
+    int i;
+    
+    /* Remove the last frame if it will be encoded again */
+    if(ftruncate(fileno(flac->out), end_pos))
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Cannot truncate %s: %s",
+               flac->filename, strerror(errno));
+      return 0;
+      }
+    gavl_io_seek(flac->io, end_pos, SEEK_SET);
+    flac->bytes_written = end_pos;
+
+    /* Take over the valid points of the old seektable */
+    if(flac->write_seektable)
+      {
+      bgen_seek_index_init(&flac->frame_index, 2 * flac->seektable_entries);
+
+      for(i = 0; i < flac->seektable_entries; i++)
+        {
+        if((flac->seektable[i].sample_number == 0xFFFFFFFFFFFFFFFFLL) ||
+           (flac->seektable[i].sample_number >= flac->samples_written))
+          break;
+        bgen_seek_index_append(&flac->frame_index,
+                               flac->seektable[i].sample_number,
+                               flac->seektable[i].stream_offset,
+                               flac->seektable[i].frame_samples);
+        }
+      }
+    }
+  else
+    flac->data_start = -1;
   
   return 1;
   }
@@ -501,15 +712,24 @@ static gavl_packet_sink_t * get_audio_packet_sink_flac(void * data, int stream)
   return flac->psink_ext;
   }
 
+static void set_seek_point(FLAC__StreamMetadata_SeekPoint * dst,
+                           const bgen_seek_point_t * src)
+  {
+  dst->sample_number = src->time;
+  dst->stream_offset = src->position;
+  dst->frame_samples = src->duration;
+  }
+
 static void build_seek_table(flac_t * flac)
   {
   int i;
-
+  const bgen_seek_index_t * idx = &flac->frame_index;
+  
   /* We encoded fewer frames than we have in the seektable: Placeholders will remain there */
-  if(flac->frame_table_len <= flac->num_seektable_entries)
+  if(idx->num_points <= flac->seektable_entries)
     {
-    memcpy(flac->seektable, flac->frame_table,
-           flac->frame_table_len * sizeof(*flac->seektable));
+    for(i = 0; i < idx->num_points; i++)
+      set_seek_point(flac->seektable + i, idx->points + i);
     }
   /* More common case: We have more frames than we will have in the seek table */
   else
@@ -518,22 +738,20 @@ static void build_seek_table(flac_t * flac)
     int64_t next_seek_sample;
     
     /* First entry is always copied */
-    memcpy(flac->seektable, flac->frame_table,
-           sizeof(*flac->seektable));
+    set_seek_point(flac->seektable, idx->points);
     
     index = 1;
-    next_seek_sample = (flac->samples_written * index) / flac->num_seektable_entries;
+    next_seek_sample = (flac->samples_written * index) / flac->seektable_entries;
     
-    for(i = 1; i < flac->frame_table_len; i++)
+    for(i = 1; i < idx->num_points; i++)
       {
-      if(flac->frame_table[i].sample_number >= next_seek_sample)
+      if(idx->points[i].time >= next_seek_sample)
         {
-        memcpy(flac->seektable + index, flac->frame_table + i,
-               sizeof(*flac->seektable));
+        set_seek_point(flac->seektable + index, idx->points + i);
         index++;
-        next_seek_sample = (flac->samples_written * index) / flac->num_seektable_entries;
+        next_seek_sample = (flac->samples_written * index) / flac->seektable_entries;
 
-        if(index >= flac->num_seektable_entries)
+        if(index >= flac->seektable_entries)
           break;
         }
       }
@@ -542,8 +760,6 @@ static void build_seek_table(flac_t * flac)
 
 static void finalize(flac_t * flac)
   {
-  int last = 0;
-  
   if(!flac->io)
     return;
   
@@ -554,14 +770,11 @@ static void finalize(flac_t * flac)
   /* Seek table */
   if(flac->write_seektable) // Build seek table
     {
-    if(!flac->cover)
-      last = 1;
-    
     build_seek_table(flac);
     gavl_io_seek(flac->io, flac->seektable_start, SEEK_SET);
     write_seektable(flac->seektable,
-                    flac->num_seektable_entries,
-                    flac, last);
+                    flac->seektable_entries,
+                    flac, flac->seektable_last);
     }
   }
 
@@ -580,7 +793,8 @@ static int close_flac(void * data, int do_delete)
   /* Finalize output file */
   if(flac->io)
     {
-    if(do_delete && flac->filename)
+    /* Never delete the file we appended to */
+    if(do_delete && flac->filename && !flac->appending)
       {
       gavl_io_destroy(flac->io);
       flac->io = NULL;
@@ -606,11 +820,7 @@ static int close_flac(void * data, int do_delete)
     flac->seektable = NULL;
     }
 
-  if(flac->frame_table)
-    {
-    free(flac->frame_table);
-    flac->frame_table = NULL;
-    }
+  bgen_seek_index_free(&flac->frame_index);
   if(flac->psink_int)
     {
     gavl_packet_sink_destroy(flac->psink_int);
@@ -628,6 +838,12 @@ static int close_flac(void * data, int do_delete)
     }
 
   gavl_dictionary_reset(&flac->stream);
+
+  flac->header_written = 0;
+  flac->appending = 0;
+  flac->write_seektable = 0;
+  flac->seektable_entries = 0;
+  flac->out = NULL;
   
   return 1;
   }
@@ -0,0 +1,303 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Sends mp3 streams to an icecast server */
+
+#include <string.h>
+#include <stdlib.h>
+#include <config.h>
+
+#include <gmerlin_encoders.h>
+#include <gmerlin/pluginfuncs.h>
+#include <gmerlin/translation.h>
+
+/* Streams are always CBR */
+#include "bglame.h"
+
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "b_lame"
+
+#include <gavl/metatags.h>
+#include <gavl/state.h>
+
+#include <bgshout.h>
+
+typedef struct
+  {
+  bg_lame_t * codec;
+  bg_shout_t * shout;
+
+  gavl_dictionary_t s;
+
+  gavl_packet_sink_t * psink;
+  gavl_audio_sink_t * asink;
+
+  bg_msg_sink_t * msg_sink;
+
+  int compressed;
+  } b_lame_t;
+
+static void * create_b_lame()
+  {
+  b_lame_t * ret;
+  ret = calloc(1, sizeof(*ret));
+  ret->codec = bg_lame_create();
+  ret->shout = bg_shout_create(SHOUT_FORMAT_MP3);
+  return ret;
+  }
+
+static void destroy_b_lame(void * priv)
+  {
+  b_lame_t * b = priv;
+  if(b->codec)
+    bg_lame_destroy(b->codec);
+  bg_shout_destroy(b->shout);
+  if(b->psink)
+    gavl_packet_sink_destroy(b->psink);
+  if(b->msg_sink)
+    bg_msg_sink_destroy(b->msg_sink);
+  gavl_dictionary_free(&b->s);
+  free(b);
+  }
+
+static const bg_parameter_info_t * get_parameters_b_lame(void * data)
+  {
+  return bg_shout_get_parameters();
+  }
+
+static void set_parameter_b_lame(void * data, const char * name,
+                                 const gavl_value_t * v)
+  {
+  b_lame_t * b = data;
+  bg_shout_set_parameter(b->shout, name, v);
+  }
+
+static const char * get_protocols_b_lame(void * data)
+  {
+  return "icecast shout";
+  }
+
+static int open_b_lame(void * data, const char * url,
+                       const gavl_dictionary_t * metadata)
+  {
+  b_lame_t * b = data;
+
+  gavl_dictionary_reset(&b->s);
+  gavl_init_audio_stream(&b->s);
+
+  if(url && *url)
+    bg_shout_set_url(b->shout, url);
+
+  if(metadata)
+    bg_shout_set_metadata(b->shout, metadata);
+
+  if(!bg_shout_open(b->shout))
+    return 0;
+
+  /* Initial song title */
+  bg_shout_update_metadata(b->shout, metadata);
+  return 1;
+  }
+
+static const bg_parameter_info_t * get_audio_parameters_b_lame(void * data)
+  {
+  return audio_parameters;
+  }
+
+static int
+writes_compressed_audio_b_lame(void * data, const gavl_audio_format_t * format,
+                               const gavl_compression_info_t * ci)
+  {
+  if((ci->id != GAVL_CODEC_ID_MP3) || (ci->bitrate == GAVL_BITRATE_VBR))
+    return 0;
+  return 1;
+  }
+
+static int
+add_audio_stream_b_lame(void * data,
+                        const gavl_dictionary_t * m,
+                        const gavl_audio_format_t * format)
+  {
+  b_lame_t * b = data;
+  gavl_audio_format_copy(gavl_stream_get_audio_format_nc(&b->s), format);
+  return 0;
+  }
+
+static int
+add_audio_stream_compressed_b_lame(void * data,
+                                   const gavl_dictionary_t * m,
+                                   const gavl_audio_format_t * format,
+                                   const gavl_compression_info_t * ci)
+  {
+  b_lame_t * b = data;
+  add_audio_stream_b_lame(data, m, format);
+  b->compressed = 1;
+  return 0;
+  }
+
+static void set_audio_parameter_b_lame(void * data, int stream,
+                                       const char * name,
+                                       const gavl_value_t * val)
+  {
+  b_lame_t * b = data;
+  bg_lame_set_parameter(b->codec, name, val);
+  }
+
+/* Metadata */
+
+static int handle_msg(void * data, gavl_msg_t * msg)
+  {
+  b_lame_t * b = data;
+
+  switch(msg->NS)
+    {
+    case GAVL_MSG_NS_STATE:
+      switch(msg->ID)
+        {
+        case GAVL_MSG_STATE_CHANGED:
+          {
+          const char * ctx;
+          const char * var;
+          gavl_value_t val;
+          const gavl_dictionary_t * dict;
+
+          gavl_value_init(&val);
+
+          gavl_msg_get_state(msg,
+                             NULL,
+                             &ctx,
+                             &var, &val, NULL);
+
+          if(!strcmp(ctx, GAVL_STATE_CTX_SRC) &&
+             !strcmp(var, GAVL_STATE_SRC_METADATA) &&
+             (dict = gavl_value_get_dictionary(&val)))
+            bg_shout_update_metadata(b->shout, dict);
+
+          gavl_value_free(&val);
+          }
+          break;
+        }
+      break;
+    }
+  return 1;
+  }
+
+static bg_msg_sink_t * add_msg_stream_b_lame(void * data, int stream_id)
+  {
+  b_lame_t * b = data;
+  if(stream_id != GAVL_META_STREAM_ID_MSG_PROGRAM)
+    return NULL;
+
+  b->msg_sink = bg_msg_sink_create(handle_msg, b, 1);
+  return b->msg_sink;
+  }
+
+static gavl_sink_status_t
+write_audio_packet_func_b_lame(void * data, gavl_packet_t * p)
+  {
+  b_lame_t * b = data;
+
+  if(!bg_shout_write(b->shout, p->buf.buf, p->buf.len))
+    return GAVL_SINK_ERROR;
+  return GAVL_SINK_OK;
+  }
+
+static int start_b_lame(void * data)
+  {
+  b_lame_t * b = data;
+
+  b->psink = gavl_packet_sink_create(NULL, write_audio_packet_func_b_lame, b);
+
+  if(!b->compressed)
+    {
+    if(!(b->asink = bg_lame_open(b->codec, &b->s)))
+      return 0;
+    bg_lame_set_packet_sink(b->codec, b->psink);
+    }
+  return 1;
+  }
+
+static gavl_audio_sink_t * get_audio_sink_b_lame(void * data, int stream)
+  {
+  b_lame_t * b = data;
+  return b->asink;
+  }
+
+static gavl_packet_sink_t *
+get_audio_packet_sink_b_lame(void * data, int stream)
+  {
+  b_lame_t * b = data;
+  return b->psink;
+  }
+
+static int close_b_lame(void * data, int do_delete)
+  {
+  b_lame_t * b = data;
+
+  /* Flushes the last frames */
+  bg_lame_destroy(b->codec);
+  b->codec = NULL;
+
+  bg_shout_close(b->shout);
+  return 1;
+  }
+
+const bg_encoder_plugin_t the_plugin =
+  {
+    .common =
+    {
+      BG_LOCALE,
+      .name =            "b_lame",       /* Unique short name */
+      .long_name =       TRS("MP3 Broadcaster"),
+      .description =     TRS("mp3 broadcaster for icecast servers. Based on lame (http://www.mp3dev.org) and libshout (http://www.icecast.org)."),
+      .type =            BG_PLUGIN_ENCODER,
+      .flags =           BG_PLUGIN_URL | BG_PLUGIN_BROADCAST,
+      .priority =        5,
+      .create =            create_b_lame,
+      .destroy =           destroy_b_lame,
+      .get_parameters =    get_parameters_b_lame,
+      .set_parameter =     set_parameter_b_lame,
+      .get_protocols =     get_protocols_b_lame,
+    },
+    .max_audio_streams =   1,
+    .min_audio_streams =   1,
+
+    .open =                open_b_lame,
+    .writes_compressed_audio = writes_compressed_audio_b_lame,
+    .get_audio_parameters =    get_audio_parameters_b_lame,
+
+    .add_audio_stream =        add_audio_stream_b_lame,
+    .add_audio_stream_compressed =        add_audio_stream_compressed_b_lame,
+    .add_msg_stream =          add_msg_stream_b_lame,
+
+    .set_audio_parameter =     set_audio_parameter_b_lame,
+
+    .start =                   start_b_lame,
+
+    .get_audio_sink =          get_audio_sink_b_lame,
+    .get_audio_packet_sink =   get_audio_packet_sink_b_lame,
+
+    .close =                   close_b_lame,
+  };
+
+/* Include this into all plugin modules exactly once
+   to let the plugin loader obtain the API version */
+BG_GET_PLUGIN_API_VERSION;
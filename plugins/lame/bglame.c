@@ -24,6 +24,7 @@
 #include <config.h>
 
 #include <string.h>
+#include <unistd.h>
 
 #include <gmerlin/translation.h>
 #include <gmerlin/log.h>
@@ -33,9 +34,12 @@
 
 
 #include <gavl/metatags.h>
+#include <gavl/io.h>
 
 
 #include <bglame.h>
+#include <xing.h>
+#include "lamemt.h"
 
 /* MPEG header detection: lame outputs incomplete frames,
    so we need to assemble them to packets */
@@ -266,15 +270,25 @@ static int decode_header(mpeg_header * h, uint8_t * ptr)
   return 1;
   }
 
+int bg_lame_frame_bytes(const uint8_t * ptr)
+  {
+  mpeg_header h;
+  if(!decode_header(&h, (uint8_t*)ptr))
+    return 0;
+  return h.frame_bytes;
+  }
+
 
 /* Actual codec starts here */
 
 struct bg_lame_s
   {
-  gavl_packet_t gp;
-  
+  /* Output buffer: Complete frames are passed as packets from
+     where they are. The data are moved to the start only if
+     the space at the end gets too small */
   uint8_t * buffer;
   int buffer_alloc;
+  int buffer_start;
   int buffer_size;
 
   enum vbr_mode_e vbr_mode;
@@ -286,8 +300,12 @@ struct bg_lame_s
   int abr_bitrate;
   int cbr_bitrate;
   int vbr_quality;
+  int stereo_mode;
+  int quality;
+  int threads;
 
   lame_t lame;
+  bg_lame_mt_t * mt;
   gavl_audio_format_t format;
   
   gavl_audio_sink_t * sink;
@@ -391,6 +409,9 @@ bg_lame_t * bg_lame_create()
   bg_lame_t * ret;
   ret = calloc(1, sizeof(*ret));
   ret->vbr_mode = vbr_off;
+  ret->stereo_mode = NOT_SET;
+  ret->quality = -1;
+  ret->threads = 1;
   ret->lame = lame_init();
   ret->in_pts = GAVL_TIME_UNDEFINED;
   ret->out_pts = GAVL_TIME_UNDEFINED;
@@ -430,8 +451,6 @@ void bg_lame_set_parameter(bg_lame_t * lame,
       {
       lame->vbr_mode = vbr_off;
       }
-    if(lame_set_VBR(lame->lame, lame->vbr_mode))
-      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR failed");
     }
   else if(!strcmp(name, "stereo_mode"))
     {
@@ -446,16 +465,15 @@ void bg_lame_set_parameter(bg_lame_t * lame,
       {
       i = JOINT_STEREO;
       }
-    if(i != NOT_SET)
-      {
-      if(lame_set_mode(lame->lame, JOINT_STEREO))
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_mode failed");
-      }
+    lame->stereo_mode = i;
     }
   else if(!strcmp(name, "quality"))
     {
-    if(lame_set_quality(lame->lame, v->v.i))
-      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_quality failed");
+    lame->quality = v->v.i;
+    }
+  else if(!strcmp(name, "threads"))
+    {
+    lame->threads = v->v.i;
     }
   
   else if(!strcmp(name, "cbr_bitrate"))
@@ -481,9 +499,33 @@ void bg_lame_set_parameter(bg_lame_t * lame,
     }
   }
 
+static gavl_sink_status_t put_frame(void * priv, const uint8_t * data, int len)
+  {
+  gavl_packet_t gp;
+  bg_lame_t * lame = priv;
+  
+  gavl_packet_init(&gp);
+  gp.buf.buf = (uint8_t*)data;
+  gp.buf.len = len;
+
+  /* PTS */
+
+  gp.pts = lame->out_pts;
+  gp.duration = lame->format.samples_per_frame;
+
+  if(gp.pts + gp.duration > lame->in_pts)
+    gp.duration = lame->in_pts - gp.pts;
+      
+  lame->out_pts += gp.duration;
+
+  /* Output packet */
+  return gavl_packet_sink_put_packet(lame->psink, &gp);
+  }
+
 static int flush_packets(bg_lame_t * lame, int flush_all)
   {
   mpeg_header h;
+  uint8_t * ptr;
   int ret = 0;
   memset(&h, 0, sizeof(h));
   
@@ -492,8 +534,10 @@ static int flush_packets(bg_lame_t * lame, int flush_all)
     if(lame->buffer_size < 4)
       break;
 
+    ptr = lame->buffer + lame->buffer_start;
+    
     /* Got no header -> Things are screwed up */
-    if(!decode_header(&h, lame->buffer))
+    if(!decode_header(&h, ptr))
       return -1;
 
     /* Output the last (possibly incomplete) packet */
@@ -505,34 +549,18 @@ static int flush_packets(bg_lame_t * lame, int flush_all)
     
     if(lame->buffer_size >= h.frame_bytes)
       {
-      /* Output packet */
-      gavl_packet_alloc(&lame->gp, h.frame_bytes);
-      memcpy(lame->gp.buf.buf, lame->buffer, h.frame_bytes);
-      lame->gp.buf.len = h.frame_bytes;
-
-      /* PTS */
-
-      lame->gp.pts = lame->out_pts;
-      lame->gp.duration = lame->format.samples_per_frame;
-
-      if(lame->gp.pts + lame->gp.duration > lame->in_pts)
-        lame->gp.duration = lame->in_pts - lame->gp.pts;
-      
-      lame->out_pts += lame->gp.duration;
-
-      /* Output packet */
-      
-      if(gavl_packet_sink_put_packet(lame->psink, &lame->gp) != GAVL_SINK_OK)
+      if(put_frame(lame, ptr, h.frame_bytes) != GAVL_SINK_OK)
         return -1;
 
       /* Remove packet from buffer */
       
       lame->buffer_size -= h.frame_bytes;
-      
+
       if(lame->buffer_size > 0)
-        memmove(lame->buffer,
-                lame->buffer + h.frame_bytes,
-                lame->buffer_size);
+        lame->buffer_start += h.frame_bytes;
+      else
+        lame->buffer_start = 0;
+      
       ret++;
       }
     else
@@ -541,6 +569,30 @@ static int flush_packets(bg_lame_t * lame, int flush_all)
   return ret;
   }
   
+/* Make sure, that bytes can be appended to the buffer */
+
+static void make_space(bg_lame_t * lame, int bytes)
+  {
+  if(lame->buffer_start + lame->buffer_size + bytes <= lame->buffer_alloc)
+    return;
+
+  /* Move the incomplete frame to the start */
+  if(lame->buffer_size > 0)
+    memmove(lame->buffer, lame->buffer + lame->buffer_start,
+            lame->buffer_size);
+  lame->buffer_start = 0;
+  }
+
+static uint8_t * get_write_ptr(bg_lame_t * lame)
+  {
+  return lame->buffer + lame->buffer_start + lame->buffer_size;
+  }
+
+static int get_write_space(bg_lame_t * lame)
+  {
+  return lame->buffer_alloc - lame->buffer_start - lame->buffer_size;
+  }
+
 static gavl_sink_status_t
 write_audio_func(void * data, gavl_audio_frame_t * frame)
   {
@@ -552,15 +604,55 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     lame->in_pts = frame->timestamp;
     lame->out_pts = lame->in_pts - lame->delay;
     }
+
+  /* Worst case from the lame documentation */
+  make_space(lame, (5 * frame->valid_samples) / 4 + 7200);
   
-  bytes_encoded = lame_encode_buffer_float(lame->lame,
-                                           frame->channels.f[0],
-                                           (lame->format.num_channels > 1) ?
-                                           frame->channels.f[1] :
-                                           frame->channels.f[0],
+  /* Integer samples are passed without conversion */
+  switch(lame->format.sample_format)
+    {
+    case GAVL_SAMPLE_S16:
+      if(lame->format.num_channels > 1)
+        bytes_encoded = lame_encode_buffer_interleaved(lame->lame,
+                                                       frame->samples.s_16,
+                                                       frame->valid_samples,
+                                                       get_write_ptr(lame),
+                                                       get_write_space(lame));
+      else
+        bytes_encoded = lame_encode_buffer(lame->lame,
+                                           frame->samples.s_16,
+                                           frame->samples.s_16,
                                            frame->valid_samples,
-                                           lame->buffer + lame->buffer_size,
-                                           lame->buffer_alloc - lame->buffer_size);
+                                           get_write_ptr(lame),
+                                           get_write_space(lame));
+      break;
+    case GAVL_SAMPLE_S32:
+      bytes_encoded = lame_encode_buffer_int(lame->lame,
+                                             frame->channels.s_32[0],
+                                             (lame->format.num_channels > 1) ?
+                                             frame->channels.s_32[1] :
+                                             frame->channels.s_32[0],
+                                             frame->valid_samples,
+                                             get_write_ptr(lame),
+                                             get_write_space(lame));
+      break;
+    default:
+      bytes_encoded = lame_encode_buffer_float(lame->lame,
+                                               frame->channels.f[0],
+                                               (lame->format.num_channels > 1) ?
+                                               frame->channels.f[1] :
+                                               frame->channels.f[0],
+                                               frame->valid_samples,
+                                               get_write_ptr(lame),
+                                               get_write_space(lame));
+      break;
+    }
+
+  if(bytes_encoded < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "lame_encode_buffer failed: %d", bytes_encoded);
+    return GAVL_SINK_ERROR;
+    }
 
   lame->buffer_size += bytes_encoded;
 
@@ -572,6 +664,103 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     return GAVL_SINK_OK;
   }
 
+static gavl_sink_status_t
+write_audio_func_mt(void * data, gavl_audio_frame_t * frame)
+  {
+  bg_lame_t * lame = data;
+
+  if(lame->in_pts == GAVL_TIME_UNDEFINED)
+    {
+    lame->in_pts = frame->timestamp;
+    lame->out_pts = lame->in_pts - lame->delay;
+    }
+  lame->in_pts += frame->valid_samples;
+  
+  return bg_lame_mt_write(lame->mt, frame->channels.f, frame->valid_samples);
+  }
+
+/* Apply the configuration to an encoder instance */
+
+static int init_encoder(bg_lame_t * lame, lame_t l)
+  {
+  if(lame_set_VBR(l, lame->vbr_mode))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR failed");
+
+  if((lame->format.num_channels > 1) && (lame->stereo_mode != NOT_SET) &&
+     lame_set_mode(l, lame->stereo_mode))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_mode failed");
+
+  if((lame->quality >= 0) && lame_set_quality(l, lame->quality))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_quality failed");
+  
+  if(lame_set_in_samplerate(l, lame->format.samplerate))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_in_samplerate failed");
+  if(lame_set_num_channels(l,  lame->format.num_channels))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_num_channels failed");
+
+  /* Float samples are expected in the range of 16 bit integers */
+  if((lame->format.sample_format == GAVL_SAMPLE_FLOAT) &&
+     lame_set_scale(l, 32767.0))
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_scale failed");
+  
+  switch(lame->vbr_mode)
+    {
+    case vbr_abr:
+      /* Average bitrate */
+      if(lame_set_VBR_q(l, lame->vbr_quality))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR_q failed");
+
+      if(lame_set_VBR_mean_bitrate_kbps(l, lame->abr_bitrate))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+               "lame_set_VBR_mean_bitrate_kbps failed");
+        
+      if(lame->abr_min_bitrate &&
+         lame_set_VBR_min_bitrate_kbps(l, lame->abr_min_bitrate))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+                 "lame_set_VBR_min_bitrate_kbps failed");
+      if(lame->abr_max_bitrate &&
+         lame_set_VBR_max_bitrate_kbps(l, lame->abr_max_bitrate))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+                 "lame_set_VBR_max_bitrate_kbps failed");
+      break;
+    case vbr_default:
+      if(lame_set_VBR_q(l, lame->vbr_quality))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR_q failed");
+      break;
+    case vbr_off:
+      if(lame_set_brate(l, lame->cbr_bitrate))
+        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_brate failed");
+      break;
+    default:
+      break;
+    }
+  
+  /* Write no xing header */
+  lame_set_bWriteVbrTag(l, 0);
+  
+  if(lame_init_params(l) < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_init_params failed");
+    return 0;
+    }
+  return 1;
+  }
+
+/* Encoder instance for one segment */
+
+static lame_t create_encoder(void * priv)
+  {
+  bg_lame_t * lame = priv;
+  lame_t ret = lame_init();
+
+  if(!init_encoder(lame, ret))
+    {
+    lame_close(ret);
+    return NULL;
+    }
+  return ret;
+  }
+
 gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
                                  gavl_dictionary_t * s)
   {
@@ -588,8 +777,6 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   
   /* Copy and adjust format */
   
-  fmt->sample_format = GAVL_SAMPLE_FLOAT;
-  fmt->interleave_mode = GAVL_INTERLEAVE_NONE;
   fmt->samplerate = gavl_nearest_samplerate(fmt->samplerate,
                                             samplerates);
   
@@ -599,28 +786,32 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
     fmt->channel_locations[0] = GAVL_CHID_NONE;
     gavl_set_channel_setup(fmt);
     }
-  
-  if(lame_set_in_samplerate(lame->lame, fmt->samplerate))
-    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_in_samplerate failed");
-  if(lame_set_num_channels(lame->lame,  fmt->num_channels))
-    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_num_channels failed");
 
-  if(lame_set_scale(lame->lame, 32767.0))
-    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_scale failed");
+  if(!lame->threads)
+    lame->threads = sysconf(_SC_NPROCESSORS_ONLN);
+  
+  /* lame takes 16 and 32 bit integers directly. The segment
+     parallel encoder works on floats */
+  
+  if((fmt->sample_format == GAVL_SAMPLE_S16) && (lame->threads < 2))
+    {
+    fmt->interleave_mode = GAVL_INTERLEAVE_ALL;
+    }
+  else if((fmt->sample_format == GAVL_SAMPLE_S32) && (lame->threads < 2))
+    {
+    fmt->interleave_mode = GAVL_INTERLEAVE_NONE;
+    }
+  else
+    {
+    fmt->sample_format = GAVL_SAMPLE_FLOAT;
+    fmt->interleave_mode = GAVL_INTERLEAVE_NONE;
+    }
   
   /* Finalize configuration and do some sanity checks */
 
   switch(lame->vbr_mode)
     {
     case vbr_abr:
-      /* Average bitrate */
-      if(lame_set_VBR_q(lame->lame, lame->vbr_quality))
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR_q failed");
-
-      if(lame_set_VBR_mean_bitrate_kbps(lame->lame, lame->abr_bitrate))
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-               "lame_set_VBR_mean_bitrate_kbps failed");
-        
       if(lame->abr_min_bitrate)
         {
         lame->abr_min_bitrate =
@@ -629,9 +820,6 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
           {
           lame->abr_min_bitrate = get_bitrate(8, fmt->samplerate);
           }
-        if(lame_set_VBR_min_bitrate_kbps(lame->lame, lame->abr_min_bitrate))
-          gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-                 "lame_set_VBR_min_bitrate_kbps failed");
         }
       if(lame->abr_max_bitrate)
         {
@@ -641,39 +829,36 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
           {
           lame->abr_max_bitrate = get_bitrate(320, fmt->samplerate);
           }
-        if(lame_set_VBR_max_bitrate_kbps(lame->lame, lame->abr_max_bitrate))
-          gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
-                 "lame_set_VBR_max_bitrate_kbps failed");
         }
       break;
-    case vbr_default:
-      if(lame_set_VBR_q(lame->lame, lame->vbr_quality))
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_VBR_q failed");
-      break;
     case vbr_off:
       lame->cbr_bitrate =
         get_bitrate(lame->cbr_bitrate, fmt->samplerate);
-      if(lame_set_brate(lame->lame, lame->cbr_bitrate))
-        gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_set_brate failed");
       break;
     default:
       break;
     }
-  
-  /* Write no xing header */
-  lame_set_bWriteVbrTag(lame->lame, 0);
-  
-  if(lame_init_params(lame->lame) < 0)
-    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,  "lame_init_params failed");
+
+  gavl_audio_format_copy(&lame->format, fmt);
+  init_encoder(lame, lame->lame);
   
   fmt->samples_per_frame = lame_get_framesize(lame->lame);
-  
-  gavl_audio_format_copy(&lame->format, fmt);
-  lame->sink = gavl_audio_sink_create(NULL, write_audio_func, lame, &lame->format);
+  lame->format.samples_per_frame = fmt->samples_per_frame;
+
+  /* The segments are encoded by separate instances, lame->lame
+     is only used for the configuration */
+  if((lame->threads > 1) &&
+     (lame->mt = bg_lame_mt_create(lame->threads, fmt->num_channels,
+                                   fmt->samples_per_frame,
+                                   create_encoder, put_frame, lame)))
+    lame->sink = gavl_audio_sink_create(NULL, write_audio_func_mt, lame, &lame->format);
+  else
+    lame->sink = gavl_audio_sink_create(NULL, write_audio_func, lame, &lame->format);
 
-  /* Allocate output buffer */
+  /* Allocate output buffer. It can take the output of several
+     calls before the incomplete frame must be moved to the start */
   
-  lame->buffer_alloc = (5 * fmt->samples_per_frame) / 4 + 7200 + 4096;
+  lame->buffer_alloc = 4 * ((5 * fmt->samples_per_frame) / 4 + 7200) + 4096;
   lame->buffer = malloc(lame->buffer_alloc);
   
   ci.id = GAVL_CODEC_ID_MP3;
@@ -687,8 +872,7 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
                                     GAVL_META_SOFTWARE,
                                     gavl_sprintf("lame %s", get_lame_version()));
   
-  /* Delay taken from ffmpeg */
-  lame->delay = lame_get_encoder_delay(lame->lame) + 528 + 1; 
+  lame->delay = lame_get_encoder_delay(lame->lame) + BG_MP3_DECODER_DELAY;
   ci.pre_skip = lame->delay;
   gavl_stream_set_compression_info(s, &ci);
   
@@ -703,11 +887,18 @@ void bg_lame_destroy(bg_lame_t * lame)
   
   /* Flush */
 
-  if(lame->in_pts != GAVL_TIME_UNDEFINED)
+  if(lame->mt)
+    {
+    bg_lame_mt_finish(lame->mt);
+    bg_lame_mt_destroy(lame->mt);
+    lame->mt = NULL;
+    }
+  else if(lame->in_pts != GAVL_TIME_UNDEFINED)
     {
+    make_space(lame, 7200);
     bytes_encoded = lame_encode_flush(lame->lame,
-                                      lame->buffer + lame->buffer_size, 
-                                      lame->buffer_alloc - lame->buffer_size);
+                                      get_write_ptr(lame),
+                                      get_write_space(lame));
 
     lame->buffer_size += bytes_encoded;
 
@@ -736,7 +927,5 @@ void bg_lame_destroy(bg_lame_t * lame)
     lame->sink = NULL;
     }
   
-  gavl_packet_free(&lame->gp);
-
   free(lame);
   }
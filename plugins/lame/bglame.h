@@ -136,5 +136,17 @@ If your selection is no valid mp3 bitrate, we'll choose the closest value.")
 If your selection is no valid mp3 bitrate, we'll choose the closest value.")
     },
 #endif // LAME_FILE
+#ifdef USE_THREADS
+    {
+      .name =        "threads",
+      .long_name =   TRS("Threads"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(64),
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Encode segments of the file in parallel. 0 means one thread per CPU. \
+This delays the output by several seconds, so it's meant for files, not for live streams.")
+    },
+#endif // USE_THREADS
     { /* End of parameters */ }
   };
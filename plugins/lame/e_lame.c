@@ -30,6 +30,7 @@
 #include <gmerlin/translation.h>
 
 #define USE_VBR
+#define USE_THREADS
 #include "bglame.h"
 
 #include <gmerlin/utils.h>
@@ -51,6 +52,8 @@ typedef struct
   int do_id3v1;
   int do_id3v2;
   int id3v2_charset;
+  int id3v2_padding;         /* Bytes */
+  int id3v2_padding_percent; /* Of the tag size */
   int add_cover;
   
   bgen_id3v1_t * id3v1;
@@ -138,6 +141,24 @@ static const bg_parameter_info_t parameters[] =
       .type =        BG_PARAMETER_CHECKBUTTON,
       .val_default = GAVL_VALUE_INIT_INT(0),
     },
+    {
+      .name =        "id3v2_padding",
+      .long_name =   TRS("ID3V2 padding (bytes)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min = GAVL_VALUE_INIT_INT(0),
+      .val_max = GAVL_VALUE_INIT_INT(1048576),
+      .val_default = GAVL_VALUE_INIT_INT(4096),
+      .help_string = TRS("Reserve space after the ID3V2 tag. Taggers can use it to update the metadata without rewriting the whole file.")
+    },
+    {
+      .name =        "id3v2_padding_percent",
+      .long_name =   TRS("Relative ID3V2 padding (%)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min = GAVL_VALUE_INIT_INT(0),
+      .val_max = GAVL_VALUE_INIT_INT(1000),
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Additional padding in percent of the size of the ID3V2 tag. Useful if the cover or the comments are expected to grow.")
+    },
     { /* End of parameters */ }
   };
 
@@ -162,13 +183,16 @@ static void set_parameter_lame(void * data, const char * name,
     lame->add_cover = v->v.i;
   else if(!strcmp(name, "id3v2_charset"))
     lame->id3v2_charset = atoi(v->v.str);
+  else if(!strcmp(name, "id3v2_padding"))
+    lame->id3v2_padding = v->v.i;
+  else if(!strcmp(name, "id3v2_padding_percent"))
+    lame->id3v2_padding_percent = v->v.i;
   }
 
 static int open_io_lame(void * data, gavl_io_t * io,
                         const gavl_dictionary_t * metadata)
   {
   lame_priv_t * lame;
-  bg_id3v2_t * id3v2;
   lame = data;
   lame->output = io;
   
@@ -191,11 +215,13 @@ static int open_io_lame(void * data, gavl_io_t * io,
   if(lame->do_id3v1 && metadata)
     lame->id3v1 = bgen_id3v1_create(metadata);
 
-  if(lame->do_id3v2 && metadata)
+  if(lame->do_id3v2 && metadata &&
+     !bgen_id3v2_write(lame->output, metadata, lame->add_cover,
+                       lame->id3v2_charset, lame->id3v2_padding,
+                       lame->id3v2_padding_percent))
     {
-    id3v2 = bg_id3v2_create(metadata, lame->add_cover);
-    bg_id3v2_write(lame->output, id3v2, lame->id3v2_charset);
-    bg_id3v2_destroy(id3v2);
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Writing ID3V2 tag failed");
+    return 0;
     }
   return 1;
   }
@@ -259,10 +285,13 @@ write_audio_packet_func_lame(void * data, gavl_packet_t * p)
   
   lame = data;
 
-  if((lame->ci.bitrate == GAVL_BITRATE_VBR) &&
-     !lame->xing)
+  /* The tag is finalized at the end, so we need to seek back */
+  if(!lame->xing && gavl_io_can_seek(lame->output))
     {
-    lame->xing = bg_xing_create(p->buf.buf, p->buf.len);
+    char encoder[16];
+    snprintf(encoder, sizeof(encoder), "LAME%s", get_lame_short_version());
+    
+    lame->xing = bg_xing_create(p->buf.buf, p->buf.len, encoder, &lame->ci);
     lame->xing_pos = gavl_io_position(lame->output);
     
     if(!bg_xing_write(lame->xing, lame->output))
@@ -270,7 +299,7 @@ write_audio_packet_func_lame(void * data, gavl_packet_t * p)
     }
 
   if(lame->xing)
-    bg_xing_update(lame->xing, p->buf.len);
+    bg_xing_update(lame->xing, p);
   
   if(gavl_io_write_data(lame->output, p->buf.buf, p->buf.len) < p->buf.len)
     return GAVL_SINK_ERROR;
@@ -329,12 +358,12 @@ static int start_lame(void * data)
     {
     lame->asink = bg_lame_open(lame->codec, &lame->s);
 
+    /* Bitrate and delay for the tag */
+    gavl_stream_get_compression_info(&lame->s, &lame->ci);
+    
     if((lame->ci.bitrate == GAVL_BITRATE_VBR) && (!gavl_io_can_seek(lame->output)))
-      {
-      gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN, "Won't write VBR mp3 to streaming output");
-      return 0;
-      }
-
+      gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN, "Writing VBR mp3 without Xing tag to streaming output");
+    
     bg_lame_set_packet_sink(lame->codec, lame->psink);
     }
   
@@ -356,6 +385,8 @@ static int close_lame(void * data, int do_delete)
     gavl_io_seek(lame->output, lame->xing_pos, SEEK_SET);
     bg_xing_write(lame->xing, lame->output);
     gavl_io_seek(lame->output, pos, SEEK_SET);
+    bg_xing_destroy(lame->xing);
+    lame->xing = NULL;
     }
   
   /* Write ID3V1 tag */
@@ -0,0 +1,701 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Segment parallel mp3 encoding: The input is split into segments of
+   SEGMENT_FRAMES frames. Each segment is encoded by a fresh lame
+   instance in a worker thread. The encoding starts PREROLL_FRAMES
+   before and ends POSTROLL_FRAMES after the segment.
+
+   Since all encoders start at a frame boundary, frame n of every
+   encoder covers the same samples as frame n of a single encoder.
+   Two neighbouring segments are spliced at a frame in the overlap,
+   where the bit reservoir left by the earlier encoder is at least as
+   large as the reservoir used by the later one (main_data_begin).
+   The reservoir bytes of the later encoder are then copied into the
+   unused space at the end of the earlier one, so all frames are
+   passed as they came from lame.
+
+   If no frame in the overlap has a large enough reservoir, both
+   segments are encoded again by one lame instance, which starts where
+   the earlier segment started (serial fallback). Its frames are
+   identical to the ones of the earlier segment up to the splice point
+   with its predecessor. The instance isn't flushed, so it can continue
+   with the next segment if the following splice fails as well. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <config.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "lamemt"
+
+#include <lame/lame.h>
+#include <gmerlin/plugin.h>
+#include <gmerlin_encoders.h>
+#include "lamemt.h"
+
+#define SEGMENT_FRAMES  512
+#define PREROLL_FRAMES   16
+#define POSTROLL_FRAMES  16
+
+/* Frames of the later encoder, which are never used */
+#define WARMUP_FRAMES     8
+
+/* Frames of the earlier encoder, which depend on the flushed
+   (i.e. zero) samples after the input */
+#define TAIL_FRAMES       4
+
+/* Samples passed to lame at once */
+#define CHUNK_SAMPLES  (16*1152)
+
+/* Tests can force the serial fallback for the nth splice */
+#ifndef FORCE_SERIAL
+#define FORCE_SERIAL(n) 0
+#endif
+
+typedef struct
+  {
+  int offset;
+  int bytes;
+  } frame_t;
+
+typedef struct
+  {
+  float * samples[2];
+  int num_samples;
+  int target;          /* Submit when num_samples reaches this */
+  int last;            /* Emit all frames */
+
+  int64_t first_frame; /* Index of the first frame in the stream */
+  lame_t enc;          /* Kept open after the serial fallback */
+
+  gavl_buffer_t out;
+  frame_t * frames;
+  int num_frames;
+  int frames_alloc;
+  int64_t frame_offset; /* Index of frames[0] in the stream */
+
+  int emit_start;      /* First frame passed downstream */
+  } job_t;
+
+struct bg_lame_mt_s
+  {
+  int num_channels;
+  int framesize;
+
+  lame_t (*create_encoder)(void * priv);
+  gavl_sink_status_t (*put_frame)(void * priv, const uint8_t * data, int len);
+  void * priv;
+
+  /* The oldest job is emitted after its successor is done */
+  bgen_job_queue_t * q;
+  job_t * jobs;
+  int num_jobs;
+
+  /* Job currently filled by the application */
+  job_t * fill;
+
+  /* Last submitted job, the overlap is copied from there */
+  job_t * prev;
+
+  int64_t segment;
+  int64_t num_splices;
+  };
+
+/* Layer III frame layout */
+
+static int is_mpeg1(const uint8_t * ptr)
+  {
+  return !!(ptr[1] & 0x08);
+  }
+
+static int side_info_offset(const uint8_t * ptr)
+  {
+  /* Protection bit cleared means CRC present */
+  return (ptr[1] & 0x01) ? 4 : 6;
+  }
+
+static int data_offset(const uint8_t * ptr)
+  {
+  int mono = ((ptr[3] >> 6) == 3);
+
+  if(is_mpeg1(ptr))
+    return side_info_offset(ptr) + (mono ? 17 : 32);
+  else
+    return side_info_offset(ptr) + (mono ? 9 : 17);
+  }
+
+static int main_data_begin(const uint8_t * ptr)
+  {
+  const uint8_t * si = ptr + side_info_offset(ptr);
+
+  if(is_mpeg1(ptr))
+    return (si[0] << 1) | (si[1] >> 7);
+  else
+    return si[0];
+  }
+
+static uint8_t * frame_ptr(job_t * job, int64_t idx)
+  {
+  return job->out.buf + job->frames[idx].offset;
+  }
+
+/* Encoding (worker thread) */
+
+static int split_frames(job_t * job)
+  {
+  int pos = 0;
+  int bytes;
+
+  job->num_frames = 0;
+
+  while(job->out.len - pos >= 4)
+    {
+    if(!(bytes = bg_lame_frame_bytes(job->out.buf + pos)))
+      {
+      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Got invalid frame from lame");
+      return 0;
+      }
+
+    if(bytes > job->out.len - pos)
+      bytes = job->out.len - pos;
+
+    if(job->num_frames == job->frames_alloc)
+      {
+      job->frames_alloc += SEGMENT_FRAMES;
+      job->frames = realloc(job->frames, job->frames_alloc * sizeof(*job->frames));
+      }
+
+    job->frames[job->num_frames].offset = pos;
+    job->frames[job->num_frames].bytes = bytes;
+    job->num_frames++;
+    pos += bytes;
+    }
+  return 1;
+  }
+
+/* Append the frames for num samples to job->out */
+
+static int encode_samples(bg_lame_mt_t * mt, job_t * job,
+                          float * const samples[], int num)
+  {
+  int pos = 0;
+  int n;
+  int bytes;
+  float * r = samples[(mt->num_channels > 1) ? 1 : 0];
+
+  while(pos < num)
+    {
+    n = num - pos;
+    if(n > CHUNK_SAMPLES)
+      n = CHUNK_SAMPLES;
+
+    /* Worst case from the lame documentation */
+    gavl_buffer_alloc(&job->out, job->out.len + (5 * n) / 4 + 7200);
+
+    bytes = lame_encode_buffer_float(job->enc,
+                                     samples[0] + pos, r + pos, n,
+                                     job->out.buf + job->out.len,
+                                     job->out.alloc - job->out.len);
+    if(bytes < 0)
+      return 0;
+
+    job->out.len += bytes;
+    pos += n;
+    }
+  return 1;
+  }
+
+static int encode_flush(job_t * job)
+  {
+  int bytes;
+  
+  gavl_buffer_alloc(&job->out, job->out.len + 7200);
+  bytes = lame_encode_flush(job->enc, job->out.buf + job->out.len,
+                            job->out.alloc - job->out.len);
+  if(bytes < 0)
+    return 0;
+  job->out.len += bytes;
+  return 1;
+  }
+
+static int encode_job(bg_lame_mt_t * mt, job_t * job)
+  {
+  job->out.len = 0;
+  job->frame_offset = job->first_frame;
+  
+  return encode_samples(mt, job, job->samples, job->num_samples) &&
+    encode_flush(job) && split_frames(job);
+  }
+
+static int process_job(void * priv, int idx, int thread)
+  {
+  int result;
+  bg_lame_mt_t * mt = priv;
+  job_t * job = &mt->jobs[idx];
+
+  /* create_encoder() failed */
+  if(!job->enc)
+    return 0;
+  
+  result = encode_job(mt, job);
+  lame_close(job->enc);
+  job->enc = NULL;
+  return result;
+  }
+
+/* Splicing (application thread) */
+
+/* Main data space of the frames from first to end (excluding) */
+
+static int main_data_space(job_t * job, int first, int end)
+  {
+  int i;
+  int ret = 0;
+
+  for(i = first; i < end; i++)
+    ret += job->frames[i].bytes - data_offset(frame_ptr(job, i));
+  return ret;
+  }
+
+/* Copy the last num bytes of the main data before frame src_end into
+   the space before frame dst_end. Nothing is copied if either side
+   has not enough space */
+
+static int copy_reservoir(job_t * dst, int dst_end,
+                          job_t * src, int src_end, int num)
+  {
+  int n;
+  int d = dst_end;
+  int s = src_end;
+  uint8_t * dpos = NULL;
+  uint8_t * spos = NULL;
+  uint8_t * dstart = NULL;
+  uint8_t * sstart = NULL;
+
+  /* Frames before emit_start are not passed downstream */
+  if((main_data_space(dst, dst->emit_start, dst_end) < num) ||
+     (main_data_space(src, 0, src_end) < num))
+    return 0;
+  
+  while(num > 0)
+    {
+    while(dpos == dstart)
+      {
+      d--;
+      dstart = frame_ptr(dst, d) + data_offset(frame_ptr(dst, d));
+      dpos = frame_ptr(dst, d) + dst->frames[d].bytes;
+      }
+    while(spos == sstart)
+      {
+      s--;
+      sstart = frame_ptr(src, s) + data_offset(frame_ptr(src, s));
+      spos = frame_ptr(src, s) + src->frames[s].bytes;
+      }
+
+    n = num;
+    if(n > dpos - dstart)
+      n = dpos - dstart;
+    if(n > spos - sstart)
+      n = spos - sstart;
+
+    dpos -= n;
+    spos -= n;
+    memcpy(dpos, spos, n);
+    num -= n;
+    }
+  return 1;
+  }
+
+/* Find the frame, where next takes over from prev and prepare the
+   bit reservoir. Returns the frame index in the stream or -1 if there
+   is no frame in the overlap, where the reservoir of prev is large
+   enough. Splicing anywhere else would produce a corrupt frame. */
+
+static int64_t splice(bg_lame_mt_t * mt, job_t * prev, job_t * next)
+  {
+  int64_t i;
+  int64_t start, end;
+  int m_next;
+
+  start = next->frame_offset + WARMUP_FRAMES;
+  if(start < prev->frame_offset + prev->emit_start + 1)
+    start = prev->frame_offset + prev->emit_start + 1;
+
+  end = prev->first_frame + prev->num_samples / mt->framesize - TAIL_FRAMES;
+  if(end > prev->frame_offset + prev->num_frames)
+    end = prev->frame_offset + prev->num_frames;
+  if(end > next->frame_offset + next->num_frames)
+    end = next->frame_offset + next->num_frames;
+
+  for(i = start; i < end; i++)
+    {
+    m_next = main_data_begin(frame_ptr(next, i - next->frame_offset));
+
+    if(main_data_begin(frame_ptr(prev, i - prev->frame_offset)) < m_next)
+      continue;
+    
+    if(!copy_reservoir(prev, i - prev->frame_offset,
+                       next, i - next->frame_offset, m_next))
+      continue;
+    return i;
+    }
+
+  if(start >= end)
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Segments don't overlap, encoding them serially");
+  else
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+             "Bit reservoir too small in frames %"PRId64"..%"PRId64
+             ", encoding the segments serially", start, end - 1);
+  return -1;
+  }
+
+/* Serial fallback: Encode the samples of next, which are not in prev
+   with the encoder of prev. If prev has no open encoder, a new one
+   encodes the samples of prev first. The frames replace the ones of
+   next and are emitted from the splice point of prev */
+
+static int encode_serial(bg_lame_mt_t * mt, job_t * prev, job_t * next)
+  {
+  int i;
+  int offset;
+  float * samples[2] = { NULL, NULL };
+
+  next->out.len = 0;
+  
+  if(prev->enc)
+    {
+    next->enc = prev->enc;
+    prev->enc = NULL;
+    gavl_buffer_append_data(&next->out, prev->out.buf, prev->out.len);
+    }
+  else
+    {
+    if(!(next->enc = mt->create_encoder(mt->priv)))
+      return 0;
+    if(!encode_samples(mt, next, prev->samples, prev->num_samples))
+      return 0;
+    }
+
+  /* Samples after the end of prev */
+  offset = prev->num_samples -
+    (next->first_frame - prev->first_frame) * mt->framesize;
+
+  for(i = 0; i < mt->num_channels; i++)
+    samples[i] = next->samples[i] + offset;
+  
+  if(!encode_samples(mt, next, samples, next->num_samples - offset))
+    return 0;
+
+  if(next->last)
+    {
+    if(!encode_flush(next))
+      return 0;
+    lame_close(next->enc);
+    next->enc = NULL;
+    }
+  
+  if(!split_frames(next))
+    return 0;
+  
+  next->frame_offset = prev->frame_offset;
+
+  /* Sanity check: Everything up to the splice point was emitted already */
+  if((next->num_frames <= prev->emit_start) ||
+     memcmp(next->out.buf, prev->out.buf, prev->frames[prev->emit_start].offset))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Serial encoding doesn't reproduce the previous segment");
+    return 0;
+    }
+  return 1;
+  }
+
+static gavl_sink_status_t emit_frames(bg_lame_mt_t * mt, job_t * job, int end)
+  {
+  int i;
+  gavl_sink_status_t st;
+
+  for(i = job->emit_start; i < end; i++)
+    {
+    if((st = mt->put_frame(mt->priv, frame_ptr(job, i),
+                           job->frames[i].bytes)) != GAVL_SINK_OK)
+      return st;
+    }
+  return GAVL_SINK_OK;
+  }
+
+/* Emit finished jobs in order. If wait is nonzero, wait
+   until the oldest job can be emitted */
+
+static gavl_sink_status_t drain(bg_lame_mt_t * mt, int wait)
+  {
+  int result;
+  job_t * job;
+  job_t * next;
+  int64_t frame;
+  gavl_sink_status_t st;
+
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    next = NULL;
+
+    job = &mt->jobs[bgen_job_queue_get_job(mt->q, 0)];
+
+    if(!job->last)
+      {
+      /* Not submitted yet */
+      if(bgen_job_queue_num_used(mt->q) < 2)
+        break;
+      next = &mt->jobs[bgen_job_queue_get_job(mt->q, 1)];
+      }
+
+    if(!(result = bgen_job_queue_wait(mt->q, 0, wait)))
+      break;
+    if(result < 0)
+      return GAVL_SINK_ERROR;
+
+    if(next)
+      {
+      if(!(result = bgen_job_queue_wait(mt->q, 1, wait)))
+        break;
+      if(result < 0)
+        return GAVL_SINK_ERROR;
+
+      mt->num_splices++;
+      
+      if(FORCE_SERIAL(mt->num_splices) ||
+         ((frame = splice(mt, job, next)) < 0))
+        {
+        if(!encode_serial(mt, job, next))
+          return GAVL_SINK_ERROR;
+        /* Nothing of job is emitted */
+        frame = job->frame_offset + job->emit_start;
+        }
+      
+      st = emit_frames(mt, job, frame - job->frame_offset);
+      next->emit_start = frame - next->frame_offset;
+      }
+    else
+      st = emit_frames(mt, job, job->num_frames);
+
+    /* Open encoder of a serial fallback, which isn't continued */
+    if(job->enc)
+      {
+      lame_close(job->enc);
+      job->enc = NULL;
+      }
+    
+    bgen_job_queue_release(mt->q);
+
+    if(st != GAVL_SINK_OK)
+      return st;
+
+    /* Only wait for one job */
+    wait = 0;
+    }
+
+  return GAVL_SINK_OK;
+  }
+
+/* Input */
+
+static job_t * get_fill(bg_lame_mt_t * mt)
+  {
+  int i;
+  int offset;
+  job_t * job;
+
+  if(mt->fill)
+    return mt->fill;
+
+  /* Wait until the oldest job is emitted */
+  if((bgen_job_queue_get_free(mt->q) < 0) && (drain(mt, 1) != GAVL_SINK_OK))
+    return NULL;
+
+  job = &mt->jobs[bgen_job_queue_get_free(mt->q)];
+
+  job->num_samples = 0;
+  job->last = 0;
+  job->emit_start = 0;
+  job->num_frames = 0;
+
+  if(mt->segment)
+    job->first_frame = mt->segment * SEGMENT_FRAMES - PREROLL_FRAMES;
+  else
+    job->first_frame = 0;
+
+  job->target = ((mt->segment + 1) * SEGMENT_FRAMES + POSTROLL_FRAMES -
+                 job->first_frame) * mt->framesize;
+
+  /* Overlap with the previous segment */
+  if(mt->prev)
+    {
+    offset = (job->first_frame - mt->prev->first_frame) * mt->framesize;
+    job->num_samples = mt->prev->num_samples - offset;
+
+    for(i = 0; i < mt->num_channels; i++)
+      memcpy(job->samples[i], mt->prev->samples[i] + offset,
+             job->num_samples * sizeof(float));
+    }
+
+  mt->fill = job;
+  return job;
+  }
+
+static void submit(bg_lame_mt_t * mt, int last)
+  {
+  job_t * job = mt->fill;
+
+  job->last = last;
+
+  /* lame_init_params() isn't called from the workers */
+  job->enc = mt->create_encoder(mt->priv);
+  bgen_job_queue_submit(mt->q);
+
+  mt->prev = job;
+  mt->fill = NULL;
+  mt->segment++;
+  }
+
+bg_lame_mt_t *
+bg_lame_mt_create(int num_threads, int num_channels, int framesize,
+                  lame_t (*create_encoder)(void * priv),
+                  gavl_sink_status_t (*put_frame)(void * priv,
+                                                  const uint8_t * data,
+                                                  int len),
+                  void * priv)
+  {
+  int i, j;
+  int job_alloc;
+  bg_lame_mt_t * mt = calloc(1, sizeof(*mt));
+
+  /* One job per worker, one waiting for its successor and
+     one filled by the application */
+  if(!(mt->q = bgen_job_queue_create(num_threads, num_threads + 2,
+                                     process_job, mt)))
+    {
+    free(mt);
+    return NULL;
+    }
+  
+  mt->num_channels   = num_channels;
+  mt->framesize      = framesize;
+  mt->create_encoder = create_encoder;
+  mt->put_frame      = put_frame;
+  mt->priv           = priv;
+
+  job_alloc = (PREROLL_FRAMES + SEGMENT_FRAMES + POSTROLL_FRAMES) * framesize;
+
+  mt->num_jobs = num_threads + 2;
+  mt->jobs = calloc(mt->num_jobs, sizeof(*mt->jobs));
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    for(j = 0; j < num_channels; j++)
+      mt->jobs[i].samples[j] = malloc(job_alloc * sizeof(float));
+    }
+
+  gavl_log(GAVL_LOG_INFO, LOG_DOMAIN,
+           "Encoding segment parallel with %d threads", num_threads);
+
+  return mt;
+  }
+
+gavl_sink_status_t bg_lame_mt_write(bg_lame_mt_t * mt,
+                                    float * const samples[], int num)
+  {
+  int i;
+  int n;
+  int pos = 0;
+  job_t * job;
+
+  while(pos < num)
+    {
+    if(!(job = get_fill(mt)))
+      return GAVL_SINK_ERROR;
+
+    n = job->target - job->num_samples;
+    if(n > num - pos)
+      n = num - pos;
+
+    for(i = 0; i < mt->num_channels; i++)
+      memcpy(job->samples[i] + job->num_samples, samples[i] + pos,
+             n * sizeof(float));
+
+    job->num_samples += n;
+    pos += n;
+
+    if(job->num_samples == job->target)
+      submit(mt, 0);
+    }
+
+  return drain(mt, 0);
+  }
+
+int bg_lame_mt_finish(bg_lame_mt_t * mt)
+  {
+  job_t * job;
+
+  /* The last segment gets at least the overlap of the previous one */
+  if(!(job = get_fill(mt)))
+    return 0;
+
+  if(job->num_samples)
+    submit(mt, 1);
+  else
+    mt->fill = NULL;
+
+  while(bgen_job_queue_num_used(mt->q))
+    {
+    if(drain(mt, 1) != GAVL_SINK_OK)
+      return 0;
+    }
+  return 1;
+  }
+
+void bg_lame_mt_destroy(bg_lame_mt_t * mt)
+  {
+  int i, j;
+
+  /* Unfinished jobs are still encoded, but not emitted */
+  bgen_job_queue_destroy(mt->q);
+
+  for(i = 0; i < mt->num_jobs; i++)
+    {
+    for(j = 0; j < mt->num_channels; j++)
+      {
+      if(mt->jobs[i].samples[j])
+        free(mt->jobs[i].samples[j]);
+      }
+    /* Submitted but never started */
+    if(mt->jobs[i].enc)
+      lame_close(mt->jobs[i].enc);
+    gavl_buffer_free(&mt->jobs[i].out);
+    if(mt->jobs[i].frames)
+      free(mt->jobs[i].frames);
+    }
+
+  if(mt->jobs)
+    free(mt->jobs);
+  free(mt);
+  }
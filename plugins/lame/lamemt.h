@@ -0,0 +1,48 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Segment parallel mp3 encoding (internal to bglame.c) */
+
+typedef struct bg_lame_mt_s bg_lame_mt_t;
+
+/* Size of the mpeg audio frame starting at ptr or 0 (bglame.c) */
+
+int bg_lame_frame_bytes(const uint8_t * ptr);
+
+/* create_encoder() is called from the application thread and must
+   return a lame instance ready for encoding. The complete frames
+   are passed to put_frame() in the order of the input */
+
+bg_lame_mt_t *
+bg_lame_mt_create(int num_threads, int num_channels, int framesize,
+                  lame_t (*create_encoder)(void * priv),
+                  gavl_sink_status_t (*put_frame)(void * priv,
+                                                  const uint8_t * data,
+                                                  int len),
+                  void * priv);
+
+gavl_sink_status_t bg_lame_mt_write(bg_lame_mt_t * mt,
+                                    float * const samples[], int num);
+
+/* Encode the remaining samples and pass all frames */
+
+int bg_lame_mt_finish(bg_lame_mt_t * mt);
+
+void bg_lame_mt_destroy(bg_lame_mt_t * mt);
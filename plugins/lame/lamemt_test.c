@@ -0,0 +1,342 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Check the segment parallel encoding (lamemt.c) with many segments.
+   The bit reservoir of the output must be consistent: The main data of
+   each frame starts after the main data of the previous frame and ends
+   before the next frame. The number of frames must be the same as for
+   a serial encoding.
+
+   The serial fallback is forced for 3 of 4 splices and for all of
+   them. In the latter case, the output must be identical to a serial
+   encoding. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <config.h>
+
+#include <gavl/gavl.h>
+
+static int force_mode;
+
+static int force_serial(int64_t n)
+  {
+  switch(force_mode)
+    {
+    case 1:
+      return !!(n % 4);
+    case 2:
+      return 1;
+    }
+  return 0;
+  }
+
+#define FORCE_SERIAL(n) force_serial(n)
+
+#include "lamemt.c"
+
+#define SAMPLERATE   44100
+#define NUM_SEGMENTS 8
+#define NUM_SAMPLES  ((NUM_SEGMENTS * SEGMENT_FRAMES + 300) * 1152)
+
+/* MPEG-1 Layer III only */
+
+static const int bitrates[16] =
+  { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+
+int bg_lame_frame_bytes(const uint8_t * ptr)
+  {
+  int br;
+  
+  if((ptr[0] != 0xff) || ((ptr[1] & 0xfe) != 0xfa) ||
+     ((ptr[2] >> 2) & 3) || !(br = bitrates[ptr[2] >> 4]))
+    return 0;
+  return 144000 * br / SAMPLERATE + ((ptr[2] >> 1) & 1);
+  }
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+  {
+  /* xorshift32 */
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+  }
+
+/* Blocks of silence, tones and noise with random levels make the
+   encoder fill and use the bit reservoir */
+
+static float * samples[2];
+
+static void make_signal(void)
+  {
+  int i, j;
+  int len;
+  int type = 0;
+  float level = 0.0;
+  float freq = 0.0;
+
+  for(i = 0; i < 2; i++)
+    samples[i] = malloc(NUM_SAMPLES * sizeof(float));
+
+  len = 0;
+  for(i = 0; i < NUM_SAMPLES; i++)
+    {
+    if(!len)
+      {
+      len = 1000 + rng() % 40000;
+      type = rng() % 4;
+      level = (float)(rng() % 1000) / 1000.0;
+      freq = 50.0 + rng() % 10000;
+      }
+    len--;
+    
+    for(j = 0; j < 2; j++)
+      {
+      switch(type)
+        {
+        case 0:
+          samples[j][i] = 0.0;
+          break;
+        case 1:
+          samples[j][i] = level * sin(2.0 * M_PI * freq * i / SAMPLERATE);
+          break;
+        default:
+          samples[j][i] = level * ((float)(rng() % 20001) / 10000.0 - 1.0);
+          break;
+        }
+      }
+    }
+  }
+
+static int vbr;
+
+static lame_t create_encoder(void * priv)
+  {
+  lame_t ret = lame_init();
+
+  lame_set_in_samplerate(ret, SAMPLERATE);
+  lame_set_num_channels(ret, 2);
+  lame_set_quality(ret, 9);
+  lame_set_bWriteVbrTag(ret, 0);
+
+  if(vbr)
+    {
+    lame_set_VBR(ret, vbr_default);
+    lame_set_VBR_q(ret, 4);
+    }
+  else
+    lame_set_brate(ret, 128);
+  
+  if(lame_init_params(ret) < 0)
+    {
+    lame_close(ret);
+    return NULL;
+    }
+  return ret;
+  }
+
+static gavl_sink_status_t put_frame(void * priv, const uint8_t * data, int len)
+  {
+  gavl_buffer_append_data(priv, data, len);
+  return GAVL_SINK_OK;
+  }
+
+static int encode_serial_ref(gavl_buffer_t * out)
+  {
+  job_t job;
+  bg_lame_mt_t mt;
+
+  memset(&job, 0, sizeof(job));
+  memset(&mt, 0, sizeof(mt));
+  mt.num_channels = 2;
+  
+  if(!(job.enc = create_encoder(NULL)) ||
+     !encode_samples(&mt, &job, samples, NUM_SAMPLES) ||
+     !encode_flush(&job))
+    return 0;
+  lame_close(job.enc);
+  
+  gavl_buffer_append_data(out, job.out.buf, job.out.len);
+  gavl_buffer_free(&job.out);
+  return 1;
+  }
+
+static int get_bits(const uint8_t * ptr, int pos, int num)
+  {
+  int ret = 0;
+  
+  while(num--)
+    {
+    ret = (ret << 1) | ((ptr[pos / 8] >> (7 - (pos % 8))) & 1);
+    pos++;
+    }
+  return ret;
+  }
+
+/* Check the bit reservoir and return the number of frames */
+
+static int check_stream(const char * name, const gavl_buffer_t * buf)
+  {
+  int i;
+  int pos = 0;
+  int bytes;
+  int bits;
+  int num_frames = 0;
+  int64_t area = 0;  /* Main data space before the frame */
+  int64_t end = 0;   /* End of the main data of the previous frame */
+  int64_t begin;
+  int offset;
+  const uint8_t * ptr;
+  const uint8_t * si;
+
+  while(pos < buf->len)
+    {
+    ptr = buf->buf + pos;
+    
+    if((buf->len - pos < 4) || !(bytes = bg_lame_frame_bytes(ptr)) ||
+       (bytes > buf->len - pos))
+      {
+      fprintf(stderr, "%s: Invalid frame %d\n", name, num_frames);
+      return -1;
+      }
+
+    offset = data_offset(ptr);
+    si = ptr + side_info_offset(ptr);
+    
+    /* Stereo: 9 bits main_data_begin, 3 private bits, 2 x 4 bits scfsi */
+    bits = 0;
+    for(i = 0; i < 4; i++)
+      bits += get_bits(si, 20 + i * 59, 12);
+
+    begin = area - main_data_begin(ptr);
+    
+    if((begin < end) || (begin + (bits + 7) / 8 > area + bytes - offset))
+      {
+      fprintf(stderr, "%s: Bit reservoir broken in frame %d\n",
+              name, num_frames);
+      return -1;
+      }
+    
+    end = begin + (bits + 7) / 8;
+    area += bytes - offset;
+    pos += bytes;
+    num_frames++;
+    }
+  return num_frames;
+  }
+
+static int run(const char * name, int mode, int threads,
+               const gavl_buffer_t * ref, int ref_frames)
+  {
+  int pos = 0;
+  int num;
+  int frames;
+  float * ptrs[2];
+  gavl_buffer_t out;
+  bg_lame_mt_t * mt;
+
+  gavl_buffer_init(&out);
+  force_mode = mode;
+  
+  if(!(mt = bg_lame_mt_create(threads, 2, 1152, create_encoder,
+                              put_frame, &out)))
+    return 0;
+
+  while(pos < NUM_SAMPLES)
+    {
+    num = 1 + rng() % 20000;
+    if(num > NUM_SAMPLES - pos)
+      num = NUM_SAMPLES - pos;
+    ptrs[0] = samples[0] + pos;
+    ptrs[1] = samples[1] + pos;
+    
+    if(bg_lame_mt_write(mt, ptrs, num) != GAVL_SINK_OK)
+      {
+      fprintf(stderr, "%s: Encoding failed\n", name);
+      return 0;
+      }
+    pos += num;
+    }
+
+  if(!bg_lame_mt_finish(mt))
+    {
+    fprintf(stderr, "%s: Finishing failed\n", name);
+    return 0;
+    }
+
+  printf("%-12s %"PRId64" splices, ", name, mt->num_splices);
+  bg_lame_mt_destroy(mt);
+
+  if((frames = check_stream(name, &out)) < 0)
+    return 0;
+  printf("%d frames\n", frames);
+
+  if(frames != ref_frames)
+    {
+    fprintf(stderr, "%s: Got %d frames, serial encoding has %d\n",
+            name, frames, ref_frames);
+    return 0;
+    }
+  
+  if((mode == 2) &&
+     ((out.len != ref->len) || memcmp(out.buf, ref->buf, out.len)))
+    {
+    fprintf(stderr, "%s: Output differs from serial encoding\n", name);
+    return 0;
+    }
+  
+  gavl_buffer_free(&out);
+  return 1;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int ret = 0;
+  int ref_frames;
+  gavl_buffer_t ref;
+  
+  rng_state = 1;
+  make_signal();
+
+  for(vbr = 0; vbr < 2; vbr++)
+    {
+    gavl_buffer_init(&ref);
+
+    if(!encode_serial_ref(&ref) || ((ref_frames = check_stream("serial", &ref)) < 0))
+      return EXIT_FAILURE;
+    
+    if(!run(vbr ? "vbr" : "cbr", 0, 4, &ref, ref_frames) ||
+       !run(vbr ? "vbr_mixed" : "cbr_mixed", 1, 3, &ref, ref_frames) ||
+       !run(vbr ? "vbr_serial" : "cbr_serial", 2, 2, &ref, ref_frames))
+      ret = EXIT_FAILURE;
+
+    gavl_buffer_free(&ref);
+    }
+
+  free(samples[0]);
+  free(samples[1]);
+  return ret;
+  }
@@ -29,6 +29,7 @@
 #include <gavl/gavl.h>
 #include <gavl/io.h>
 
+#include <gmerlin_encoders.h>
 #include <xing.h>
 
 /*
@@ -38,12 +39,22 @@
 
 #define MAXFRAMESIZE 2881
 
+/* Candidates for the 100 TOC entries. With 1024 points, the distance
+   between neighbouring points is below the 1/256 resolution of
+   the TOC */
+#define INDEX_SIZE 1024
+
+/* Xing part: Signature, flags, frames, bytes, TOC and quality */
+#define XING_BYTES (4 + 4 + 4 + 4 + 100 + 4)
+
+/* LAME extension following the Xing part */
+#define LAME_BYTES 36
+
 struct bg_xing_s
   {
-  /* Frame sizes */
+  /* Frame positions */
 
-  uint32_t * frame_positions;
-  int frame_positions_alloc;
+  bgen_seek_index_t frame_index;
   int num_frames;
   
   uint32_t total_bytes;
@@ -53,6 +64,15 @@ struct bg_xing_s
   int tag_bytes;
   int samples_per_frame;
 
+  /* Information for the LAME extension */
+  char encoder[9];
+  int bitrate; /* kbps, 0 for VBR */
+  int pre_skip;
+  int64_t duration;
+  
+  uint16_t music_crc;
+  uint16_t crc_table[256];
+  
   uint8_t buffer[MAXFRAMESIZE];
   
   };
@@ -69,6 +89,35 @@ struct bg_xing_s
 (p)[1] = ((i)>>16) & 0xff; \
 (p)[0] = ((i)>>24) & 0xff;
 
+#define INT_16BE_2_PTR(i, p)                   \
+(p)[1] = (i) & 0xff; \
+(p)[0] = ((i)>>8) & 0xff;
+
+/* CRC-16 (polynomial 0x8005, reflected) as used by the LAME tag */
+
+static void init_crc(bg_xing_t * xing)
+  {
+  int i, j;
+  uint16_t c;
+  
+  for(i = 0; i < 256; i++)
+    {
+    c = i;
+    for(j = 0; j < 8; j++)
+      c = (c & 1) ? ((c >> 1) ^ 0xa001) : (c >> 1);
+    xing->crc_table[i] = c;
+    }
+  }
+
+static uint16_t update_crc(const bg_xing_t * xing, uint16_t crc,
+                           const uint8_t * data, int len)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    crc = (crc >> 8) ^ xing->crc_table[(crc ^ data[i]) & 0xff];
+  return crc;
+  }
+
 static int
 get_xing_offset (uint32_t header)
   {
@@ -184,53 +233,144 @@ parse_header(uint32_t header, int * ret_size, int * ret_spf,
   }
 
 
-bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len)
+bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len,
+                           const char * encoder,
+                           const gavl_compression_info_t * ci)
   {
   bg_xing_t * ret;
-  int bitrate_index = 0;
+  int bitrate_index;
   int xing_offset;
   ret = calloc(1, sizeof(*ret));
 
+  bgen_seek_index_init(&ret->frame_index, INDEX_SIZE);
+  init_crc(ret);
+  
   /* Get final header */
   ret->header = PTR_2_32BE(first_frame);
 
   /* Switch off crc */
   ret->header |= 0x00010000;
 
-  /* Get bitrate */
+  /* Don't use padding, the tag size is calculated without */
+  ret->header &= ~0x00000200;
+  
+  xing_offset = get_xing_offset(ret->header);
+  
+  if(ci->bitrate != GAVL_BITRATE_VBR)
+    {
+    ret->bitrate = ci->bitrate / 1000;
+    
+    /* Keep the bitrate of CBR streams if the tag fits */
+    parse_header(ret->header, &ret->tag_bytes, &ret->samples_per_frame, NULL);
+    bitrate_index = 0;
+    }
+  else
+    bitrate_index = 1;
 
-  do{
-    bitrate_index++;
+  /* Get bitrate */
+  
+  if(bitrate_index ||
+     (ret->tag_bytes < 4 + xing_offset + XING_BYTES + LAME_BYTES))
+    {
+    bitrate_index = 0;
+    do{
+      bitrate_index++;
     
-    ret->header &= 0xffff0fff;
-    ret->header |= bitrate_index << 12;
+      ret->header &= 0xffff0fff;
+      ret->header |= bitrate_index << 12;
     
-    parse_header (ret->header, &ret->tag_bytes, &ret->samples_per_frame, NULL);
-    xing_offset = get_xing_offset(ret->header);
-  } while (ret->tag_bytes < (4 + xing_offset + 4 + 4 + 4 + 4 + 100) && bitrate_index < 0xe);
+      parse_header (ret->header, &ret->tag_bytes, &ret->samples_per_frame, NULL);
+    } while (ret->tag_bytes < (4 + xing_offset + XING_BYTES + LAME_BYTES) && bitrate_index < 0xe);
+    }
   
+  /* Short version string, not null terminated, padded with zeros */
+  memset(ret->encoder, 0, sizeof(ret->encoder));
+  memcpy(ret->encoder, encoder, strnlen(encoder, sizeof(ret->encoder)));
+  ret->pre_skip = ci->pre_skip;
   return ret;
   }
 
-void bg_xing_update(bg_xing_t * xing, int bytes)
+void bg_xing_update(bg_xing_t * xing, const gavl_packet_t * p)
   {
-  if(xing->frame_positions_alloc < xing->num_frames + 1)
-    {
-    xing->frame_positions_alloc += 1024;
-    xing->frame_positions = realloc(xing->frame_positions,
-                                    xing->frame_positions_alloc *
-                                    sizeof(*xing->frame_positions));
-    }
-  xing->frame_positions[xing->num_frames] = xing->total_bytes;
+  bgen_seek_index_append(&xing->frame_index, xing->num_frames,
+                         xing->total_bytes, p->buf.len);
   xing->num_frames++;
-  xing->total_bytes+= bytes;
+  xing->total_bytes += p->buf.len;
+
+  if(p->duration > 0)
+    xing->duration += p->duration;
+  
+  xing->music_crc = update_crc(xing, xing->music_crc, p->buf.buf, p->buf.len);
   }
 
 static const char xing_sig[4] = "Xing";
+static const char info_sig[4] = "Info";
+
+/* LAME extension, see http://gabriel.mp3-tech.org/mp3infotag.html */
+
+static uint8_t * write_lame_tag(bg_xing_t * xing, uint8_t * ptr)
+  {
+  int delay = 0;
+  int padding = 0;
+  uint32_t tmp;
+  
+  /* Encoder version */
+  memcpy(ptr, xing->encoder, 9); ptr += 9;
+
+  /* Tag revision 0 and VBR method (1 = CBR, 0 = unknown) */
+  *ptr = xing->bitrate ? 1 : 0; ptr++;
+
+  /* Lowpass, peak signal amplitude and replay gain are unknown */
+  ptr += 1 + 4 + 2 + 2;
+
+  /* Encoding flags and ATH type */
+  ptr++;
+
+  /* Bitrate (CBR) */
+  *ptr = (xing->bitrate < 255) ? xing->bitrate : 255; ptr++;
+
+  /* Encoder delay and padding for gapless playback. The duration
+     of the packets includes the pre_skip samples */
+
+  if((xing->pre_skip >= BG_MP3_DECODER_DELAY) && (xing->duration > 0))
+    {
+    delay = xing->pre_skip - BG_MP3_DECODER_DELAY;
+    padding = (int64_t)xing->num_frames * xing->samples_per_frame +
+      BG_MP3_DECODER_DELAY - xing->duration;
+
+    if(delay > 0xfff)
+      delay = 0xfff;
+    if(padding < 0)
+      padding = 0;
+    else if(padding > 0xfff)
+      padding = 0xfff;
+    }
+  
+  ptr[0] = delay >> 4;
+  ptr[1] = ((delay & 0x0f) << 4) | (padding >> 8);
+  ptr[2] = padding & 0xff;
+  ptr += 3;
+
+  /* Misc, MP3 gain, preset and surround info */
+  ptr += 1 + 1 + 2;
+  
+  /* Music length including the tag frame */
+  tmp = xing->tag_bytes + xing->total_bytes;
+  INT_32BE_2_PTR(tmp, ptr); ptr += 4;
+  
+  /* Music CRC */
+  INT_16BE_2_PTR(xing->music_crc, ptr); ptr += 2;
+
+  /* CRC of the tag frame up to here */
+  tmp = update_crc(xing, 0, xing->buffer, ptr - xing->buffer);
+  INT_16BE_2_PTR(tmp, ptr); ptr += 2;
+  return ptr;
+  }
 
 int bg_xing_write(bg_xing_t * xing, gavl_io_t * out)
   {
   uint32_t tmp;
+  uint32_t total_bytes;
   uint64_t tmp_64;
   int i;
   uint8_t * ptr;
@@ -244,35 +384,42 @@ int bg_xing_write(bg_xing_t * xing, gavl_io_t * out)
 
     ptr += get_xing_offset(xing->header);
 
-    memcpy(ptr, xing_sig, 4); ptr += 4;
+    memcpy(ptr, xing->bitrate ? info_sig : xing_sig, 4); ptr += 4;
 
     /* Flags */
-    tmp = 7; // FRAMES_FLAG | BYTES_FLAG | TOC_FLAG
+    tmp = 15; // FRAMES_FLAG | BYTES_FLAG | TOC_FLAG | VBR_SCALE_FLAG
     INT_32BE_2_PTR(tmp, ptr); ptr += 4;
 
     /* Num frames */
     tmp = xing->num_frames;
     INT_32BE_2_PTR(tmp, ptr); ptr += 4;
     
-    /* Num bytes */
-    tmp = xing->total_bytes;
-    INT_32BE_2_PTR(tmp, ptr); ptr += 4;
+    /* Num bytes, the positions are relative to the start of the tag frame */
+    total_bytes = xing->tag_bytes + xing->total_bytes;
+    INT_32BE_2_PTR(total_bytes, ptr); ptr += 4;
 
-    /* Seek table */
+    /* Seek table: Byte positions of the frames at i percent of
+       the duration */
     for(i = 0; i < 100; i++)
       {
-      tmp_64 = xing->frame_positions[(i * xing->num_frames) / 100];
-
-      //      fprintf(stderr, "Seek entry %d: %ld ", i, tmp_64);
+      tmp_64 = xing->tag_bytes +
+        bgen_seek_index_lookup(&xing->frame_index,
+                               (i * (int64_t)xing->num_frames) / 100)->position;
       
       tmp_64 *= 256;
-      tmp_64 /= xing->total_bytes;
+      tmp_64 /= total_bytes;
 
-      //      fprintf(stderr, "%ld\n",tmp_64);
+      if(tmp_64 > 255)
+        tmp_64 = 255;
       
       *ptr = tmp_64;
       ptr++;
       }
+
+    /* Quality (unknown) */
+    ptr += 4;
+
+    write_lame_tag(xing, ptr);
     }
   if(gavl_io_write_data(out, xing->buffer, xing->tag_bytes) < xing->tag_bytes)
     return 0;
@@ -282,7 +429,6 @@ int bg_xing_write(bg_xing_t * xing, gavl_io_t * out)
 
 void bg_xing_destroy(bg_xing_t * xing)
   {
-  if(xing->frame_positions)
-    free(xing->frame_positions);
+  bgen_seek_index_free(&xing->frame_index);
   free(xing);
   }
@@ -20,11 +20,23 @@
 
 
 
+/* Decoders add this to the encoder delay of lame (taken from
+   ffmpeg). The pre_skip of the stream includes it, the encoder delay
+   in the LAME tag doesn't */
+
+#define BG_MP3_DECODER_DELAY (528 + 1)
+
 typedef struct bg_xing_s bg_xing_t;
 
-bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len);
+/* Xing or Info tag with LAME extension. The encoder string
+   (e.g. "LAME3.100") is stored in 9 bytes. The pre_skip of ci
+   is stored as encoder delay */
+
+bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len,
+                           const char * encoder,
+                           const gavl_compression_info_t * ci);
 
-void bg_xing_update(bg_xing_t * xing, int bytes);
+void bg_xing_update(bg_xing_t * xing, const gavl_packet_t * p);
 
 int bg_xing_write(bg_xing_t * xing, gavl_io_t * out);
 
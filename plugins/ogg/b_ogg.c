@@ -0,0 +1,507 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Sends Ogg streams to an icecast server */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <config.h>
+#include <gmerlin/translation.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/plugin.h>
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "b_ogg"
+
+#include <gavl/metatags.h>
+#include <gavl/state.h>
+
+#include <bgshout.h>
+
+#include "ogg_common.h"
+
+/* The send queue of the shout connection does the buffering. Pages
+   are passed to it immediately and held back only briefly for
+   interleaving */
+
+#define LIVE_LOOKAHEAD 100 /* ms */
+
+static const char * const file_parameters[] =
+  {
+    "write_buffer",
+    "flush_interval",
+    NULL
+  };
+
+extern const bg_ogg_codec_t bg_vorbis_codec;
+
+#ifdef HAVE_OPUS
+extern const bg_ogg_codec_t bg_opus_codec;
+#endif
+
+static bg_ogg_codec_t const * const audio_codecs[] =
+  {
+    &bg_vorbis_codec,
+#ifdef HAVE_OPUS
+    &bg_opus_codec,
+#endif
+    NULL,
+  };
+
+typedef struct
+  {
+  bg_ogg_encoder_t * enc;
+  bg_shout_t * shout;
+  gavl_io_t * io;
+
+  bg_parameter_info_t * parameters;
+
+  /* Wrappers for the sinks of the encoder */
+  gavl_audio_sink_t * asink;
+  gavl_packet_sink_t * psink;
+  gavl_audio_sink_t * enc_asink;
+  gavl_packet_sink_t * enc_psink;
+
+  bg_msg_sink_t * msg_sink;
+
+  /* Metadata updates, applied from the encoding thread */
+  pthread_mutex_t metadata_mutex;
+  gavl_dictionary_t metadata;
+  int metadata_changed;
+  } b_ogg_t;
+
+static void * create_b_ogg()
+  {
+  b_ogg_t * ret = calloc(1, sizeof(*ret));
+  ret->enc = bg_ogg_encoder_create();
+  ret->enc->out_buf_size = 0;
+  ret->enc->flush_interval = 0;
+  ret->enc->max_lookahead = gavl_time_unscale(1000, LIVE_LOOKAHEAD);
+  ret->shout = bg_shout_create(SHOUT_FORMAT_OGG);
+  pthread_mutex_init(&ret->metadata_mutex, NULL);
+  return ret;
+  }
+
+static void destroy_b_ogg(void * data)
+  {
+  b_ogg_t * b = data;
+
+  bg_ogg_encoder_destroy(b->enc);
+  bg_shout_destroy(b->shout);
+
+  if(b->io)
+    gavl_io_destroy(b->io);
+  if(b->asink)
+    gavl_audio_sink_destroy(b->asink);
+  if(b->psink)
+    gavl_packet_sink_destroy(b->psink);
+  if(b->msg_sink)
+    bg_msg_sink_destroy(b->msg_sink);
+  if(b->parameters)
+    bg_parameter_info_destroy_array(b->parameters);
+
+  gavl_dictionary_free(&b->metadata);
+  pthread_mutex_destroy(&b->metadata_mutex);
+  free(b);
+  }
+
+static int is_file_parameter(const char * name)
+  {
+  int i = 0;
+  while(file_parameters[i])
+    {
+    if(!strcmp(file_parameters[i], name))
+      return 1;
+    i++;
+    }
+  return 0;
+  }
+
+static const bg_parameter_info_t * get_parameters_b_ogg(void * data)
+  {
+  b_ogg_t * b = data;
+
+  if(!b->parameters)
+    {
+    int i, j, num;
+    const bg_parameter_info_t * arr[3];
+    const bg_parameter_info_t * ogg;
+    bg_parameter_info_t * live;
+
+    /* Encoder parameters without the ones for file output */
+    ogg = bg_ogg_encoder_get_parameters(b->enc);
+
+    num = 0;
+    while(ogg[num].name)
+      num++;
+    live = calloc(num + 1, sizeof(*live));
+
+    j = 0;
+    for(i = 0; i < num; i++)
+      {
+      if(is_file_parameter(ogg[i].name))
+        continue;
+      live[j] = ogg[i];
+      if(!strcmp(live[j].name, "lookahead"))
+        live[j].val_default.v.i = LIVE_LOOKAHEAD;
+      j++;
+      }
+    
+    arr[0] = bg_shout_get_parameters();
+    arr[1] = live;
+    arr[2] = NULL;
+    b->parameters = bg_parameter_info_concat_arrays(arr);
+    free(live);
+    }
+  return b->parameters;
+  }
+
+static void set_parameter_b_ogg(void * data, const char * name,
+                                const gavl_value_t * val)
+  {
+  b_ogg_t * b = data;
+
+  /* Ignore stored settings of the hidden parameters */
+  if(name && is_file_parameter(name))
+    return;
+  
+  bg_shout_set_parameter(b->shout, name, val);
+  bg_ogg_encoder_set_parameter(b->enc, name, val);
+  }
+
+static void set_callbacks_b_ogg(void * data, bg_encoder_callbacks_t * cb)
+  {
+  b_ogg_t * b = data;
+  bg_ogg_encoder_set_callbacks(b->enc, cb);
+  }
+
+static const char * get_protocols_b_ogg(void * data)
+  {
+  return "icecast shout";
+  }
+
+static int write_func(void * priv, const uint8_t * data, int len)
+  {
+  return bg_shout_write(priv, data, len);
+  }
+
+static int open_b_ogg(void * data, const char * url,
+                      const gavl_dictionary_t * metadata)
+  {
+  b_ogg_t * b = data;
+
+  if(url && *url)
+    bg_shout_set_url(b->shout, url);
+
+  if(metadata)
+    bg_shout_set_metadata(b->shout, metadata);
+
+  if(!bg_shout_open(b->shout))
+    return 0;
+
+  b->io = gavl_io_create(NULL, write_func, NULL, NULL, NULL,
+                         GAVL_IO_CAN_WRITE, b->shout);
+
+  return bg_ogg_encoder_open(b->enc, NULL, b->io, metadata, "ogg");
+  }
+
+/* Audio streams */
+
+static const bg_parameter_info_t * get_audio_parameters_b_ogg(void * data)
+  {
+  b_ogg_t * b = data;
+  return bg_ogg_encoder_get_audio_parameters(b->enc, audio_codecs);
+  }
+
+static const bg_ogg_codec_t * get_compressed_codec(const gavl_compression_info_t * ci)
+  {
+  switch(ci->id)
+    {
+    case GAVL_CODEC_ID_VORBIS:
+      return &bg_vorbis_codec;
+#ifdef HAVE_OPUS
+    case GAVL_CODEC_ID_OPUS:
+      return &bg_opus_codec;
+#endif
+    default:
+      break;
+    }
+  return NULL;
+  }
+
+static int writes_compressed_audio_b_ogg(void * data,
+                                         const gavl_audio_format_t * format,
+                                         const gavl_compression_info_t * ci)
+  {
+  return !!get_compressed_codec(ci);
+  }
+
+static int add_audio_stream_b_ogg(void * data, const gavl_dictionary_t * m,
+                                  const gavl_audio_format_t * format)
+  {
+  b_ogg_t * b = data;
+  bg_ogg_stream_t * s;
+  s = bg_ogg_encoder_add_audio_stream(b->enc, m, format);
+  /* Codec is set along with the parameters */
+  return s->index;
+  }
+
+static int add_audio_stream_compressed_b_ogg(void * data,
+                                             const gavl_dictionary_t * m,
+                                             const gavl_audio_format_t * format,
+                                             const gavl_compression_info_t * ci)
+  {
+  b_ogg_t * b = data;
+  bg_ogg_stream_t * s;
+  s = bg_ogg_encoder_add_audio_stream_compressed(b->enc, m, format, ci);
+  bg_ogg_encoder_init_stream(b->enc, s, get_compressed_codec(ci));
+  return s->index;
+  }
+
+static void set_audio_parameter_b_ogg(void * data, int stream,
+                                      const char * name,
+                                      const gavl_value_t * val)
+  {
+  int i = 0;
+  b_ogg_t * b = data;
+  bg_ogg_stream_t * s = &b->enc->audio_streams[stream];
+
+  if(!name)
+    return;
+  else if(!strcmp(name, "codec"))
+    {
+    while(audio_codecs[i])
+      {
+      if(!strcmp(audio_codecs[i]->name, val->v.str))
+        {
+        bg_ogg_encoder_init_stream(b->enc, s, audio_codecs[i]);
+        break;
+        }
+      i++;
+      }
+    }
+  else if(s->codec)
+    bg_ogg_encoder_set_audio_parameter(b->enc, stream, name, val);
+  }
+
+/* Metadata */
+
+static int handle_msg(void * data, gavl_msg_t * msg)
+  {
+  b_ogg_t * b = data;
+
+  switch(msg->NS)
+    {
+    case GAVL_MSG_NS_STATE:
+      switch(msg->ID)
+        {
+        case GAVL_MSG_STATE_CHANGED:
+          {
+          const char * ctx;
+          const char * var;
+          gavl_value_t val;
+          const gavl_dictionary_t * dict;
+
+          gavl_value_init(&val);
+
+          gavl_msg_get_state(msg,
+                             NULL,
+                             &ctx,
+                             &var, &val, NULL);
+
+          if(!strcmp(ctx, GAVL_STATE_CTX_SRC) &&
+             !strcmp(var, GAVL_STATE_SRC_METADATA) &&
+             (dict = gavl_value_get_dictionary(&val)))
+            {
+            pthread_mutex_lock(&b->metadata_mutex);
+            gavl_dictionary_reset(&b->metadata);
+            gavl_dictionary_copy(&b->metadata, dict);
+            b->metadata_changed = 1;
+            pthread_mutex_unlock(&b->metadata_mutex);
+            }
+          gavl_value_free(&val);
+          }
+          break;
+        }
+      break;
+    }
+  return 1;
+  }
+
+static bg_msg_sink_t * add_msg_stream_b_ogg(void * data, int stream_id)
+  {
+  b_ogg_t * b = data;
+  if(stream_id != GAVL_META_STREAM_ID_MSG_PROGRAM)
+    return NULL;
+
+  b->msg_sink = bg_msg_sink_create(handle_msg, b, 1);
+  return b->msg_sink;
+  }
+
+static void resume_shout(void * data)
+  {
+  bg_shout_resume(data);
+  }
+
+/* Called before each frame or packet. Icecast takes the metadata of
+   Ogg streams from the comment headers, so metadata changes and
+   reconnects both start a new chain */
+
+static void check_restart(b_ogg_t * b)
+  {
+  int restart = 0;
+  
+  pthread_mutex_lock(&b->metadata_mutex);
+  if(b->metadata_changed)
+    {
+    gavl_dictionary_copy(&b->enc->metadata, &b->metadata);
+    b->metadata_changed = 0;
+    restart = 1;
+    }
+  pthread_mutex_unlock(&b->metadata_mutex);
+  
+  if(bg_shout_reconnected(b->shout))
+    {
+    gavl_log(GAVL_LOG_INFO, LOG_DOMAIN, "Restarting stream after reconnect");
+    bg_ogg_encoder_restart(b->enc, resume_shout, b->shout);
+    }
+  else if(restart)
+    bg_ogg_encoder_restart(b->enc, NULL, NULL);
+  }
+
+static gavl_audio_frame_t * get_audio_func(void * data)
+  {
+  b_ogg_t * b = data;
+  return gavl_audio_sink_get_frame(b->enc_asink);
+  }
+
+static gavl_sink_status_t put_audio_func(void * data, gavl_audio_frame_t * f)
+  {
+  b_ogg_t * b = data;
+  check_restart(b);
+  return gavl_audio_sink_put_frame(b->enc_asink, f);
+  }
+
+static gavl_sink_status_t put_packet_func(void * data, gavl_packet_t * p)
+  {
+  b_ogg_t * b = data;
+  check_restart(b);
+  return gavl_packet_sink_put_packet(b->enc_psink, p);
+  }
+
+static int start_b_ogg(void * data)
+  {
+  b_ogg_t * b = data;
+
+  if(!b->enc->audio_streams[0].codec)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "No codec selected");
+    return 0;
+    }
+
+  if(!bg_ogg_encoder_start(b->enc))
+    return 0;
+
+  if((b->enc_asink = bg_ogg_encoder_get_audio_sink(b->enc, 0)))
+    b->asink = gavl_audio_sink_create(get_audio_func, put_audio_func, b,
+                                      gavl_audio_sink_get_format(b->enc_asink));
+
+  b->enc_psink = bg_ogg_encoder_get_audio_packet_sink(b->enc, 0);
+  b->psink = gavl_packet_sink_create(NULL, put_packet_func, b);
+  return 1;
+  }
+
+static gavl_audio_sink_t * get_audio_sink_b_ogg(void * data, int stream)
+  {
+  b_ogg_t * b = data;
+  return b->asink;
+  }
+
+static gavl_packet_sink_t *
+get_audio_packet_sink_b_ogg(void * data, int stream)
+  {
+  b_ogg_t * b = data;
+  return b->psink;
+  }
+
+static int close_b_ogg(void * data, int do_delete)
+  {
+  int ret;
+  b_ogg_t * b = data;
+
+  ret = bg_ogg_encoder_close(b->enc, 0);
+  bg_shout_close(b->shout);
+
+  if(b->io)
+    {
+    gavl_io_destroy(b->io);
+    b->io = NULL;
+    }
+  return ret;
+  }
+
+const bg_encoder_plugin_t the_plugin =
+  {
+    .common =
+    {
+      BG_LOCALE,
+      .name =            "b_ogg",       /* Unique short name */
+      .long_name =       TRS("Ogg Broadcaster"),
+      .description =     TRS("Broadcaster for Ogg streams using libshout. Supports vorbis and opus."),
+      .type =            BG_PLUGIN_ENCODER,
+      .flags =           BG_PLUGIN_URL | BG_PLUGIN_BROADCAST,
+      .priority =        5,
+      .create =            create_b_ogg,
+      .destroy =           destroy_b_ogg,
+      .get_parameters =    get_parameters_b_ogg,
+      .set_parameter =     set_parameter_b_ogg,
+      .get_protocols =     get_protocols_b_ogg,
+    },
+    .max_audio_streams =   1,
+    .min_audio_streams =   1,
+    .max_video_streams =   0,
+
+    .set_callbacks =       set_callbacks_b_ogg,
+    .writes_compressed_audio = writes_compressed_audio_b_ogg,
+    .open =                open_b_ogg,
+
+    .get_audio_parameters =    get_audio_parameters_b_ogg,
+
+    .add_audio_stream =        add_audio_stream_b_ogg,
+    .add_audio_stream_compressed =        add_audio_stream_compressed_b_ogg,
+    .add_msg_stream =          add_msg_stream_b_ogg,
+
+    .set_audio_parameter =   set_audio_parameter_b_ogg,
+
+    .start =                 start_b_ogg,
+
+    .get_audio_sink =        get_audio_sink_b_ogg,
+    .get_audio_packet_sink = get_audio_packet_sink_b_ogg,
+
+    .close =                 close_b_ogg,
+  };
+
+/* Include this into all plugin modules exactly once
+   to let the plugin loader obtain the API version */
+BG_GET_PLUGIN_API_VERSION;
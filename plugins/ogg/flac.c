@@ -44,9 +44,20 @@
 /* Way too large but save */
 #define BUFFER_SIZE (MAX_BYTES_PER_FRAME*10)
 
+#define ID_HEADER_SIZE 9
+
+static const uint8_t id_header[ID_HEADER_SIZE] =
+  {
+    0x7f,
+    0x46, 0x4C, 0x41, 0x43, // FLAC
+    0x01, 0x00, // Major, minor version
+    0x00, 0x01, // Number of other header packets (Big Endian)
+  };
+
 typedef struct
   {
   bg_flac_t * enc;
+  bg_ogg_stream_t * s;
   
   int header_written;
     
@@ -73,15 +84,8 @@ static int init_compressed_flacogg(bg_ogg_stream_t * s)
   uint8_t * ptr;
   uint8_t * comment_ptr;
   gavl_io_t * io;
+  flacogg_t * flacogg = s->codec_priv;
   
-  uint8_t header_bytes[] =
-    {
-      0x7f,
-      0x46, 0x4C, 0x41, 0x43, // FLAC
-      0x01, 0x00, // Major, minor version
-      0x00, 0x01, // Number of other header packets (Big Endian)
-    };
-
   gavl_compression_info_t ci;
   gavl_compression_info_init(&ci);
   gavl_stream_get_compression_info(&s->s, &ci);
@@ -91,14 +95,14 @@ static int init_compressed_flacogg(bg_ogg_stream_t * s)
   /* Not the last metadata packet */
   ci.codec_header.buf[4] &= 0x7f;
 
-  op.packet = malloc(9 + ci.codec_header.len);
+  op.packet = malloc(ID_HEADER_SIZE + ci.codec_header.len);
   
-  memcpy(op.packet, header_bytes, 9);
+  memcpy(op.packet, id_header, ID_HEADER_SIZE);
   
-  memcpy(op.packet+9, ci.codec_header.buf,
+  memcpy(op.packet+ID_HEADER_SIZE, ci.codec_header.buf,
          ci.codec_header.len);
 
-  op.bytes  = ci.codec_header.len + 9;
+  op.bytes  = ci.codec_header.len + ID_HEADER_SIZE;
   
   if(!bg_ogg_stream_write_header_packet(s, &op))
     {
@@ -107,6 +111,9 @@ static int init_compressed_flacogg(bg_ogg_stream_t * s)
     }
   
   free(op.packet);
+
+  /* The stream info gets updated when the encoder is finished */
+  flacogg->s = s;
   
   /* Vorbis comment */
   
@@ -165,10 +172,32 @@ static void set_parameter_flacogg(void * data, const char * name,
   bg_flac_set_parameter(flacogg->enc, name, v);
   }
 
+/* Put the final stream info into the ID page */
+
+static int streaminfo_callback(void * data, uint8_t * si, int len)
+  {
+  uint8_t packet[ID_HEADER_SIZE + BG_FLAC_HEADER_SIZE];
+  flacogg_t * flacogg = data;
+
+  /* Initial stream info, the ID page is not written yet */
+  if(!flacogg->s || (len != BG_FLAC_HEADER_SIZE))
+    return 1;
+
+  memcpy(packet, id_header, ID_HEADER_SIZE);
+  memcpy(packet + ID_HEADER_SIZE, si, len);
+
+  /* Not the last metadata packet */
+  packet[ID_HEADER_SIZE + 4] &= 0x7f;
+
+  bg_ogg_stream_update_id_packet(flacogg->s, packet, ID_HEADER_SIZE + len);
+  return 1;
+  }
+
 static gavl_audio_sink_t *
 init_flacogg(void * data, gavl_dictionary_t * stream)
   {
   flacogg_t * flacogg = data;
+  bg_flac_set_callbacks(flacogg->enc, streaminfo_callback, flacogg);
   return bg_flac_start_uncompressed(flacogg->enc, stream);
   }
 
@@ -0,0 +1,179 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Benchmark for the packet path of the Ogg muxer. The one-packet
+   lookahead used to copy every packet with gavl_packet_copy() and
+   pass it to libogg when its successor arrived. write_gavl_packet()
+   now passes each packet right away. Both variants are run with
+   FLAC sized packets and the payload bytes copied by the muxer
+   (excluding the copy inside libogg) are reported per encoded second.
+
+   Usage: lookahead_bench [seconds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <config.h>
+
+#include <gavl/gavl.h>
+#include <ogg/ogg.h>
+
+/* 16 bit stereo at 44.1 kHz, FLAC level 0 compresses to about 60 % */
+#define SAMPLERATE     44100
+#define PACKET_SAMPLES 4096
+#define PACKET_BYTES   10650
+
+typedef struct
+  {
+  gavl_time_t time;
+  int64_t copied;
+  int64_t written;
+  } result_t;
+
+static void packet_to_ogg(gavl_packet_t * p, ogg_packet * op, int64_t packetno)
+  {
+  memset(op, 0, sizeof(*op));
+  op->packet = p->buf.buf;
+  op->bytes = p->buf.len;
+  op->granulepos = p->pts + p->duration;
+  op->packetno = packetno;
+  }
+
+static void pageout(ogg_stream_state * os, result_t * r, int force)
+  {
+  ogg_page og;
+
+  while(force ? ogg_stream_flush(os, &og) : ogg_stream_pageout(os, &og))
+    r->written += og.header_len + og.body_len;
+  }
+
+static void run(int num_packets, int lookahead, result_t * r)
+  {
+  int i;
+  uint8_t * data;
+  ogg_stream_state os;
+  ogg_packet op;
+  gavl_packet_t p;
+  gavl_packet_t last_packet;
+  gavl_timer_t * timer;
+
+  memset(r, 0, sizeof(*r));
+  
+  data = malloc(PACKET_BYTES);
+  for(i = 0; i < PACKET_BYTES; i++)
+    data[i] = rand() & 0xff;
+  
+  gavl_packet_init(&p);
+  gavl_packet_init(&last_packet);
+
+  p.buf.buf = data;
+  p.buf.len = PACKET_BYTES;
+  p.duration = PACKET_SAMPLES;
+  
+  ogg_stream_init(&os, 1);
+
+  timer = gavl_timer_create();
+  gavl_timer_start(timer);
+
+  for(i = 0; i < num_packets; i++)
+    {
+    p.pts = (int64_t)i * PACKET_SAMPLES;
+
+    if(lookahead)
+      {
+      /* Old code: Pass the previous packet and keep a copy of this one */
+      if(i)
+        {
+        packet_to_ogg(&last_packet, &op, i - 1);
+        ogg_stream_packetin(&os, &op);
+        }
+      gavl_packet_copy(&last_packet, &p);
+      r->copied += p.buf.len;
+      }
+    else
+      {
+      packet_to_ogg(&p, &op, i);
+      ogg_stream_packetin(&os, &op);
+      }
+    pageout(&os, r, 0);
+    }
+
+  if(lookahead)
+    {
+    packet_to_ogg(&last_packet, &op, num_packets - 1);
+    op.e_o_s = 1;
+    ogg_stream_packetin(&os, &op);
+    }
+  else
+    os.e_o_s = 1;
+  
+  pageout(&os, r, 1);
+  
+  r->time = gavl_timer_get(timer);
+
+  gavl_timer_destroy(timer);
+  ogg_stream_clear(&os);
+  gavl_packet_free(&last_packet);
+  free(data);
+  }
+
+static void print_result(const char * name, const result_t * r,
+                         double seconds)
+  {
+  printf("%-10s %8.1f MB/s, %10.0f bytes copied per encoded second\n",
+         name,
+         (double)r->written / (double)(r->time ? r->time : 1) *
+         GAVL_TIME_SCALE / 1.0e6,
+         (double)r->copied / seconds);
+  }
+
+int main(int argc, char ** argv)
+  {
+  int seconds = 3600;
+  int num_packets;
+  result_t old_r;
+  result_t new_r;
+  
+  if(argc > 1)
+    seconds = atoi(argv[1]);
+  if(seconds < 1)
+    seconds = 1;
+  
+  num_packets = (int)((int64_t)seconds * SAMPLERATE / PACKET_SAMPLES);
+  
+  printf("%d packets of %d bytes (%d seconds)\n",
+         num_packets, PACKET_BYTES, seconds);
+  
+  run(num_packets, 1, &old_r);
+  run(num_packets, 0, &new_r);
+
+  if(old_r.written != new_r.written)
+    {
+    fprintf(stderr, "Output size differs: %"PRId64" != %"PRId64"\n",
+            old_r.written, new_r.written);
+    return 1;
+    }
+  
+  print_result("lookahead", &old_r, seconds);
+  print_result("direct", &new_r, seconds);
+  return 0;
+  }
@@ -42,19 +42,139 @@
 
 #define LOG_DOMAIN "ogg"
 
+/* Hard limit for the page queue, used if the granule times are bogus */
+#define MAX_QUEUED_PAGES 1024
+
 void * bg_ogg_encoder_create()
   {
   bg_ogg_encoder_t * ret;
   ret = calloc(1, sizeof(*ret));
+  ret->max_lookahead = GAVL_TIME_SCALE / 2;
+  ret->max_page_size = 4096;
+  ret->out_buf_size = 64 * 1024;
+  ret->flush_interval = GAVL_TIME_SCALE / 2;
+  ret->timer = gavl_timer_create();
+  ret->use_skeleton = 1;
   return ret;
   }
 
+static const bg_parameter_info_t parameters[] =
+  {
+    {
+      .name =        "lookahead",
+      .long_name =   TRS("Interleaving lookahead (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(10000),
+      .val_default = GAVL_VALUE_INIT_INT(500),
+      .help_string = TRS("Maximum time distance between the first and last page held back for interleaving multiple streams. Larger values give better interleaving at the cost of memory and latency."),
+    },
+    {
+      .name =        "max_page_duration",
+      .long_name =   TRS("Maximum page duration (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(10000),
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Finish a page before it covers more than this time. This bounds the latency of live streams at the cost of some overhead. 0 means no limit."),
+    },
+    {
+      .name =        "max_page_size",
+      .long_name =   TRS("Maximum page size"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(256),
+      .val_max =     GAVL_VALUE_INIT_INT(65025),
+      .val_default = GAVL_VALUE_INIT_INT(4096),
+      .help_string = TRS("Finish a page once its body exceeds this many bytes. The default of 4096 is the libogg default."),
+    },
+    {
+      .name =        "write_buffer",
+      .long_name =   TRS("Write buffer (kB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(16384),
+      .val_default = GAVL_VALUE_INIT_INT(64),
+      .help_string = TRS("Collect pages in a buffer of this size and write them at once. 0 writes each page immediately."),
+    },
+    {
+      .name =        "flush_interval",
+      .long_name =   TRS("Flush interval (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(60000),
+      .val_default = GAVL_VALUE_INIT_INT(500),
+      .help_string = TRS("Write the buffered pages at least this often, even if the buffer is not full. Useful for live streams. 0 means flush only when the buffer is full."),
+    },
+    {
+      .name =        "threads",
+      .long_name =   TRS("Encode streams in separate threads"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Run the codec of each stream in its own thread. Speeds up files with multiple streams on multicore machines."),
+    },
+    {
+      .name =        "page_builder",
+      .long_name =   TRS("Internal page builder"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Build the Ogg pages internally with a faster CRC calculation instead of using libogg. The output is identical."),
+    },
+    {
+      .name =        "skeleton",
+      .long_name =   TRS("Write skeleton index"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Add an Ogg Skeleton 4.0 track with a keypoint index for fast seeking. This is only done for seekable outputs."),
+    },
+    { /* End of parameters */ }
+  };
+
+const bg_parameter_info_t * bg_ogg_encoder_get_parameters(void * data)
+  {
+  return parameters;
+  }
+
+void bg_ogg_encoder_set_parameter(void * data, const char * name,
+                                  const gavl_value_t * val)
+  {
+  bg_ogg_encoder_t * e = data;
+
+  if(!name)
+    return;
+  else if(!strcmp(name, "lookahead"))
+    e->max_lookahead = gavl_time_unscale(1000, val->v.i);
+  else if(!strcmp(name, "max_page_duration"))
+    e->max_page_duration = gavl_time_unscale(1000, val->v.i);
+  else if(!strcmp(name, "max_page_size"))
+    e->max_page_size = val->v.i;
+  else if(!strcmp(name, "write_buffer"))
+    e->out_buf_size = val->v.i * 1024;
+  else if(!strcmp(name, "flush_interval"))
+    e->flush_interval = gavl_time_unscale(1000, val->v.i);
+  else if(!strcmp(name, "threads"))
+    e->use_threads = val->v.i;
+  else if(!strcmp(name, "page_builder"))
+    e->use_builder = val->v.i;
+  else if(!strcmp(name, "skeleton"))
+    e->use_skeleton = val->v.i;
+  }
+
+int bg_ogg_encoder_get_queue_depth(bg_ogg_encoder_t * e)
+  {
+  return e->num_pages;
+  }
+
 static void free_stream(bg_ogg_stream_t * s)
   {
   gavl_dictionary_free(&s->s);
   if(s->stats_file)
     free(s->stats_file);
-  gavl_packet_free(&s->last_packet);
+  if(s->keypoints)
+    free(s->keypoints);
+  if(s->worker)
+    bg_ogg_worker_destroy(s->worker);
+  bg_ogg_builder_free(&s->builder);
+  gavl_buffer_free(&s->id_page);
   }
 
 void bg_ogg_encoder_destroy(void * data)
@@ -84,6 +204,19 @@ void bg_ogg_encoder_destroy(void * data)
   
   if(e->filename)
     free(e->filename);
+
+  if(e->pages)
+    {
+    for(i = 0; i < e->pages_alloc; i++)
+      gavl_buffer_free(&e->pages[i].buf);
+    free(e->pages);
+    }
+
+  gavl_buffer_free(&e->out_buf);
+  gavl_timer_destroy(e->timer);
+
+  if(e->skeleton)
+    bg_ogg_skeleton_destroy(e);
   
   if(e->audio_parameters)
     bg_parameter_info_destroy_array(e->audio_parameters);
@@ -145,34 +278,280 @@ bg_ogg_encoder_open(void * data, const char * file,
     }
   
   e->serialno = rand();
+  gavl_timer_start(e->timer);
+  e->last_flush_time = 0;
   if(metadata)
     gavl_dictionary_copy(&e->metadata, metadata);
   return 1;
   }
 
+int bg_ogg_encoder_flush_output(bg_ogg_encoder_t * e)
+  {
+  int ret = 1;
+  
+  if(e->out_buf.len &&
+     (gavl_io_write_data(e->io, e->out_buf.buf, e->out_buf.len) < e->out_buf.len))
+    ret = 0;
+  
+  e->out_buf.len = 0;
+  e->last_flush_time = gavl_timer_get(e->timer);
+  return ret;
+  }
+
+/* Write the buffered data if the flush interval elapsed */
+
+static int check_flush_interval(bg_ogg_encoder_t * e)
+  {
+  if(e->flush_interval && e->out_buf.len &&
+     (gavl_timer_get(e->timer) - e->last_flush_time >= e->flush_interval))
+    return bg_ogg_encoder_flush_output(e);
+  return 1;
+  }
+
+static int write_page_data(bg_ogg_encoder_t * e,
+                           const uint8_t * data, int len)
+  {
+  if(e->out_buf.len + len > e->out_buf_size)
+    {
+    if(!bg_ogg_encoder_flush_output(e))
+      return 0;
+    }
+
+  /* Unbuffered or too large */
+  if(len >= e->out_buf_size)
+    {
+    if(gavl_io_write_data(e->io, data, len) < len)
+      return 0;
+    return 1;
+    }
+  
+  if(!e->out_buf.alloc)
+    gavl_buffer_alloc(&e->out_buf, e->out_buf_size);
+  
+  gavl_buffer_append_data(&e->out_buf, data, len);
+  return check_flush_interval(e);
+  }
+
+int bg_ogg_encoder_write_page(bg_ogg_encoder_t * e, const ogg_page * og)
+  {
+  /* Unbuffered: Write header and body at once, so network outputs
+     never get a partial page */
+  if(!e->out_buf_size)
+    {
+    gavl_buffer_append_data(&e->out_buf, og->header, og->header_len);
+    gavl_buffer_append_data(&e->out_buf, og->body, og->body_len);
+    return bg_ogg_encoder_flush_output(e);
+    }
+  
+  if(!write_page_data(e, og->header, og->header_len) ||
+     !write_page_data(e, og->body, og->body_len))
+    return 0;
+  return 1;
+  }
+
+int64_t bg_ogg_encoder_position(bg_ogg_encoder_t * e)
+  {
+  return gavl_io_position(e->io) + e->out_buf.len;
+  }
+
+/* Page queue */
+
+static int stream_page_pending(bg_ogg_stream_t * streams, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    {
+    if(!streams[i].finished && !streams[i].num_queued_pages)
+      return 0;
+    }
+  return 1;
+  }
+
+/* Return the index of the next page to write or -1 if we must
+   wait for more pages */
+
+static int next_page(bg_ogg_encoder_t * e, int all)
+  {
+  int i;
+  int ret = 0;
+  gavl_time_t max_time;
+
+  if(!e->num_pages)
+    return -1;
+
+  max_time = e->pages[0].time;
+  
+  for(i = 1; i < e->num_pages; i++)
+    {
+    if(e->pages[i].time < e->pages[ret].time)
+      ret = i;
+    if(e->pages[i].time > max_time)
+      max_time = e->pages[i].time;
+    }
+
+  if(all ||
+     (e->num_pages > MAX_QUEUED_PAGES) ||
+     (max_time - e->pages[ret].time > e->max_lookahead))
+    return ret;
+
+  /* The earliest page can be written if all other streams
+     have a page queued, because pages within a stream are ordered */
+  
+  if(stream_page_pending(e->audio_streams, e->num_audio_streams) &&
+     stream_page_pending(e->video_streams, e->num_video_streams))
+    return ret;
+  
+  return -1;
+  }
+
+static int drain_queue(bg_ogg_encoder_t * e, int all)
+  {
+  int idx;
+  int ret = 1;
+  bg_ogg_page_t p;
+  
+  while((idx = next_page(e, all)) >= 0)
+    {
+    if(e->skeleton)
+      bg_ogg_skeleton_add_page(e, &e->pages[idx],
+                               bg_ogg_encoder_position(e));
+    
+    if(!write_page_data(e, e->pages[idx].buf.buf, e->pages[idx].buf.len))
+      ret = 0;
+
+    e->pages[idx].s->num_queued_pages--;
+
+    /* Keep the buffer behind the active pages for reuse */
+    p = e->pages[idx];
+    if(idx < e->num_pages - 1)
+      memmove(e->pages + idx, e->pages + idx + 1,
+              (e->num_pages - 1 - idx) * sizeof(*e->pages));
+    e->num_pages--;
+    e->pages[e->num_pages] = p;
+    
+    if(!ret)
+      break;
+    }
+  return ret;
+  }
+
+static int queue_page(bg_ogg_stream_t * s, ogg_page * og,
+                      int64_t start_granule)
+  {
+  bg_ogg_page_t * p;
+  bg_ogg_page_t direct;
+  int64_t granulepos;
+  bg_ogg_encoder_t * e = s->enc;
+
+  /* A single stream needs no interleaving: The page is written
+     without copying it into the queue */
+  if(e->num_audio_streams + e->num_video_streams == 1)
+    {
+    memset(&direct, 0, sizeof(direct));
+    p = &direct;
+    }
+  else
+    {
+    if(e->num_pages == e->pages_alloc)
+      {
+      e->pages_alloc += 16;
+      e->pages = realloc(e->pages, e->pages_alloc * sizeof(*e->pages));
+      memset(e->pages + e->num_pages, 0,
+             (e->pages_alloc - e->num_pages) * sizeof(*e->pages));
+      }
+
+    p = e->pages + e->num_pages;
+  
+    p->buf.len = 0;
+    gavl_buffer_append_data(&p->buf, og->header, og->header_len);
+    gavl_buffer_append_data(&p->buf, og->body, og->body_len);
+    }
+
+  /* Pages without a finished packet inherit the time of the previous page */
+  granulepos = ogg_page_granulepos(og);
+  if((granulepos != -1) && s->granule_rate)
+    s->last_page_time = gavl_time_unscale(s->granule_rate, granulepos);
+  
+  p->time = s->last_page_time;
+  p->s = s;
+  p->granulepos = granulepos;
+  p->start_granule = start_granule;
+
+  /* A seek point is a page where a (key)frame starts */
+  p->keypoint = (start_granule != GAVL_TIME_UNDEFINED) &&
+    !ogg_page_continued(og) &&
+    (!(s->flags & STREAM_KEYFRAMES) || s->keypoint_pending);
+  s->keypoint_pending = 0;
+  
+  if(ogg_page_eos(og))
+    s->finished = 1;
+
+  if(p == &direct)
+    {
+    if(e->skeleton)
+      bg_ogg_skeleton_add_page(e, p, bg_ogg_encoder_position(e));
+    return bg_ogg_encoder_write_page(e, og);
+    }
+  
+  s->num_queued_pages++;
+  e->num_pages++;
+  
+  return drain_queue(e, 0);
+  }
+
 static int bg_ogg_stream_flush_page(bg_ogg_stream_t * s, int force)
   {
   int result;
   ogg_page og;
+  int64_t start_granule = s->last_granule;
+  
   memset(&og, 0, sizeof(og));
-  if(force)
-    result = ogg_stream_flush(&s->os,&og);
+  if(s->enc->use_builder)
+    result = bg_ogg_builder_pageout(&s->builder, &og, force,
+                                    s->enc->max_page_size);
+  else if(force)
+    result = ogg_stream_flush_fill(&s->os, &og, s->enc->max_page_size);
   else
-    result = ogg_stream_pageout(&s->os,&og);
+    result = ogg_stream_pageout_fill(&s->os, &og, s->enc->max_page_size);
   
   if(result)
     {
-    if((gavl_io_write_data(s->enc->io,
-                           og.header,og.header_len) < og.header_len) ||
-       (gavl_io_write_data(s->enc->io,
-                           og.body,og.body_len) < og.body_len))
+    /* Header pages don't count for the page duration */
+    if(s->enc->started && (ogg_page_granulepos(&og) != -1))
+      s->last_granule = ogg_page_granulepos(&og);
+    
+    /* Header pages are written immediately */
+    if(!s->enc->started)
+      {
+      /* Keep the ID page for updating it at the end */
+      if(ogg_page_bos(&og) && !s->id_page.len && (s->id_page_pos >= 0) &&
+         gavl_io_can_seek(s->enc->io))
+        {
+        s->id_page_pos = bg_ogg_encoder_position(s->enc);
+        s->id_page_header_len = og.header_len;
+        gavl_buffer_append_data(&s->id_page, og.header, og.header_len);
+        gavl_buffer_append_data(&s->id_page, og.body, og.body_len);
+        }
+      
+      if(!bg_ogg_encoder_write_page(s->enc, &og))
+        return -1;
+      }
+    else if(!queue_page(s, &og, start_granule))
       return -1;
-    else
-      return 1;
+    
+    return 1;
     }
   return 0;
   }
 
+static void stream_packetin(bg_ogg_stream_t * s, ogg_packet * op)
+  {
+  if(s->enc->use_builder)
+    bg_ogg_builder_packetin(&s->builder, op);
+  else
+    ogg_stream_packetin(&s->os, op);
+  }
+
 int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s, ogg_packet * p)
   {
   if(!s->packetno)
@@ -181,7 +560,7 @@ int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s, ogg_packet * p)
     p->b_o_s = 0;
   
   p->packetno = s->packetno++;
-  ogg_stream_packetin(&s->os, p);
+  stream_packetin(s, p);
   if(!s->num_headers)
     {
     if(bg_ogg_stream_flush_page(s, 1) <= 0)
@@ -194,6 +573,59 @@ int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s, ogg_packet * p)
   return 1;
   }
 
+int bg_ogg_stream_update_id_packet(bg_ogg_stream_t * s,
+                                   const uint8_t * data, int len)
+  {
+  uint32_t crc;
+  uint8_t * h;
+  
+  if(!s->id_page.len || (s->id_page_pos < 0))
+    return 0;
+
+  /* The lacing values would change */
+  if(s->id_page.len - s->id_page_header_len != len)
+    {
+    gavl_log(GAVL_LOG_WARNING, LOG_DOMAIN,
+             "Cannot update ID page: Packet size changed");
+    return 0;
+    }
+  
+  h = s->id_page.buf;
+  memcpy(h + s->id_page_header_len, data, len);
+
+  memset(h + 22, 0, 4);
+  crc = bg_ogg_crc(0, h, s->id_page.len);
+  
+  h[22] = crc & 0xff;
+  h[23] = (crc >> 8) & 0xff;
+  h[24] = (crc >> 16) & 0xff;
+  h[25] = (crc >> 24) & 0xff;
+
+  s->id_page_changed = 1;
+  return 1;
+  }
+
+static int write_id_page(bg_ogg_encoder_t * e, bg_ogg_stream_t * s)
+  {
+  int ret = 1;
+  int64_t end_pos;
+  
+  if(!s->id_page_changed || (s->id_page_pos < 0))
+    return 1;
+
+  end_pos = gavl_io_position(e->io);
+  
+  if((gavl_io_seek(e->io, s->id_page_pos, SEEK_SET) != s->id_page_pos) ||
+     (gavl_io_write_data(e->io, s->id_page.buf, s->id_page.len) < s->id_page.len))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Updating ID page failed");
+    ret = 0;
+    }
+  
+  gavl_io_seek(e->io, end_pos, SEEK_SET);
+  return ret;
+  }
+
 int bg_ogg_stream_flush(bg_ogg_stream_t * s, int force)
   {
   int result, ret = 0;
@@ -240,47 +672,59 @@ void bg_ogg_packet_from_gavl(bg_ogg_stream_t * s, gavl_packet_t * src,
 
 static gavl_sink_status_t write_gavl_packet(void * data, gavl_packet_t * p)
   {
+  ogg_packet op;
+  int force_flush = 0;
   bg_ogg_stream_t * s = data;
 
-  /* Flush the last packet */
-  if(s->last_packet.buf.len)
-    {
-    ogg_packet op;
-    int force_flush = 0;
-    
-    memset(&op, 0, sizeof(op));
-    bg_ogg_packet_from_gavl(s, &s->last_packet, &op);
-    op.packetno = s->packetno++;
-    ogg_stream_packetin(&s->os, &op);
-
-    if((s->flags & STREAM_KEYFRAMES) &&
-       (p->flags & GAVL_PACKET_KEYFRAME))
-      force_flush = 1;
-    
-    /* Flush pages if any */
-    if(bg_ogg_stream_flush(s, force_flush) < 0)
-      return GAVL_SINK_ERROR;
-    }
-  /* Save this packet */
-  gavl_packet_copy(&s->last_packet, p);
+  memset(&op, 0, sizeof(op));
+  bg_ogg_packet_from_gavl(s, p, &op);
+
+  /* Flush pages of the previous packets. The packet passed last stays
+     in the stream state until we know if it's the last one */
+  
+  if((s->flags & STREAM_KEYFRAMES) &&
+     (p->flags & GAVL_PACKET_KEYFRAME))
+    force_flush = 1;
+
+  /* The first page of a link starts with the first data packet */
+  if(s->last_granule == GAVL_TIME_UNDEFINED)
+    s->last_granule = op.granulepos - p->duration;
+  
+  /* Don't let the page become longer than max_page_duration */
+  else if(s->max_page_granules &&
+          (op.granulepos - s->last_granule > s->max_page_granules))
+    force_flush = 1;
+  
+  if(bg_ogg_stream_flush(s, force_flush) < 0)
+    return GAVL_SINK_ERROR;
+
+  if((s->flags & STREAM_KEYFRAMES) &&
+     (p->flags & GAVL_PACKET_KEYFRAME))
+    s->keypoint_pending = 1;
+  
+  op.packetno = s->packetno++;
+  stream_packetin(s, &op);
+
+  /* Pages of other streams must not wait in the buffer
+     just because this stream produces no pages */
+  if(!check_flush_interval(s->enc))
+    return GAVL_SINK_ERROR;
+  
   return GAVL_SINK_OK;
   }
 
 static int flush_stream(bg_ogg_stream_t * s)
   {
-  /* Flush the last packet */
-  if(s->last_packet.buf.len)
-    {
-    ogg_packet op;
-    memset(&op, 0, sizeof(op));
-    bg_ogg_packet_from_gavl(s, &s->last_packet, &op);
-    op.packetno = s->packetno++;
-    op.e_o_s = 1;
-    ogg_stream_packetin(&s->os, &op);
-    /* Flush pages if any */
-    if(bg_ogg_stream_flush(s, 1) < 0)
-      return 0;
-    }
+  /* Mark the last page */
+  s->os.e_o_s = 1;
+  s->builder.e_o_s = 1;
+  
+  /* Flush pages if any */
+  if(bg_ogg_stream_flush(s, 1) < 0)
+    return 0;
+  
+  /* Don't wait for pages of this stream anymore */
+  s->finished = 1;
   return 1;
   }
 
@@ -298,7 +742,9 @@ static bg_ogg_stream_t * append_stream(bg_ogg_encoder_t * e,
   ret->index = num_streams;
   
   memset(ret, 0, sizeof(*ret));
-  ogg_stream_init(&ret->os, e->serialno++);
+  ret->serialno = e->serialno++;
+  ogg_stream_init(&ret->os, ret->serialno);
+  bg_ogg_builder_init(&ret->builder, ret->serialno);
   
   ret->enc = e;
   ret->index = num_streams;
@@ -435,6 +881,88 @@ int bg_ogg_encoder_set_video_pass(void * data, int stream,
   return 1;
   }
 
+static void set_granule_rate_audio(bg_ogg_stream_t * s)
+  {
+  gavl_compression_info_t ci;
+  gavl_compression_info_init(&ci);
+  gavl_stream_get_compression_info(&s->s, &ci);
+
+  /* Opus granules are always in 48 kHz units */
+  if(ci.id == GAVL_CODEC_ID_OPUS)
+    s->granule_rate = 48000;
+  else
+    s->granule_rate = gavl_stream_get_audio_format(&s->s)->samplerate;
+  
+  gavl_compression_info_free(&ci);
+  }
+
+static void set_packet_sink(bg_ogg_stream_t * s)
+  {
+  s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
+
+  if(s->enc->use_threads && !(s->flags & STREAM_COMPRESSED) &&
+     (s->worker = bg_ogg_worker_create(s)))
+    s->codec->set_packet_sink(s->codec_priv,
+                              bg_ogg_worker_get_packet_sink(s->worker));
+  else
+    s->codec->set_packet_sink(s->codec_priv, s->psink_out);
+  }
+
+static int drain_streams(bg_ogg_stream_t * streams, int num)
+  {
+  int i;
+  int ret = 1;
+  for(i = 0; i < num; i++)
+    {
+    if(streams[i].worker && !bg_ogg_worker_drain(streams[i].worker))
+      ret = 0;
+    }
+  return ret;
+  }
+
+int bg_ogg_encoder_drain_workers(bg_ogg_encoder_t * e)
+  {
+  int ret = 1;
+  if(!drain_streams(e->video_streams, e->num_video_streams))
+    ret = 0;
+  if(!drain_streams(e->audio_streams, e->num_audio_streams))
+    ret = 0;
+  return ret;
+  }
+
+static void finish_workers(bg_ogg_encoder_t * e, int quit)
+  {
+  int i;
+  for(i = 0; i < e->num_audio_streams; i++)
+    {
+    bg_ogg_stream_t * s = &e->audio_streams[i];
+    if(!s->worker)
+      continue;
+    if(quit)
+      bg_ogg_worker_finish(s->worker);
+    else
+      bg_ogg_worker_sync(s->worker);
+    }
+  for(i = 0; i < e->num_video_streams; i++)
+    {
+    bg_ogg_stream_t * s = &e->video_streams[i];
+    if(!s->worker)
+      continue;
+    if(quit)
+      bg_ogg_worker_finish(s->worker);
+    else
+      bg_ogg_worker_sync(s->worker);
+    }
+  bg_ogg_encoder_drain_workers(e);
+  }
+
+static void init_page_policy(bg_ogg_stream_t * s)
+  {
+  s->last_granule = GAVL_TIME_UNDEFINED;
+  s->max_page_granules = gavl_time_scale(s->granule_rate,
+                                         s->enc->max_page_duration);
+  }
+
 static int start_audio(bg_ogg_encoder_t * e, int stream)
   {
   bg_ogg_stream_t * s = &e->audio_streams[stream];
@@ -453,8 +981,9 @@ static int start_audio(bg_ogg_encoder_t * e, int stream)
     if(!s->codec->init_audio_compressed(s))
       return 0;
     }
-  s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
-  s->codec->set_packet_sink(s->codec_priv, s->psink_out);
+  set_granule_rate_audio(s);
+  init_page_policy(s);
+  set_packet_sink(s);
   return 1;
   }
 
@@ -488,8 +1017,9 @@ static int start_video(bg_ogg_encoder_t * e, int stream)
       return 0;
     }
 
-  s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
-  s->codec->set_packet_sink(s->codec_priv, s->psink_out);
+  s->granule_rate = gavl_stream_get_video_format(&s->s)->timescale;
+  init_page_policy(s);
+  set_packet_sink(s);
   return 1;
   }
 
@@ -497,6 +1027,13 @@ int bg_ogg_encoder_start(void * data)
   {
   int i;
   bg_ogg_encoder_t * e = data;
+
+  /* The skeleton BOS page must be the first one */
+  if(e->use_skeleton && gavl_io_can_seek(e->io))
+    {
+    if(!bg_ogg_skeleton_start(e))
+      return 0;
+    }
   
   /* Start encoders and write identification headers */
   for(i = 0; i < e->num_video_streams; i++)
@@ -510,6 +1047,9 @@ int bg_ogg_encoder_start(void * data)
       return 0;
     }
 
+  if(e->skeleton && !bg_ogg_skeleton_write_headers(e))
+    return 0;
+  
   /* Write remaining header pages */
   for(i = 0; i < e->num_video_streams; i++)
     {
@@ -523,6 +1063,10 @@ int bg_ogg_encoder_start(void * data)
     if(bg_ogg_stream_flush(s, 1) < 0)
       return 0;
     }
+
+  if(e->skeleton && !bg_ogg_skeleton_finish_headers(e))
+    return 0;
+  
   e->started = 1;
   return 1;
   }
@@ -530,12 +1074,16 @@ int bg_ogg_encoder_start(void * data)
 gavl_audio_sink_t * bg_ogg_encoder_get_audio_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
+  if(e->audio_streams[stream].worker)
+    return bg_ogg_worker_get_audio_sink(e->audio_streams[stream].worker);
   return e->audio_streams[stream].asink;
   }
 
 gavl_video_sink_t * bg_ogg_encoder_get_video_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
+  if(e->video_streams[stream].worker)
+    return bg_ogg_worker_get_video_sink(e->video_streams[stream].worker);
   return e->video_streams[stream].vsink;
   }
 
@@ -555,8 +1103,6 @@ bg_ogg_encoder_get_video_packet_sink(void * data, int stream)
 
 void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_metadata)
   {
-  int i;
-
   bg_ogg_encoder_t * e = data;
 
   /* Copy all tags, overriding what's already there */
@@ -564,6 +1110,22 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
   
   if(!e->started)
     return;
+
+  bg_ogg_encoder_restart(e, NULL, NULL);
+  }
+
+/* End the current chain and start a new one with the same streams.
+   If resume is given, it's called after the old chain was passed to
+   the output and before the new headers are written */
+
+void bg_ogg_encoder_restart(bg_ogg_encoder_t * e,
+                            void (*resume)(void * priv),
+                            void * priv)
+  {
+  int i;
+  
+  /* Wait for the encoder threads */
+  finish_workers(e, 0);
   
   /* Flush all data */
   for(i = 0; i < e->num_audio_streams; i++)
@@ -576,6 +1138,21 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
     bg_ogg_stream_t * s = &e->video_streams[i];
     bg_ogg_stream_reset(s, e->serialno++);
     }
+
+  /* All pages of the old chain must be written before the new headers */
+  drain_queue(e, 1);
+
+  /* The skeleton index covers only the first link */
+  if(e->skeleton)
+    bg_ogg_skeleton_end_segment(e);
+
+  if(resume)
+    {
+    bg_ogg_encoder_flush_output(e);
+    resume(priv);
+    }
+  
+  e->started = 0;
   
   /* Reinitialize with new metadata */
   for(i = 0; i < e->num_audio_streams; i++)
@@ -600,7 +1177,7 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
     bg_ogg_stream_t * s = &e->video_streams[i];
     bg_ogg_stream_flush(s, 1);
     }
-  
+  e->started = 1;
   }
 
 int bg_ogg_encoder_close(void * data, int do_delete)
@@ -611,6 +1188,9 @@ int bg_ogg_encoder_close(void * data, int do_delete)
 
   if(!e->io)
     return 1;
+
+  /* Encode all queued frames */
+  finish_workers(e, 1);
   
   for(i = 0; i < e->num_audio_streams; i++)
     {
@@ -622,6 +1202,14 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       break;
       }
 
+    if(s->worker)
+      {
+      /* Packets flushed by the codec */
+      bg_ogg_worker_drain(s->worker);
+      bg_ogg_worker_destroy(s->worker);
+      s->worker = NULL;
+      }
+    
     flush_stream(s);
     ogg_stream_clear(&s->os);
     
@@ -644,6 +1232,14 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       ret = 0;
       break;
       }
+
+    if(s->worker)
+      {
+      bg_ogg_worker_drain(s->worker);
+      bg_ogg_worker_destroy(s->worker);
+      s->worker = NULL;
+      }
+    
     flush_stream(s);
     ogg_stream_clear(&s->os);
 
@@ -659,6 +1255,34 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       }
     }
 
+  if(!drain_queue(e, 1))
+    ret = 0;
+
+  if(!bg_ogg_encoder_flush_output(e))
+    ret = 0;
+
+  /* Final ID headers */
+  if(ret && !do_delete)
+    {
+    for(i = 0; i < e->num_audio_streams; i++)
+      {
+      if(!write_id_page(e, &e->audio_streams[i]))
+        ret = 0;
+      }
+    for(i = 0; i < e->num_video_streams; i++)
+      {
+      if(!write_id_page(e, &e->video_streams[i]))
+        ret = 0;
+      }
+    }
+  
+  if(e->skeleton)
+    {
+    if(ret && !do_delete && !bg_ogg_skeleton_finalize(e))
+      ret = 0;
+    bg_ogg_skeleton_destroy(e);
+    }
+  
   if(e->io_priv)
     gavl_io_destroy(e->io_priv);
   
@@ -839,7 +1463,14 @@ void bg_ogg_stream_reset(bg_ogg_stream_t * s, long serialno)
   flush_stream(s);
   s->packetno = 0;
   s->num_headers = 0;
+  s->finished = 0;
+  s->last_granule = GAVL_TIME_UNDEFINED;
   ogg_stream_clear(&s->os);
   ogg_stream_init(&s->os, serialno);
+  bg_ogg_builder_init(&s->builder, serialno);
+  s->serialno = serialno;
+
+  /* The ID page of the first link stays as it is */
+  s->id_page_pos = -1;
   
   }
@@ -31,6 +31,54 @@ typedef struct bg_ogg_stream_s bg_ogg_stream_t;
 #define STREAM_COMPRESSED  (1<<1)
 #define STREAM_KEYFRAMES   (1<<2)
 
+/* Entry of the Skeleton keypoint index */
+
+typedef struct
+  {
+  int64_t offset;  /* Page position relative to the segment start */
+  int64_t granule; /* Granule of the first packet starting on the page */
+  } bg_ogg_keypoint_t;
+
+typedef struct bg_ogg_skeleton_s bg_ogg_skeleton_t;
+typedef struct bg_ogg_worker_s bg_ogg_worker_t;
+
+/* In-tree page builder (pagebuilder.c) */
+
+typedef struct
+  {
+  int bytes;          /* Bytes not yet written to a page */
+  int started;        /* Parts of the packet are already written */
+  int64_t granulepos;
+  } bg_ogg_builder_packet_t;
+
+typedef struct
+  {
+  long serialno;
+  long pageno;
+  int b_o_s;
+  int e_o_s;
+
+  bg_ogg_builder_packet_t * packets;
+  int num_packets;
+  int packets_alloc;
+  int num_segments;
+
+  gavl_buffer_t body;
+  int body_returned;
+
+  uint8_t header[282];
+  } bg_ogg_builder_t;
+
+void bg_ogg_builder_init(bg_ogg_builder_t * b, long serialno);
+void bg_ogg_builder_free(bg_ogg_builder_t * b);
+void bg_ogg_builder_packetin(bg_ogg_builder_t * b, const ogg_packet * op);
+
+/* force = 1: ogg_stream_flush_fill(), force = 0: ogg_stream_pageout_fill() */
+int bg_ogg_builder_pageout(bg_ogg_builder_t * b, ogg_page * og,
+                           int force, int nfill);
+
+uint32_t bg_ogg_crc(uint32_t crc, const uint8_t * data, int len);
+
 typedef struct
   {
   char * name;
@@ -81,8 +129,13 @@ struct bg_ogg_stream_s
   gavl_video_sink_t * vsink;
 
   gavl_packet_sink_t * psink_out;
+
+  /* Encoder thread (optional) */
+  bg_ogg_worker_t * worker;
   
   ogg_stream_state os;
+  bg_ogg_builder_t builder;
+  long serialno;
 
   int flags;
   
@@ -94,13 +147,34 @@ struct bg_ogg_stream_s
   /* Counter for header packets */
   int num_headers;
 
+  /* First page of the stream, updated in place on seekable outputs */
+  gavl_buffer_t id_page;
+  int64_t id_page_pos;       /* -1: No update (chained stream) */
+  int id_page_header_len;
+  int id_page_changed;
+
   /* Counter for packets */
   int64_t packetno;
   
   int index;
 
-  /* Last packet */
-  gavl_packet_t last_packet;
+  /* Page interleaving */
+  int granule_rate;          /* Timescale of the granulepos */
+  gavl_time_t last_page_time;
+  int num_queued_pages;
+  int finished;              /* EOS page was produced */
+
+  /* Page flushing policy */
+  int64_t max_page_granules;
+  int64_t last_granule;      /* Granulepos of the last data page */
+
+  /* Skeleton index */
+  int keypoint_pending;      /* Next page starts with a keyframe */
+  bg_ogg_keypoint_t * keypoints;
+  int num_keypoints;
+  int64_t keypoint_interval; /* Minimum distance in granules */
+  int64_t index_first_granule;
+  int64_t index_last_granule;
 
   /* Metadata */
 
@@ -116,6 +190,13 @@ int bg_ogg_stream_write_gavl_packet(bg_ogg_stream_t * s,
 
 int bg_ogg_stream_flush(bg_ogg_stream_t * s, int force);
 
+/* Replace the packet on the ID page with its final version. This is
+   done only if the packet size doesn't change. The page is written
+   when the encoder is closed */
+
+int bg_ogg_stream_update_id_packet(bg_ogg_stream_t * s,
+                                   const uint8_t * data, int len);
+
 void bg_ogg_packet_to_gavl(ogg_packet * src,
                            gavl_packet_t * dst,
                            int64_t * pts);
@@ -129,6 +210,23 @@ void bg_ogg_stream_reset(bg_ogg_stream_t * s, long serialno);
 
 void bg_ogg_encoder_update_metadata(void * priv, const gavl_dictionary_t * new_metadata);
 
+void bg_ogg_encoder_restart(bg_ogg_encoder_t * e,
+                            void (*resume)(void * priv),
+                            void * priv);
+
+/* Completed page, waiting in the interleaving queue */
+
+typedef struct
+  {
+  gavl_buffer_t buf; /* Header and body */
+  gavl_time_t time;  /* Granulepos converted to GAVL_TIME_SCALE */
+  bg_ogg_stream_t * s;
+
+  int keypoint;          /* Page can be used as a seek point */
+  int64_t start_granule; /* Granule of the first packet starting here */
+  int64_t granulepos;
+  } bg_ogg_page_t;
+
 struct bg_ogg_encoder_s
   {
   int started;
@@ -156,6 +254,35 @@ struct bg_ogg_encoder_s
   //  void (*close_callback)(void * priv);
   int (*open_callback)(void * priv);
   void * open_callback_data;
+
+  /* Page queue: Pages of all streams are written in the order
+     of their granule times */
+  bg_ogg_page_t * pages;
+  int num_pages;
+  int pages_alloc;
+
+  gavl_time_t max_lookahead;
+
+  /* Page flushing policy */
+  gavl_time_t max_page_duration;
+  int max_page_size;
+
+  /* Write-behind buffer */
+  gavl_buffer_t out_buf;
+  int out_buf_size;
+  gavl_time_t flush_interval;
+  gavl_time_t last_flush_time;
+  gavl_timer_t * timer;
+
+  /* Run the codecs in separate threads */
+  int use_threads;
+
+  /* Use pagebuilder.c instead of libogg */
+  int use_builder;
+
+  /* Skeleton track with keypoint index (seekable outputs only) */
+  int use_skeleton;
+  bg_ogg_skeleton_t * skeleton;
   };
 
 void * bg_ogg_encoder_create(void);
@@ -170,6 +297,57 @@ int bg_ogg_encoder_open(void *, const char * file,
 
 void bg_ogg_encoder_destroy(void*);
 
+const bg_parameter_info_t * bg_ogg_encoder_get_parameters(void * data);
+
+void bg_ogg_encoder_set_parameter(void * data, const char * name,
+                                  const gavl_value_t * val);
+
+/* Number of completed pages not yet written to the output */
+int bg_ogg_encoder_get_queue_depth(bg_ogg_encoder_t * e);
+
+/* Low level output, bypassing the page queue */
+
+int bg_ogg_encoder_write_page(bg_ogg_encoder_t * e, const ogg_page * og);
+
+int bg_ogg_encoder_flush_output(bg_ogg_encoder_t * e);
+
+/* Logical output position including buffered data */
+int64_t bg_ogg_encoder_position(bg_ogg_encoder_t * e);
+
+/* Skeleton (skeleton.c) */
+
+int bg_ogg_skeleton_start(bg_ogg_encoder_t * e);
+
+int bg_ogg_skeleton_write_headers(bg_ogg_encoder_t * e);
+
+int bg_ogg_skeleton_finish_headers(bg_ogg_encoder_t * e);
+
+void bg_ogg_skeleton_add_page(bg_ogg_encoder_t * e,
+                              const bg_ogg_page_t * p,
+                              int64_t position);
+
+void bg_ogg_skeleton_end_segment(bg_ogg_encoder_t * e);
+
+int bg_ogg_skeleton_finalize(bg_ogg_encoder_t * e);
+
+void bg_ogg_skeleton_destroy(bg_ogg_encoder_t * e);
+
+/* Encoder threads (worker.c) */
+
+bg_ogg_worker_t * bg_ogg_worker_create(bg_ogg_stream_t * s);
+void bg_ogg_worker_destroy(bg_ogg_worker_t * w);
+
+gavl_audio_sink_t * bg_ogg_worker_get_audio_sink(bg_ogg_worker_t * w);
+gavl_video_sink_t * bg_ogg_worker_get_video_sink(bg_ogg_worker_t * w);
+gavl_packet_sink_t * bg_ogg_worker_get_packet_sink(bg_ogg_worker_t * w);
+
+int bg_ogg_worker_drain(bg_ogg_worker_t * w);
+int bg_ogg_worker_sync(bg_ogg_worker_t * w);
+int bg_ogg_worker_finish(bg_ogg_worker_t * w);
+
+/* Pass packets from all encoder threads to the muxer */
+int bg_ogg_encoder_drain_workers(bg_ogg_encoder_t * e);
+
 //int bg_ogg_flush_page(ogg_stream_state * os, bg_ogg_encoder_t * output, int force);
 int bg_ogg_flush(ogg_stream_state * os, bg_ogg_encoder_t * output, int force);
 
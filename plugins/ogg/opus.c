@@ -63,6 +63,9 @@ typedef struct
 
 #define MAX_HEADER_LEN (8+1+1+2+4+2+1+1+1+256)
 
+/* Size of the input buffer in frames */
+#define BUFFER_FRAMES 8
+
 static void setup_header(opus_header_t * h, gavl_audio_format_t * format);
 static void header_to_packet(opus_header_t * h, gavl_buffer_t * ret);
 
@@ -85,9 +88,19 @@ typedef struct
   OpusMSEncoder * enc;
   opus_header_t h;
   opus_int32 lookahead;
-  gavl_audio_frame_t * frame;
   gavl_audio_format_t * format;
 
+  /* Input buffer. The encoder reads whole frames from read_pos,
+     new samples are appended at write_pos */
+  gavl_audio_frame_t * buffer;
+  int buffer_size;
+  int read_pos;
+  int write_pos;
+  int block_align;
+
+  /* Window at write_pos, passed to the caller for writing in place */
+  gavl_audio_frame_t * frame;
+
   int64_t samples_read;
 
   uint8_t * enc_buffer;
@@ -312,121 +325,182 @@ static void set_parameter_opus(void * data, const char * name,
   
   }
 
-static int flush_frame(opus_t * opus, int eof)
+static int encode_frame(opus_t * opus, int num, int eof)
   {
   gavl_packet_t gp;
   int result;
-
-  //  fprintf(stderr, "Flush frame %d %d\n", opus->frame->valid_samples,
-  //          opus->format->samples_per_frame);
+  uint8_t * ptr = opus->buffer->samples.u_8 +
+    opus->read_pos * opus->block_align;
   
-  if(opus->frame && opus->frame->valid_samples)
+  if(opus->format->sample_format == GAVL_SAMPLE_FLOAT)
     {
+    result = opus_multistream_encode_float(opus->enc,
+                                           (const float*)ptr,
+                                           opus->format->samples_per_frame,
+                                           opus->enc_buffer,
+                                           opus->enc_buffer_size);
+    }
+  else
+    {
+    result = opus_multistream_encode(opus->enc,
+                                     (const opus_int16*)ptr,
+                                     opus->format->samples_per_frame,
+                                     opus->enc_buffer,
+                                     opus->enc_buffer_size);
+    }
     
-    if(opus->frame->valid_samples < opus->format->samples_per_frame)
-      {
-      int block_align = opus->format->num_channels *
-        gavl_bytes_per_sample(opus->format->sample_format);
+  if(result < 0)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Encoding failed: %s", opus_strerror(result));
+    return 0;
+    }
     
-      memset(opus->frame->samples.s_8 +
-             block_align * opus->frame->valid_samples, 0,
-             (opus->format->samples_per_frame - opus->frame->valid_samples) *
-             block_align);
-      }
+  /* Create packet */
+  gavl_packet_init(&gp);
+  gp.buf.buf = opus->enc_buffer;
+  gp.buf.len = result;
+  if(eof)
+    gp.flags |= GAVL_PACKET_LAST;
+
+  gp.duration = (num * 48000) / opus->format->samplerate;
+  gp.pts = opus->pts;
+  opus->pts += gp.duration;
+  gavl_packet_sink_put_packet(opus->psink, &gp);
+  opus->read_pos += num;
+  return 1;
+  }
 
-    if(opus->format->sample_format == GAVL_SAMPLE_FLOAT)
-      {
-      result = opus_multistream_encode_float(opus->enc,
-                                             opus->frame->samples.f,
-                                             opus->format->samples_per_frame,
-                                             opus->enc_buffer,
-                                             opus->enc_buffer_size);
-      }
-    else
-      {
-      result = opus_multistream_encode(opus->enc,
-                                       opus->frame->samples.s_16,
-                                       opus->format->samples_per_frame,
-                                       opus->enc_buffer,
-                                       opus->enc_buffer_size);
-      }
-    
-    if(result < 0)
-      {
-      gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Encoding failed: %s", opus_strerror(result));
+/* Make sure, that there is space for one frame after write_pos */
+
+static void make_room(opus_t * opus)
+  {
+  int num;
+
+  if(opus->read_pos == opus->write_pos)
+    {
+    opus->read_pos = 0;
+    opus->write_pos = 0;
+    }
+  else if(opus->buffer_size - opus->write_pos < opus->format->samples_per_frame)
+    {
+    num = opus->write_pos - opus->read_pos;
+    memmove(opus->buffer->samples.u_8,
+            opus->buffer->samples.u_8 + opus->read_pos * opus->block_align,
+            num * opus->block_align);
+    opus->read_pos = 0;
+    opus->write_pos = num;
+    }
+  opus->frame->samples.u_8 = opus->buffer->samples.u_8 +
+    opus->write_pos * opus->block_align;
+  opus->frame->valid_samples = 0;
+  }
+
+/* Encode all complete frames. With eof, the last incomplete frame is
+   padded with silence */
+
+static int flush_frames(opus_t * opus, int eof)
+  {
+  int num;
+  
+  while(opus->write_pos - opus->read_pos >= opus->format->samples_per_frame)
+    {
+    if(!encode_frame(opus, opus->format->samples_per_frame, 0))
       return 0;
-      }
+    }
+
+  if(eof && (opus->write_pos > opus->read_pos))
+    {
+    make_room(opus);
+    num = opus->write_pos - opus->read_pos;
+
+    memset(opus->buffer->samples.u_8 + opus->write_pos * opus->block_align, 0,
+           (opus->format->samples_per_frame - num) * opus->block_align);
+
+    if(!encode_frame(opus, num, 1))
+      return 0;
+    opus->write_pos = opus->read_pos;
+    }
+  return 1;
+  }
+
+/* Encode the silence covering the encoder lookahead */
+
+static int flush_lookahead(opus_t * opus)
+  {
+  int num;
+  
+  while(opus->lookahead)
+    {
+    make_room(opus);
     
-    /* Create packet */
-    gavl_packet_init(&gp);
-    gp.buf.buf = opus->enc_buffer;
-    gp.buf.len = result;
-    if(eof)
-      gp.flags |= GAVL_PACKET_LAST;
-
-    gp.duration = (opus->frame->valid_samples * 48000) / opus->format->samplerate;
-    gp.pts = opus->pts;
-    opus->pts += gp.duration;
-    gavl_packet_sink_put_packet(opus->psink, &gp);
-    opus->frame->valid_samples = 0;
+    num = opus->lookahead;
+    if(num > opus->format->samples_per_frame)
+      num = opus->format->samples_per_frame;
+
+    memset(opus->frame->samples.u_8, 0, num * opus->block_align);
+    opus->write_pos += num;
+    opus->lookahead -= num;
+    
+    if(!flush_frames(opus, 0))
+      return 0;
     }
   return 1;
   }
 
+/* Let the caller write directly into the input buffer */
+
+static gavl_audio_frame_t * get_audio_frame_opus(void * data)
+  {
+  opus_t * opus = data;
+
+  if(!flush_lookahead(opus))
+    return NULL;
+  
+  make_room(opus);
+  return opus->frame;
+  }
+
 static gavl_sink_status_t
 write_audio_frame_opus(void * data, gavl_audio_frame_t * frame)
   {
-  int result = 1;
   int samples_read = 0;
   int samples_copied;
   
   opus_t * opus = data;
 
-  /* Handle lookahead */
-  while(opus->lookahead)
+  if(frame == opus->frame)
     {
-    gavl_audio_frame_mute(opus->frame, opus->format);
-
-    opus->frame->valid_samples = opus->lookahead;
-    if(opus->frame->valid_samples > opus->format->samples_per_frame)
-      opus->frame->valid_samples = opus->format->samples_per_frame;
-
-    samples_copied = opus->frame->valid_samples;
-    
-    if(opus->frame->valid_samples == opus->format->samples_per_frame)
-      {
-      result = flush_frame(opus, 0);
-      if(!result)
-        break;
-      }
-    opus->lookahead -= samples_copied;
+    /* Already in place */
+    opus->write_pos += frame->valid_samples;
     }
-  
-  // fprintf(stderr, "write_audio %d\n", frame->valid_samples);
-  while(samples_read < frame->valid_samples)
+  else
     {
-    samples_copied =
-      gavl_audio_frame_copy(opus->format,
-                            opus->frame,
-                            frame,
-                            opus->frame->valid_samples, /* dst_pos */
-                            samples_read,                /* src_pos */
-                            opus->format->samples_per_frame -
-                            opus->frame->valid_samples, /* dst_size */
-                            frame->valid_samples - samples_read /* src_size */ );
-    opus->frame->valid_samples += samples_copied;
-    samples_read += samples_copied;
-
-    if(opus->frame->valid_samples == opus->format->samples_per_frame)
+    /* Handle lookahead */
+    if(!flush_lookahead(opus))
+      return GAVL_SINK_ERROR;
+    
+    while(samples_read < frame->valid_samples)
       {
-      result = flush_frame(opus, 0);
-      if(!result)
-        break;
+      make_room(opus);
+      
+      samples_copied =
+        gavl_audio_frame_copy(opus->format,
+                              opus->frame,
+                              frame,
+                              0,                           /* dst_pos */
+                              samples_read,                /* src_pos */
+                              opus->format->samples_per_frame, /* dst_size */
+                              frame->valid_samples - samples_read /* src_size */ );
+      opus->write_pos += samples_copied;
+      samples_read += samples_copied;
+
+      if(!flush_frames(opus, 0))
+        return GAVL_SINK_ERROR;
       }
     }
   
   opus->samples_read += frame->valid_samples;
-  return result ? GAVL_SINK_OK : GAVL_SINK_ERROR; 
+  return flush_frames(opus, 0) ? GAVL_SINK_OK : GAVL_SINK_ERROR; 
   }
 
 
@@ -436,6 +510,7 @@ init_opus(void * data, gavl_dictionary_t * s)
   int err;
   opus_t * opus = data;
   gavl_compression_info_t ci;
+  gavl_audio_format_t buffer_format;
   gavl_audio_format_t * format = gavl_stream_get_audio_format_nc(s);
   
   gavl_compression_info_init(&ci);
@@ -550,7 +625,14 @@ init_opus(void * data, gavl_dictionary_t * s)
   
   /* Save format and create frame */
   opus->format = format;
-  opus->frame = gavl_audio_frame_create(opus->format);
+
+  gavl_audio_format_copy(&buffer_format, opus->format);
+  buffer_format.samples_per_frame *= BUFFER_FRAMES;
+  opus->buffer = gavl_audio_frame_create(&buffer_format);
+  opus->buffer_size = buffer_format.samples_per_frame;
+  opus->block_align = opus->format->num_channels *
+    gavl_bytes_per_sample(opus->format->sample_format);
+  opus->frame = gavl_audio_frame_create(NULL);
   
   /* Output header */
 
@@ -576,7 +658,8 @@ init_opus(void * data, gavl_dictionary_t * s)
   gavl_stream_set_compression_info(s, &ci);
   gavl_compression_info_free(&ci);
   
-  return gavl_audio_sink_create(NULL, write_audio_frame_opus, opus,
+  return gavl_audio_sink_create(get_audio_frame_opus,
+                                write_audio_frame_opus, opus,
                                 opus->format);
   }
 
@@ -642,10 +725,16 @@ static int close_opus(void * data)
   opus_t * opus = data;
 
   /* Flush */
-  result = flush_frame(opus, 1);
+  if(opus->buffer)
+    result = flush_frames(opus, 1);
   
   if(opus->frame)
+    {
+    gavl_audio_frame_null(opus->frame);
     gavl_audio_frame_destroy(opus->frame);
+    }
+  if(opus->buffer)
+    gavl_audio_frame_destroy(opus->buffer);
   if(opus->enc_buffer)
     free(opus->enc_buffer);
   
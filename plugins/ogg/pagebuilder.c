@@ -0,0 +1,412 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Replacement for ogg_stream_packetin() / ogg_stream_pageout().
+   The page layout decisions are the same as in libogg (1.3.x), so the
+   output is byte identical. The difference is, that we keep one record
+   per packet instead of per lacing value and compute the lacing values
+   only when the page header is built. The page CRC is calculated
+   with slicing-by-8 or, if the CPU supports it, with PCLMULQDQ. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gmerlin/plugin.h>
+
+#include "ogg_common.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_PCLMUL_CRC
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+/* CRC-32 as used by Ogg: Polynomial 0x04c11db7, not reflected,
+   initial value 0, no final xor */
+
+#define CRC_POLY 0x04c11db7
+
+static uint32_t crc_table[8][256];
+
+typedef uint32_t (*crc_func_t)(uint32_t crc, const uint8_t * data, int len);
+
+static crc_func_t crc_func;
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_bytes(uint32_t crc, const uint8_t * data, int len)
+  {
+  while(len--)
+    crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *(data++)];
+  return crc;
+  }
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t * data, int len)
+  {
+  while(len >= 8)
+    {
+    crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+      ((uint32_t)data[2] << 8) | data[3];
+
+    crc = crc_table[7][crc >> 24] ^
+      crc_table[6][(crc >> 16) & 0xff] ^
+      crc_table[5][(crc >> 8) & 0xff] ^
+      crc_table[4][crc & 0xff] ^
+      crc_table[3][data[4]] ^
+      crc_table[2][data[5]] ^
+      crc_table[1][data[6]] ^
+      crc_table[0][data[7]];
+    data += 8;
+    len -= 8;
+    }
+  return crc_bytes(crc, data, len);
+  }
+
+#ifdef HAVE_PCLMUL_CRC
+
+/* Folding constants: x^n mod P */
+#define K_128 0xe8a45605ULL
+#define K_192 0xc5b9cd4cULL
+#define K_512 0xe6228b11ULL
+#define K_576 0x8833794cULL
+
+/* The bit order within a register is x^127 ... x^0, so the data is
+   byte reversed when loaded */
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i x, __m128i k, __m128i next)
+  {
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                     _mm_clmulepi64_si128(x, k, 0x00)),
+                       next);
+  }
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t * data, int len)
+  {
+  int i;
+  __m128i x[4];
+  __m128i k;
+  uint8_t tmp[16];
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                    8, 9, 10, 11, 12, 13, 14, 15);
+
+  if(len < 64)
+    return crc_slice8(crc, data, len);
+
+  for(i = 0; i < 4; i++)
+    x[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16*i)),
+                            swap);
+
+  /* The initial value goes into the first 32 bits of the message */
+  x[0] = _mm_xor_si128(x[0], _mm_set_epi32(crc, 0, 0, 0));
+
+  data += 64;
+  len -= 64;
+
+  /* Fold by 4 */
+  k = _mm_set_epi64x(K_576, K_512);
+  while(len >= 64)
+    {
+    for(i = 0; i < 4; i++)
+      x[i] = fold(x[i], k,
+                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16*i)),
+                                   swap));
+    data += 64;
+    len -= 64;
+    }
+
+  /* Fold by 1 */
+  k = _mm_set_epi64x(K_192, K_128);
+  x[0] = fold(x[0], k, x[1]);
+  x[0] = fold(x[0], k, x[2]);
+  x[0] = fold(x[0], k, x[3]);
+
+  while(len >= 16)
+    {
+    x[0] = fold(x[0], k,
+                _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), swap));
+    data += 16;
+    len -= 16;
+    }
+
+  /* The remaining 128 bits are reduced with the table */
+  _mm_storeu_si128((__m128i*)tmp, _mm_shuffle_epi8(x[0], swap));
+  crc = crc_slice8(0, tmp, 16);
+
+  return crc_slice8(crc, data, len);
+  }
+#endif
+
+static void crc_init(void)
+  {
+  int i, j;
+  uint32_t r;
+
+  for(i = 0; i < 256; i++)
+    {
+    r = i << 24;
+    for(j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ CRC_POLY : (r << 1);
+    crc_table[0][i] = r;
+    }
+
+  for(i = 0; i < 256; i++)
+    {
+    for(j = 1; j < 8; j++)
+      crc_table[j][i] = (crc_table[j-1][i] << 8) ^
+        crc_table[0][crc_table[j-1][i] >> 24];
+    }
+
+  crc_func = crc_slice8;
+
+#ifdef HAVE_PCLMUL_CRC
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    crc_func = crc_pclmul;
+#endif
+  }
+
+uint32_t bg_ogg_crc(uint32_t crc, const uint8_t * data, int len)
+  {
+  pthread_once(&crc_once, crc_init);
+  return crc_func(crc, data, len);
+  }
+
+/* Page builder */
+
+void bg_ogg_builder_init(bg_ogg_builder_t * b, long serialno)
+  {
+  b->serialno = serialno;
+  b->pageno = 0;
+  b->b_o_s = 0;
+  b->e_o_s = 0;
+  b->num_packets = 0;
+  b->num_segments = 0;
+  b->body.len = 0;
+  b->body_returned = 0;
+  }
+
+void bg_ogg_builder_free(bg_ogg_builder_t * b)
+  {
+  gavl_buffer_free(&b->body);
+  if(b->packets)
+    free(b->packets);
+  memset(b, 0, sizeof(*b));
+  }
+
+void bg_ogg_builder_packetin(bg_ogg_builder_t * b, const ogg_packet * op)
+  {
+  bg_ogg_builder_packet_t * p;
+
+  /* Drop the data of already returned pages */
+  if(b->body_returned)
+    {
+    b->body.len -= b->body_returned;
+    if(b->body.len)
+      memmove(b->body.buf, b->body.buf + b->body_returned, b->body.len);
+    b->body_returned = 0;
+    }
+
+  gavl_buffer_append_data(&b->body, op->packet, op->bytes);
+
+  if(b->num_packets == b->packets_alloc)
+    {
+    b->packets_alloc += 32;
+    b->packets = realloc(b->packets, b->packets_alloc * sizeof(*b->packets));
+    }
+
+  p = b->packets + b->num_packets;
+  p->bytes = op->bytes;
+  p->granulepos = op->granulepos;
+  p->started = 0;
+
+  b->num_packets++;
+  b->num_segments += op->bytes / 255 + 1;
+
+  if(op->e_o_s)
+    b->e_o_s = 1;
+  }
+
+/* Same decisions as ogg_stream_flush_i() in libogg */
+
+int bg_ogg_builder_pageout(bg_ogg_builder_t * b, ogg_page * og,
+                           int force, int nfill)
+  {
+  int i;
+  int vals = 0;
+  int maxvals;
+  int bytes = 0;
+  long acc = 0;
+  int64_t granule_pos = -1;
+  int packets_done = 0;
+  int packet_just_done = 0;
+  int done;
+  int seg;
+  int pkt;
+  int remaining;
+  uint8_t * h = b->header;
+  uint32_t crc;
+
+  maxvals = b->num_segments > 255 ? 255 : b->num_segments;
+
+  if(!maxvals)
+    return 0;
+
+  /* Like ogg_stream_pageout(): Finish the initial header page and the
+     last page immediately */
+  if(!force && ((b->e_o_s && b->num_segments) || !b->b_o_s))
+    force = 1;
+
+  /* Walk through the lacing values without consuming them */
+
+  pkt = 0;
+  remaining = b->packets[0].bytes;
+
+  if(!b->b_o_s)
+    {
+    /* Initial header page contains only the first packet */
+    granule_pos = 0;
+    vals = remaining / 255 + 1;
+    if(vals > maxvals)
+      vals = maxvals;
+    }
+  else
+    {
+    for(vals = 0; vals < maxvals; vals++)
+      {
+      if((acc > nfill) && (packet_just_done >= 4))
+        {
+        force = 1;
+        break;
+        }
+
+      seg = remaining >= 255 ? 255 : remaining;
+      acc += seg;
+
+      if(seg < 255)
+        {
+        granule_pos = b->packets[pkt].granulepos;
+        packet_just_done = ++packets_done;
+        pkt++;
+        if(pkt < b->num_packets)
+          remaining = b->packets[pkt].bytes;
+        }
+      else
+        {
+        packet_just_done = 0;
+        remaining -= 255;
+        }
+      }
+    if(vals == 255)
+      force = 1;
+    }
+
+  if(!force)
+    return 0;
+
+  /* Build header */
+
+  memcpy(h, "OggS", 4);
+  h[4] = 0x00;
+  h[5] = 0x00;
+
+  if(b->packets[0].started)
+    h[5] |= 0x01;
+  if(!b->b_o_s)
+    h[5] |= 0x02;
+  if(b->e_o_s && (b->num_segments == vals))
+    h[5] |= 0x04;
+  b->b_o_s = 1;
+
+  for(i = 6; i < 14; i++)
+    {
+    h[i] = granule_pos & 0xff;
+    granule_pos >>= 8;
+    }
+
+  h[14] = b->serialno & 0xff;
+  h[15] = (b->serialno >> 8) & 0xff;
+  h[16] = (b->serialno >> 16) & 0xff;
+  h[17] = (b->serialno >> 24) & 0xff;
+
+  h[18] = b->pageno & 0xff;
+  h[19] = (b->pageno >> 8) & 0xff;
+  h[20] = (b->pageno >> 16) & 0xff;
+  h[21] = (b->pageno >> 24) & 0xff;
+  b->pageno++;
+
+  h[22] = 0;
+  h[23] = 0;
+  h[24] = 0;
+  h[25] = 0;
+
+  /* Segment table, consuming the packets */
+
+  h[26] = vals;
+  done = 0;
+
+  for(i = 0; i < vals; i++)
+    {
+    bg_ogg_builder_packet_t * p = b->packets + done;
+
+    seg = p->bytes >= 255 ? 255 : p->bytes;
+    h[27 + i] = seg;
+    bytes += seg;
+
+    if(seg < 255)
+      done++;
+    else
+      {
+      p->bytes -= 255;
+      p->started = 1;
+      }
+    }
+
+  if(done)
+    {
+    b->num_packets -= done;
+    if(b->num_packets)
+      memmove(b->packets, b->packets + done,
+              b->num_packets * sizeof(*b->packets));
+    }
+  b->num_segments -= vals;
+
+  og->header = h;
+  og->header_len = vals + 27;
+  og->body = b->body.buf + b->body_returned;
+  og->body_len = bytes;
+
+  b->body_returned += bytes;
+
+  /* Checksum */
+  crc = bg_ogg_crc(0, og->header, og->header_len);
+  crc = bg_ogg_crc(crc, og->body, og->body_len);
+
+  h[22] = crc & 0xff;
+  h[23] = (crc >> 8) & 0xff;
+  h[24] = (crc >> 16) & 0xff;
+  h[25] = (crc >> 24) & 0xff;
+
+  return 1;
+  }
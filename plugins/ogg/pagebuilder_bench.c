@@ -0,0 +1,169 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Benchmark for the page builder (pagebuilder.c): CRC throughput of
+   a byte-wise table loop compared to bg_ogg_crc() and page building
+   with libogg compared to bg_ogg_builder_*() with FLAC sized packets.
+
+   Usage: pagebuilder_bench [megabytes] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include <gmerlin/plugin.h>
+
+#include "ogg_common.h"
+
+#define CRC_BUFFER   (64 * 1024)
+#define PACKET_BYTES 10650
+
+static uint32_t crc_table[256];
+
+static void init_table(void)
+  {
+  int i, j;
+  uint32_t r;
+  
+  for(i = 0; i < 256; i++)
+    {
+    r = i << 24;
+    for(j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+    crc_table[i] = r;
+    }
+  }
+
+static uint32_t crc_bytes(uint32_t crc, const uint8_t * data, int len)
+  {
+  while(len--)
+    crc = (crc << 8) ^ crc_table[(crc >> 24) ^ *(data++)];
+  return crc;
+  }
+
+static double mb_per_second(int64_t bytes, gavl_time_t t)
+  {
+  return (double)bytes / (double)(t ? t : 1) * GAVL_TIME_SCALE / 1.0e6;
+  }
+
+static void bench_crc(int64_t total, const uint8_t * data)
+  {
+  int i;
+  int num = total / CRC_BUFFER;
+  uint32_t crc1 = 0;
+  uint32_t crc2 = 0;
+  gavl_time_t t1, t2;
+  gavl_timer_t * timer = gavl_timer_create();
+
+  gavl_timer_start(timer);
+  for(i = 0; i < num; i++)
+    crc1 = crc_bytes(crc1, data, CRC_BUFFER);
+  t1 = gavl_timer_get(timer);
+  
+  for(i = 0; i < num; i++)
+    crc2 = bg_ogg_crc(crc2, data, CRC_BUFFER);
+  t2 = gavl_timer_get(timer) - t1;
+
+  if(crc1 != crc2)
+    fprintf(stderr, "CRC mismatch\n");
+  
+  printf("CRC byte table   %8.1f MB/s\n", mb_per_second((int64_t)num * CRC_BUFFER, t1));
+  printf("CRC bg_ogg_crc   %8.1f MB/s\n", mb_per_second((int64_t)num * CRC_BUFFER, t2));
+
+  gavl_timer_destroy(timer);
+  }
+
+static void bench_pages(int64_t total, uint8_t * data, int builder)
+  {
+  int i;
+  int num = total / PACKET_BYTES;
+  int64_t bytes = 0;
+  ogg_stream_state os;
+  bg_ogg_builder_t b;
+  ogg_packet op;
+  ogg_page og;
+  gavl_time_t t;
+  gavl_timer_t * timer = gavl_timer_create();
+
+  memset(&b, 0, sizeof(b));
+  ogg_stream_init(&os, 1);
+  bg_ogg_builder_init(&b, 1);
+
+  memset(&op, 0, sizeof(op));
+  op.packet = data;
+  op.bytes = PACKET_BYTES;
+  
+  gavl_timer_start(timer);
+
+  for(i = 0; i < num; i++)
+    {
+    op.granulepos = (int64_t)(i + 1) * 4096;
+    op.packetno = i;
+    
+    if(builder)
+      {
+      bg_ogg_builder_packetin(&b, &op);
+      while(bg_ogg_builder_pageout(&b, &og, 0, 4096))
+        bytes += og.header_len + og.body_len;
+      }
+    else
+      {
+      ogg_stream_packetin(&os, &op);
+      while(ogg_stream_pageout(&os, &og))
+        bytes += og.header_len + og.body_len;
+      }
+    }
+  t = gavl_timer_get(timer);
+
+  printf("Pages %-10s %8.1f MB/s\n", builder ? "builder" : "libogg",
+         mb_per_second(bytes, t));
+  
+  ogg_stream_clear(&os);
+  bg_ogg_builder_free(&b);
+  gavl_timer_destroy(timer);
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int64_t total = 1024;
+  uint8_t * data;
+
+  if(argc > 1)
+    total = atoi(argv[1]);
+  if(total < 1)
+    total = 1;
+  total *= 1024 * 1024;
+  
+  init_table();
+
+  data = malloc(CRC_BUFFER);
+  for(i = 0; i < CRC_BUFFER; i++)
+    data[i] = rand() & 0xff;
+  
+  bench_crc(total, data);
+  bench_pages(total, data, 0);
+  bench_pages(total, data, 1);
+
+  free(data);
+  return 0;
+  }
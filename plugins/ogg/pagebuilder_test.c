@@ -0,0 +1,272 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Check, that the page builder (pagebuilder.c) produces the same
+   pages as libogg. Random packet sequences are passed to both
+   bg_ogg_builder_packetin() and ogg_stream_packetin(). The pages
+   are taken out at random points with random fill sizes and must
+   be byte identical. The CRC functions are checked against a
+   byte-wise reference. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include <gmerlin/plugin.h>
+
+#include "ogg_common.h"
+
+#define NUM_SEQUENCES 200
+#define MAX_PACKET    (300 * 255)
+
+static uint32_t rng_state;
+
+static uint32_t rng(void)
+  {
+  /* xorshift32 */
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+  }
+
+/* Packet sizes around lacing boundaries are the interesting ones */
+
+static int packet_size(void)
+  {
+  switch(rng() % 5)
+    {
+    case 0:
+      return rng() % 64;
+    case 1:
+      return rng() % 4096;
+    case 2:
+      return (1 + rng() % 20) * 255 + (int)(rng() % 3) - 1;
+    case 3:
+      return rng() % 20000;
+    default:
+      return rng() % MAX_PACKET;
+    }
+  }
+
+static int fill_size(void)
+  {
+  switch(rng() % 3)
+    {
+    case 0:
+      return 4096;
+    case 1:
+      return rng() % 256;
+    default:
+      return rng() % 65536;
+    }
+  }
+
+/* Byte-wise CRC as in the Ogg specification */
+
+static uint32_t crc_ref(uint32_t crc, const uint8_t * data, int len)
+  {
+  int i;
+  while(len--)
+    {
+    crc ^= (uint32_t)(*(data++)) << 24;
+    for(i = 0; i < 8; i++)
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+    }
+  return crc;
+  }
+
+static int check_crc(void)
+  {
+  int i;
+  int len;
+  int split;
+  uint32_t crc;
+  uint8_t * buf = malloc(70000);
+
+  for(i = 0; i < 70000; i++)
+    buf[i] = rng() & 0xff;
+
+  for(i = 0; i < 2000; i++)
+    {
+    len = (i < 300) ? i : (int)(rng() % 70000);
+    split = len ? (int)(rng() % len) : 0;
+    
+    crc = bg_ogg_crc(0, buf, split);
+    crc = bg_ogg_crc(crc, buf + split, len - split);
+
+    if(crc != crc_ref(0, buf, len))
+      {
+      fprintf(stderr, "CRC mismatch for %d bytes (split at %d)\n", len, split);
+      free(buf);
+      return 0;
+      }
+    }
+  free(buf);
+  return 1;
+  }
+
+static int compare_page(const ogg_page * og1, const ogg_page * og2,
+                        int seq, int page)
+  {
+  if((og1->header_len != og2->header_len) ||
+     (og1->body_len != og2->body_len) ||
+     memcmp(og1->header, og2->header, og1->header_len) ||
+     memcmp(og1->body, og2->body, og1->body_len))
+    {
+    fprintf(stderr, "Sequence %d: Page %d differs\n", seq, page);
+    return 0;
+    }
+  return 1;
+  }
+
+/* Take pages out of both until libogg returns none. Returns the
+   number of pages or -1 if they differ */
+
+static int pageout(ogg_stream_state * os, bg_ogg_builder_t * b,
+                   int force, int nfill, int seq, int page)
+  {
+  int r1, r2;
+  int ret = 0;
+  ogg_page og1;
+  ogg_page og2;
+
+  while(1)
+    {
+    if(force)
+      r1 = ogg_stream_flush_fill(os, &og1, nfill);
+    else
+      r1 = ogg_stream_pageout_fill(os, &og1, nfill);
+
+    r2 = bg_ogg_builder_pageout(b, &og2, force, nfill);
+
+    if(r1 != r2)
+      {
+      fprintf(stderr, "Sequence %d: libogg returned %d, builder %d\n",
+              seq, r1, r2);
+      return -1;
+      }
+    if(!r1)
+      break;
+    if(!compare_page(&og1, &og2, seq, page + ret))
+      return -1;
+    ret++;
+    }
+  return ret;
+  }
+
+static int check_sequence(int seq, uint8_t * data, int * num_pages)
+  {
+  int i;
+  int result;
+  int num_packets;
+  int64_t granulepos = 0;
+  ogg_stream_state os;
+  bg_ogg_builder_t b;
+  ogg_packet op;
+  int ret = 0;
+
+  memset(&b, 0, sizeof(b));
+  
+  ogg_stream_init(&os, seq);
+  bg_ogg_builder_init(&b, seq);
+
+  num_packets = 1 + rng() % 200;
+
+  for(i = 0; i < num_packets; i++)
+    {
+    memset(&op, 0, sizeof(op));
+
+    op.bytes = packet_size();
+    op.packet = data + rng() % (MAX_PACKET - op.bytes + 1);
+    op.b_o_s = !i;
+    op.packetno = i;
+
+    /* Header packets have granulepos 0, some packets have none */
+    if(i > 2)
+      granulepos += rng() % 5000;
+    op.granulepos = (rng() % 8) ? granulepos : -1;
+
+    /* The last packet is marked either here or in the stream state */
+    if((i == num_packets - 1) && (seq & 1))
+      op.e_o_s = 1;
+    
+    ogg_stream_packetin(&os, &op);
+    bg_ogg_builder_packetin(&b, &op);
+
+    /* Like the muxer: Page out after each packet and sometimes
+       flush before keyframes or after the header packets */
+    if((result = pageout(&os, &b, !(rng() % 8), fill_size(),
+                         seq, *num_pages)) < 0)
+      goto fail;
+    *num_pages += result;
+    }
+
+  if(!(seq & 1))
+    {
+    os.e_o_s = 1;
+    b.e_o_s = 1;
+    }
+
+  if((result = pageout(&os, &b, 1, fill_size(), seq, *num_pages)) < 0)
+    goto fail;
+  *num_pages += result;
+  
+  ret = 1;
+  fail:
+  
+  ogg_stream_clear(&os);
+  bg_ogg_builder_free(&b);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int num_pages = 0;
+  uint8_t * data;
+  int ret = 0;
+
+  rng_state = 0x12345678;
+  
+  if(!check_crc())
+    return 1;
+
+  data = malloc(MAX_PACKET);
+  for(i = 0; i < MAX_PACKET; i++)
+    data[i] = rng() & 0xff;
+  
+  for(i = 0; i < NUM_SEQUENCES; i++)
+    {
+    if(!check_sequence(i, data, &num_pages))
+      {
+      ret = 1;
+      break;
+      }
+    }
+
+  if(!ret)
+    printf("%d sequences, %d pages identical\n", NUM_SEQUENCES, num_pages);
+  
+  free(data);
+  return ret;
+  }
@@ -0,0 +1,478 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Ogg Skeleton 4.0 with keypoint index. The fishead and index packets
+   are written with placeholder contents when the encoder starts and
+   overwritten in place on close. Since the packet sizes don't change,
+   libogg produces pages of identical sizes the second time. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <config.h>
+
+#include <gmerlin/translation.h>
+#include <gmerlin/plugin.h>
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "oggskeleton"
+
+#include <gavl/numptr.h>
+
+#include "ogg_common.h"
+
+/* Keypoints per stream. If there are more, every second one is dropped */
+#define MAX_KEYPOINTS  2048
+
+/* Reserved bytes per keypoint in the index packet. Keypoints are thinned
+   out on close if they don't fit */
+#define KEYPOINT_BYTES 8
+
+#define FISHEAD_SIZE       80
+#define FISBONE_HEADER_LEN 52
+#define INDEX_HEADER_LEN   42
+
+struct bg_ogg_skeleton_s
+  {
+  ogg_stream_state os;
+  long serialno;
+
+  int64_t fishead_pos;
+  int fishead_len;
+
+  int64_t headers_pos; /* Fisbone and index pages */
+  int64_t headers_end;
+
+  int64_t content_pos; /* First non-header page */
+  int64_t segment_end;
+
+  int index_size;      /* Size of each index packet */
+  int done;            /* Segment is finished */
+  };
+
+/* Write pages either to the encoder or into a buffer */
+
+static int flush_pages(bg_ogg_encoder_t * e, ogg_stream_state * os,
+                       gavl_buffer_t * buf)
+  {
+  ogg_page og;
+  memset(&og, 0, sizeof(og));
+
+  while(ogg_stream_flush(os, &og))
+    {
+    if(buf)
+      {
+      gavl_buffer_append_data(buf, og.header, og.header_len);
+      gavl_buffer_append_data(buf, og.body, og.body_len);
+      }
+    else if(!bg_ogg_encoder_write_page(e, &og))
+      return 0;
+    }
+  return 1;
+  }
+
+static void packetin(ogg_stream_state * os, uint8_t * data, int len,
+                     int64_t packetno)
+  {
+  ogg_packet op;
+  memset(&op, 0, sizeof(op));
+
+  op.packet = data;
+  op.bytes = len;
+  op.packetno = packetno;
+  op.b_o_s = !packetno;
+  ogg_stream_packetin(os, &op);
+  }
+
+static void create_fishead(bg_ogg_skeleton_t * sk, uint8_t * buf)
+  {
+  memset(buf, 0, FISHEAD_SIZE);
+  memcpy(buf, "fishead", 8);
+
+  GAVL_16LE_2_PTR(4, buf + 8);  /* Version major */
+  GAVL_16LE_2_PTR(0, buf + 10); /* Version minor */
+
+  /* Presentation time and base time */
+  GAVL_64LE_2_PTR(0,    buf + 12);
+  GAVL_64LE_2_PTR(1000, buf + 20);
+  GAVL_64LE_2_PTR(0,    buf + 28);
+  GAVL_64LE_2_PTR(1000, buf + 36);
+
+  /* UTC (20 bytes) is left empty */
+
+  if(sk->segment_end > sk->fishead_pos)
+    GAVL_64LE_2_PTR(sk->segment_end - sk->fishead_pos, buf + 64);
+  if(sk->content_pos > sk->fishead_pos)
+    GAVL_64LE_2_PTR(sk->content_pos - sk->fishead_pos, buf + 72);
+  }
+
+static uint8_t * create_fisbone(bg_ogg_stream_t * s, int video, int * len)
+  {
+  uint8_t * ret;
+  char * fields;
+  const char * content_type;
+  int preroll = 0;
+  gavl_compression_info_t ci;
+
+  gavl_compression_info_init(&ci);
+  gavl_stream_get_compression_info(&s->s, &ci);
+
+  switch(ci.id)
+    {
+    case GAVL_CODEC_ID_VORBIS:
+      content_type = "audio/vorbis";
+      preroll = 2;
+      break;
+    case GAVL_CODEC_ID_OPUS:
+      content_type = "audio/opus";
+      preroll = 3840; /* 80 ms */
+      break;
+    case GAVL_CODEC_ID_FLAC:
+      content_type = "audio/flac";
+      break;
+    case GAVL_CODEC_ID_THEORA:
+      content_type = "video/theora";
+      break;
+    default:
+      content_type = "application/octet-stream";
+      break;
+    }
+  gavl_compression_info_free(&ci);
+
+  fields = gavl_sprintf("Content-Type: %s\r\nRole: %s\r\n",
+                        content_type, video ? "video/main" : "audio/main");
+
+  *len = FISBONE_HEADER_LEN + strlen(fields);
+  ret = calloc(1, *len);
+
+  memcpy(ret, "fisbone", 8);
+  GAVL_32LE_2_PTR(FISBONE_HEADER_LEN - 8, ret + 8);
+  GAVL_32LE_2_PTR(s->serialno,   ret + 12);
+  GAVL_32LE_2_PTR(s->num_headers,   ret + 16);
+  GAVL_64LE_2_PTR(s->granule_rate,  ret + 20);
+  GAVL_64LE_2_PTR(1,                ret + 28); /* Granulerate denominator */
+  GAVL_64LE_2_PTR(0,                ret + 36); /* Basegranule */
+  GAVL_32LE_2_PTR(preroll,          ret + 44);
+  /* Granuleshift and padding stay 0 */
+
+  memcpy(ret + FISBONE_HEADER_LEN, fields, strlen(fields));
+  free(fields);
+  return ret;
+  }
+
+/* Skeleton variable length integers: 7 bits per byte, least
+   significant first, the high bit marks the last byte */
+
+static int write_varint(uint8_t * ptr, uint64_t n)
+  {
+  int len = 0;
+  while(n > 0x7f)
+    {
+    ptr[len++] = n & 0x7f;
+    n >>= 7;
+    }
+  ptr[len++] = n | 0x80;
+  return len;
+  }
+
+/* Returns 0 if the keypoints don't fit into the reserved space */
+
+static int create_index(bg_ogg_stream_t * s, uint8_t * buf, int size)
+  {
+  int i, len;
+  uint8_t tmp[20];
+  uint8_t * ptr;
+  int64_t last_offset = 0;
+  int64_t last_granule = 0;
+
+  memset(buf, 0, size);
+  memcpy(buf, "index", 6);
+
+  GAVL_32LE_2_PTR(s->serialno,        buf + 6);
+  GAVL_64LE_2_PTR(s->num_keypoints,      buf + 10);
+  GAVL_64LE_2_PTR(s->granule_rate,       buf + 18);
+  GAVL_64LE_2_PTR(s->index_first_granule, buf + 26);
+  GAVL_64LE_2_PTR(s->index_last_granule,  buf + 34);
+
+  ptr = buf + INDEX_HEADER_LEN;
+
+  for(i = 0; i < s->num_keypoints; i++)
+    {
+    len = write_varint(tmp, s->keypoints[i].offset - last_offset);
+    len += write_varint(tmp + len, s->keypoints[i].granule - last_granule);
+
+    if(ptr + len > buf + size)
+      return 0;
+
+    memcpy(ptr, tmp, len);
+    ptr += len;
+    last_offset = s->keypoints[i].offset;
+    last_granule = s->keypoints[i].granule;
+    }
+  return 1;
+  }
+
+static void thin_keypoints(bg_ogg_stream_t * s)
+  {
+  int i;
+  for(i = 1; 2 * i < s->num_keypoints; i++)
+    s->keypoints[i] = s->keypoints[2 * i];
+  s->num_keypoints = (s->num_keypoints + 1) / 2;
+  s->keypoint_interval *= 2;
+  }
+
+static void add_fisbones(bg_ogg_encoder_t * e, ogg_stream_state * os,
+                         int64_t * packetno)
+  {
+  int i, len;
+  uint8_t * buf;
+
+  for(i = 0; i < e->num_video_streams; i++)
+    {
+    buf = create_fisbone(&e->video_streams[i], 1, &len);
+    packetin(os, buf, len, (*packetno)++);
+    free(buf);
+    }
+  for(i = 0; i < e->num_audio_streams; i++)
+    {
+    buf = create_fisbone(&e->audio_streams[i], 0, &len);
+    packetin(os, buf, len, (*packetno)++);
+    free(buf);
+    }
+  }
+
+static void add_index(bg_ogg_encoder_t * e, bg_ogg_stream_t * s,
+                      ogg_stream_state * os, int64_t * packetno)
+  {
+  uint8_t * buf = malloc(e->skeleton->index_size);
+
+  while(!create_index(s, buf, e->skeleton->index_size))
+    thin_keypoints(s);
+
+  packetin(os, buf, e->skeleton->index_size, (*packetno)++);
+  free(buf);
+  }
+
+static void add_indices(bg_ogg_encoder_t * e, ogg_stream_state * os,
+                        int64_t * packetno)
+  {
+  int i;
+  for(i = 0; i < e->num_video_streams; i++)
+    add_index(e, &e->video_streams[i], os, packetno);
+  for(i = 0; i < e->num_audio_streams; i++)
+    add_index(e, &e->audio_streams[i], os, packetno);
+  }
+
+static void init_index(bg_ogg_stream_t * s)
+  {
+  s->num_keypoints = 0;
+  s->keypoint_interval = s->granule_rate;
+  s->index_first_granule = 0;
+  s->index_last_granule = 0;
+  }
+
+int bg_ogg_skeleton_start(bg_ogg_encoder_t * e)
+  {
+  uint8_t fishead[FISHEAD_SIZE];
+  bg_ogg_skeleton_t * sk;
+
+  sk = calloc(1, sizeof(*sk));
+  e->skeleton = sk;
+
+  sk->serialno = e->serialno++;
+  ogg_stream_init(&sk->os, sk->serialno);
+
+  sk->fishead_pos = bg_ogg_encoder_position(e);
+
+  create_fishead(sk, fishead);
+  packetin(&sk->os, fishead, FISHEAD_SIZE, 0);
+
+  if(!flush_pages(e, &sk->os, NULL))
+    return 0;
+
+  sk->fishead_len = bg_ogg_encoder_position(e) - sk->fishead_pos;
+  return 1;
+  }
+
+/* Called after all BOS pages are written */
+
+int bg_ogg_skeleton_write_headers(bg_ogg_encoder_t * e)
+  {
+  int i;
+  int64_t packetno = 1;
+  bg_ogg_skeleton_t * sk = e->skeleton;
+
+  for(i = 0; i < e->num_video_streams; i++)
+    init_index(&e->video_streams[i]);
+  for(i = 0; i < e->num_audio_streams; i++)
+    init_index(&e->audio_streams[i]);
+
+  sk->index_size = INDEX_HEADER_LEN + MAX_KEYPOINTS * KEYPOINT_BYTES;
+
+  add_fisbones(e, &sk->os, &packetno);
+  add_indices(e, &sk->os, &packetno);
+
+  sk->headers_pos = bg_ogg_encoder_position(e);
+  if(!flush_pages(e, &sk->os, NULL))
+    return 0;
+  sk->headers_end = bg_ogg_encoder_position(e);
+  return 1;
+  }
+
+/* Called after the header pages of all streams are written */
+
+int bg_ogg_skeleton_finish_headers(bg_ogg_encoder_t * e)
+  {
+  ogg_packet op;
+  bg_ogg_skeleton_t * sk = e->skeleton;
+
+  memset(&op, 0, sizeof(op));
+  op.e_o_s = 1;
+  op.packetno = 1 + 2 * (e->num_audio_streams + e->num_video_streams);
+  ogg_stream_packetin(&sk->os, &op);
+
+  if(!flush_pages(e, &sk->os, NULL))
+    return 0;
+
+  sk->content_pos = bg_ogg_encoder_position(e);
+  return 1;
+  }
+
+void bg_ogg_skeleton_add_page(bg_ogg_encoder_t * e,
+                              const bg_ogg_page_t * p,
+                              int64_t position)
+  {
+  bg_ogg_keypoint_t * kp;
+  bg_ogg_stream_t * s = p->s;
+
+  if(e->skeleton->done)
+    return;
+
+  if(p->granulepos != -1)
+    s->index_last_granule = p->granulepos;
+
+  if(!p->keypoint)
+    return;
+
+  if(s->num_keypoints)
+    {
+    if(s->num_keypoints == MAX_KEYPOINTS)
+      thin_keypoints(s);
+
+    if(p->start_granule - s->keypoints[s->num_keypoints-1].granule <
+       s->keypoint_interval)
+      return;
+    }
+  else
+    {
+    if(!s->keypoints)
+      s->keypoints = malloc(MAX_KEYPOINTS * sizeof(*s->keypoints));
+    s->index_first_granule = p->start_granule;
+    }
+
+  kp = s->keypoints + s->num_keypoints;
+  kp->offset = position - e->skeleton->fishead_pos;
+  kp->granule = p->start_granule;
+  s->num_keypoints++;
+  }
+
+void bg_ogg_skeleton_end_segment(bg_ogg_encoder_t * e)
+  {
+  if(e->skeleton->done)
+    return;
+  e->skeleton->segment_end = bg_ogg_encoder_position(e);
+  e->skeleton->done = 1;
+  }
+
+static int overwrite(bg_ogg_encoder_t * e, int64_t pos,
+                     const gavl_buffer_t * buf, int64_t len)
+  {
+  if(buf->len != len)
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN,
+             "Skeleton pages changed size (%d != %"PRId64")", buf->len, len);
+    return 0;
+    }
+
+  if((gavl_io_seek(e->io, pos, SEEK_SET) != pos) ||
+     (gavl_io_write_data(e->io, buf->buf, buf->len) < buf->len))
+    {
+    gavl_log(GAVL_LOG_ERROR, LOG_DOMAIN, "Writing skeleton index failed");
+    return 0;
+    }
+  return 1;
+  }
+
+int bg_ogg_skeleton_finalize(bg_ogg_encoder_t * e)
+  {
+  int ret = 0;
+  int64_t end_pos;
+  int64_t packetno = 0;
+  uint8_t fishead[FISHEAD_SIZE];
+  gavl_buffer_t buf;
+  ogg_stream_state os;
+  bg_ogg_skeleton_t * sk = e->skeleton;
+
+  if(!bg_ogg_encoder_flush_output(e))
+    return 0;
+
+  end_pos = gavl_io_position(e->io);
+
+  if(!sk->done)
+    sk->segment_end = end_pos;
+
+  /* Build the skeleton header pages again with the final contents */
+
+  gavl_buffer_init(&buf);
+  ogg_stream_init(&os, sk->serialno);
+
+  create_fishead(sk, fishead);
+  packetin(&os, fishead, FISHEAD_SIZE, packetno++);
+  flush_pages(e, &os, &buf);
+
+  if(!overwrite(e, sk->fishead_pos, &buf, sk->fishead_len))
+    goto fail;
+
+  buf.len = 0;
+  add_fisbones(e, &os, &packetno);
+  add_indices(e, &os, &packetno);
+  flush_pages(e, &os, &buf);
+
+  if(!overwrite(e, sk->headers_pos, &buf, sk->headers_end - sk->headers_pos))
+    goto fail;
+
+  ret = 1;
+
+  fail:
+
+  gavl_io_seek(e->io, end_pos, SEEK_SET);
+
+  ogg_stream_clear(&os);
+  gavl_buffer_free(&buf);
+  return ret;
+  }
+
+void bg_ogg_skeleton_destroy(bg_ogg_encoder_t * e)
+  {
+  ogg_stream_clear(&e->skeleton->os);
+  free(e->skeleton);
+  e->skeleton = NULL;
+  }
@@ -270,6 +270,29 @@ static int flush_data(vorbis_t * vorbis, int force)
   return 1;
   }
 
+/* Let the caller write directly into the analysis buffer */
+
+static gavl_audio_frame_t * get_audio_frame_vorbis(void * data)
+  {
+  int i;
+  vorbis_t * vorbis;
+  float **buffer;
+  
+  vorbis = data;
+
+  if(!vorbis->format->samples_per_frame)
+    return NULL;
+  
+  buffer = vorbis_analysis_buffer(&vorbis->enc_vd,
+                                  vorbis->format->samples_per_frame);
+  
+  for(i = 0; i < vorbis->format->num_channels; i++)
+    vorbis->frame->channels.f[i] = buffer[i];
+  
+  vorbis->frame->valid_samples = 0;
+  return vorbis->frame;
+  }
+
 static gavl_sink_status_t
 write_audio_frame_vorbis(void * data, gavl_audio_frame_t * frame)
   {
@@ -279,16 +302,20 @@ write_audio_frame_vorbis(void * data, gavl_audio_frame_t * frame)
      
   vorbis = data;
 
-  buffer = vorbis_analysis_buffer(&vorbis->enc_vd, frame->valid_samples);
-
-  for(i = 0; i < vorbis->format->num_channels; i++)
+  /* Frames from get_audio_frame_vorbis() are already in place */
+  if(frame != vorbis->frame)
     {
-    vorbis->frame->channels.f[i] = buffer[i];
+    buffer = vorbis_analysis_buffer(&vorbis->enc_vd, frame->valid_samples);
+
+    for(i = 0; i < vorbis->format->num_channels; i++)
+      {
+      vorbis->frame->channels.f[i] = buffer[i];
+      }
+    gavl_audio_frame_copy(vorbis->format,
+                          vorbis->frame,
+                          frame,
+                          0, 0, frame->valid_samples, frame->valid_samples);
     }
-  gavl_audio_frame_copy(vorbis->format,
-                        vorbis->frame,
-                        frame,
-                        0, 0, frame->valid_samples, frame->valid_samples);
   vorbis_analysis_wrote(&vorbis->enc_vd, frame->valid_samples);
   if(flush_data(vorbis, 0) < 0)
     return GAVL_SINK_ERROR;
@@ -381,7 +408,8 @@ static gavl_audio_sink_t * init_vorbis(void * data,
   gavl_stream_set_compression_info(s, &ci);
   gavl_compression_info_free(&ci);
     
-  return gavl_audio_sink_create(NULL, write_audio_frame_vorbis,
+  return gavl_audio_sink_create(get_audio_frame_vorbis,
+                                write_audio_frame_vorbis,
                                 vorbis, vorbis->format);
   }
 
@@ -0,0 +1,253 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2024 Members of the Gmerlin project
+ * http://github.com/bplaum
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/* Encoder thread for one stream. The frames passed by the application
+   go through a bgen_frame_queue_t to the codec, which runs in its own
+   thread. The packets produced by the codec are collected and passed
+   to the muxer from the application thread. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gmerlin/plugin.h>
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "oggworker"
+
+#include <gmerlin_encoders.h>
+#include "ogg_common.h"
+
+typedef struct
+  {
+  gavl_packet_t * packets;
+  int num;
+  int alloc;
+  } packet_queue_t;
+
+struct bg_ogg_worker_s
+  {
+  bg_ogg_stream_t * s;
+
+  bgen_frame_queue_t * fq;
+
+  /* Sinks of the frame queue */
+  gavl_audio_sink_t * fq_asink;
+  gavl_video_sink_t * fq_vsink;
+
+  /* Sinks for the application */
+  gavl_audio_sink_t * asink;
+  gavl_video_sink_t * vsink;
+
+  /* Packets coming from the codec. The codec thread writes into
+     one queue while the other one is passed to the muxer */
+  pthread_mutex_t mutex;
+  gavl_packet_sink_t * psink;
+  packet_queue_t pq[2];
+  int cur;
+  };
+
+static gavl_audio_frame_t * get_audio_func(void * data)
+  {
+  bg_ogg_worker_t * w = data;
+  return gavl_audio_sink_get_frame(w->fq_asink);
+  }
+
+static gavl_video_frame_t * get_video_func(void * data)
+  {
+  bg_ogg_worker_t * w = data;
+  return gavl_video_sink_get_frame(w->fq_vsink);
+  }
+
+/* Pass the packets, which the codec produced so far, after
+   each frame */
+
+static gavl_sink_status_t put_audio_func(void * data, gavl_audio_frame_t * f)
+  {
+  gavl_sink_status_t st;
+  bg_ogg_worker_t * w = data;
+
+  if((st = gavl_audio_sink_put_frame(w->fq_asink, f)) != GAVL_SINK_OK)
+    return st;
+  return bg_ogg_encoder_drain_workers(w->s->enc) ? GAVL_SINK_OK : GAVL_SINK_ERROR;
+  }
+
+static gavl_sink_status_t put_video_func(void * data, gavl_video_frame_t * f)
+  {
+  gavl_sink_status_t st;
+  bg_ogg_worker_t * w = data;
+
+  if((st = gavl_video_sink_put_frame(w->fq_vsink, f)) != GAVL_SINK_OK)
+    return st;
+  return bg_ogg_encoder_drain_workers(w->s->enc) ? GAVL_SINK_OK : GAVL_SINK_ERROR;
+  }
+
+/* Called from the codec (thread) */
+
+static gavl_sink_status_t put_packet_func(void * data, gavl_packet_t * p)
+  {
+  packet_queue_t * q;
+  gavl_packet_t * dst;
+  gavl_buffer_t buf;
+  bg_ogg_worker_t * w = data;
+
+  pthread_mutex_lock(&w->mutex);
+
+  q = &w->pq[w->cur];
+
+  if(q->num == q->alloc)
+    {
+    q->alloc += 16;
+    q->packets = realloc(q->packets, q->alloc * sizeof(*q->packets));
+    memset(q->packets + q->num, 0, (q->alloc - q->num) * sizeof(*q->packets));
+    }
+
+  dst = &q->packets[q->num];
+
+  /* Packets owning their buffer are moved: The codec gets back the
+     (emptied) buffer of the queue entry. Packets pointing into the
+     memory of the codec (libvorbis, opus, libFLAC) must be copied. */
+  if(p->buf.alloc)
+    {
+    buf = dst->buf;
+    gavl_packet_copy_metadata(dst, p);
+    dst->buf = p->buf;
+    p->buf = buf;
+    p->buf.len = 0;
+    }
+  else
+    gavl_packet_copy(dst, p);
+  
+  q->num++;
+
+  pthread_mutex_unlock(&w->mutex);
+  return GAVL_SINK_OK;
+  }
+
+bg_ogg_worker_t * bg_ogg_worker_create(bg_ogg_stream_t * s)
+  {
+  bg_ogg_worker_t * w = calloc(1, sizeof(*w));
+
+  w->s = s;
+
+  pthread_mutex_init(&w->mutex, NULL);
+
+  if(s->asink)
+    {
+    if(!(w->fq = bgen_frame_queue_create_audio(s->asink)))
+      goto fail;
+    w->fq_asink = bgen_frame_queue_get_audio_sink(w->fq);
+    w->asink = gavl_audio_sink_create(get_audio_func, put_audio_func, w,
+                                      gavl_audio_sink_get_format(s->asink));
+    }
+  else
+    {
+    if(!(w->fq = bgen_frame_queue_create_video(s->vsink)))
+      goto fail;
+    w->fq_vsink = bgen_frame_queue_get_video_sink(w->fq);
+    w->vsink = gavl_video_sink_create(get_video_func, put_video_func, w,
+                                      gavl_video_sink_get_format(s->vsink));
+    }
+
+  w->psink = gavl_packet_sink_create(NULL, put_packet_func, w);
+  return w;
+
+  fail:
+  bg_ogg_worker_destroy(w);
+  return NULL;
+  }
+
+gavl_audio_sink_t * bg_ogg_worker_get_audio_sink(bg_ogg_worker_t * w)
+  {
+  return w->asink;
+  }
+
+gavl_video_sink_t * bg_ogg_worker_get_video_sink(bg_ogg_worker_t * w)
+  {
+  return w->vsink;
+  }
+
+gavl_packet_sink_t * bg_ogg_worker_get_packet_sink(bg_ogg_worker_t * w)
+  {
+  return w->psink;
+  }
+
+/* Pass the collected packets to the muxer */
+
+int bg_ogg_worker_drain(bg_ogg_worker_t * w)
+  {
+  int i;
+  int ret = 1;
+  packet_queue_t * q;
+
+  pthread_mutex_lock(&w->mutex);
+  q = &w->pq[w->cur];
+  w->cur ^= 1;
+  pthread_mutex_unlock(&w->mutex);
+
+  for(i = 0; i < q->num; i++)
+    {
+    if(gavl_packet_sink_put_packet(w->s->psink_out, &q->packets[i]) != GAVL_SINK_OK)
+      ret = 0;
+    }
+  q->num = 0;
+  return ret;
+  }
+
+/* Wait until all queued frames are encoded */
+
+int bg_ogg_worker_sync(bg_ogg_worker_t * w)
+  {
+  return bgen_frame_queue_sync(w->fq);
+  }
+
+/* Encode the remaining frames and terminate the thread */
+
+int bg_ogg_worker_finish(bg_ogg_worker_t * w)
+  {
+  return bgen_frame_queue_finish(w->fq);
+  }
+
+void bg_ogg_worker_destroy(bg_ogg_worker_t * w)
+  {
+  int i, j;
+
+  if(w->fq)
+    bgen_frame_queue_destroy(w->fq);
+
+  if(w->asink)
+    gavl_audio_sink_destroy(w->asink);
+  if(w->vsink)
+    gavl_video_sink_destroy(w->vsink);
+  if(w->psink)
+    gavl_packet_sink_destroy(w->psink);
+
+  for(i = 0; i < 2; i++)
+    {
+    for(j = 0; j < w->pq[i].alloc; j++)
+      gavl_packet_free(&w->pq[i].packets[j]);
+    if(w->pq[i].packets)
+      free(w->pq[i].packets);
+    }
+
+  pthread_mutex_destroy(&w->mutex);
+  free(w);
+  }